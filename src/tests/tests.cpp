@@ -1,17 +1,57 @@
 #include <tree_bitset/tree_bitset.hpp>
+#include <tree_bitset/mapped_memory_resource.hpp>
+#include <tree_bitset/concurrent_tree_bitset.hpp>
+#include <tree_bitset/sharded_tree_bitset.hpp>
+#include <tree_bitset/magazine_tree_bitset.hpp>
+#include <tree_bitset/entity_allocator.hpp>
+#include <tree_bitset/sparse_tree_bitset.hpp>
 
 #include <array>
 #include <vector>
 #include <algorithm>
+#include <numeric>
 #include <random>
 #include <unordered_set>
 #include <tuple>
+#include <iterator>
+#include <string>
+#include <cstdio>
+#include <memory_resource>
+#include <chrono>
+#include <filesystem>
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#endif
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
 
 #define CATCH_CONFIG_ENABLE_BENCHMARKING
 #include "catch_amalgamated.hpp"
 
 using namespace treebitset;
 
+// Resident set size of the process in bytes or 0 where we can't read it
+size_t resident_memory()
+{
+  size_t total_pages = 0, resident_pages = 0;
+#if defined(__linux__)
+  if(FILE * statm = fopen("/proc/self/statm", "r"))
+  {
+    if(fscanf(statm, "%zu %zu", &total_pages, &resident_pages) != 2)
+      resident_pages = 0;
+    fclose(statm);
+  }
+#endif
+  return resident_pages * sysconf(_SC_PAGESIZE);
+}
+
 auto get_seed()
 {
   std::random_device::result_type seed = std::random_device{}();
@@ -23,11 +63,34 @@ std::mt19937 g{get_seed()};
 
 const std::array max_elements_exp_vals = {6, 7, 12, 13};
 
-template <typename BlockT = std::uint64_t>
-inline std::tuple<TreeBitset<TreeBitsetConfig<BlockT>>, std::vector<bool>> prepare_random_data(
+// Default policies with some of them overridden
+template <auto... Overrides>
+struct PoliciesWith
+{
+  template <typename Policy>
+  constexpr static Policy get()
+  {
+    Policy result = TreeBitsetPoliciesBuilder::default_::template get<Policy>();
+    ((result = override_policy(result, Overrides)), ...);
+    return result;
+  }
+
+private:
+  template <typename Policy, typename Override>
+  constexpr static Policy override_policy(const Policy current, const Override value)
+  {
+    if constexpr(std::is_same_v<Policy, Override>)
+      return value;
+    else
+      return current;
+  }
+};
+
+template <typename BlockT = std::uint64_t, typename Policies = TreeBitsetPoliciesBuilder::default_>
+inline std::tuple<TreeBitset<TreeBitsetConfig<BlockT, Policies>>, std::vector<bool>> prepare_random_data(
   const size_t num_elements_exp, const size_t max_elements_divider)
 {
-  auto result = std::make_tuple(TreeBitset<TreeBitsetConfig<BlockT>>{num_elements_exp},
+  auto result = std::make_tuple(TreeBitset<TreeBitsetConfig<BlockT, Policies>>{num_elements_exp},
                                 std::vector<bool>(size_t{1} << num_elements_exp, true));
 
   auto & tb     = std::get<0>(result);
@@ -77,10 +140,31 @@ TEST_CASE("Tree configuration", "[properties]")
     TreeBitset tb{13};
     REQUIRE(tb.num_metadata_levels() == 2);
     REQUIRE(tb.num_element_blocks() == 128);
-    REQUIRE(tb.num_metadata_blocks() == 1 + 64);
+    // Only the nodes of the existing root children are stored on the last level
+    REQUIRE(tb.num_metadata_blocks() == 1 + 2);
     REQUIRE(tb.max_elements() == 64 * 64 * 2);
   }
 
+  SECTION("TreeBitset<uint64_t> with 100 elements")
+  {
+    TreeBitset tb{MaxElements{100}};
+    REQUIRE(tb.num_metadata_levels() == 1);
+    REQUIRE(tb.num_element_blocks() == 2);
+    REQUIRE(tb.num_metadata_blocks() == 1);
+    REQUIRE(tb.max_elements() == 100);
+  }
+
+  SECTION("TreeBitset<uint64_t> with 600M elements")
+  {
+    TreeBitset tb{MaxElements{600'000'000}};
+    REQUIRE(tb.num_metadata_levels() == 4);
+    REQUIRE(tb.num_element_blocks() == 9'375'000);
+    REQUIRE(tb.num_metadata_blocks() == 1 + 64 + 4096 + 146'485);
+    REQUIRE(tb.memory_footprint() == (9'375'000 + 150'646) * sizeof(uint64_t));
+    REQUIRE(TreeBitset<>::required_blocks(MaxElements{size_t{1} << 30}) * sizeof(uint64_t) ==
+            tb.memory_footprint() + 60'143'000);
+  }
+
   // we don't support uint8_t for now, since it doesn't support all max_elements_exp_vals ^_~. need to
   // accomodate to it
   //SECTION("TreeBitset<uint8_t> with 2^7 elements")
@@ -115,6 +199,38 @@ TEMPLATE_TEST_CASE("TreeBitset (un)set random 1/2", "[set]", uint16_t, uint32_t,
   }
 }
 
+TEMPLATE_TEST_CASE("TreeBitset (un)set random ranges", "[set]", uint16_t, uint32_t, uint64_t)
+{
+  for(const size_t max_elements_exp : max_elements_exp_vals)
+  {
+    TreeBitset<TreeBitsetConfig<TestType>> tb{max_elements_exp};
+    TreeBitset<TreeBitsetConfig<TestType>> expected{max_elements_exp};
+
+    const size_t max_elements = tb.max_elements();
+    for(size_t step = 0; step < 64; ++step)
+    {
+      size_t     min_id = g() & (max_elements - 1);
+      size_t     max_id = g() & (max_elements - 1);
+      const bool value  = g() & 1;
+      if(min_id > max_id)
+        std::swap(min_id, max_id);
+      INFO("range: [" << min_id << ", " << max_id << "] = " << value);
+
+      tb.set_free_for_range(min_id, max_id, value);
+      for(size_t id = min_id; id <= max_id; ++id)
+        expected.set_free(id, value);
+      REQUIRE(tb == expected);
+      REQUIRE(tb.max_used_id() == expected.max_used_id());
+    }
+
+    tb.set_free_for_range(0, max_elements - 1, false);
+    REQUIRE(tb.obtain_id() == decltype(tb)::invalid_id);
+    tb.set_free_for_range(0, max_elements - 1, true);
+    REQUIRE(tb.max_used_id() == decltype(tb)::invalid_id);
+    REQUIRE(tb.obtain_id() == 0);
+  }
+}
+
 TEMPLATE_TEST_CASE("TreeBitset ordered obtain", "[obtain]", uint16_t, uint32_t, uint64_t)
 {
   for(const size_t max_elements_exp : max_elements_exp_vals)
@@ -141,277 +257,2736 @@ TEMPLATE_TEST_CASE("TreeBitset ordered obtain", "[obtain]", uint16_t, uint32_t,
   }
 }
 
-TEMPLATE_TEST_CASE("Invalid max_id by default", "[max_id]", uint16_t, uint32_t, uint64_t)
-{
-  TreeBitset<TreeBitsetConfig<TestType>> tb{2};
-  REQUIRE(decltype(tb)::invalid_id == tb.max_used_id());
-}
-
-TEMPLATE_TEST_CASE("Determines max_id after unsetting random 1/2", "[max_id]", uint16_t, uint32_t, uint64_t)
+TEMPLATE_TEST_CASE("TreeBitset bulk obtain", "[obtain]", uint16_t, uint32_t, uint64_t)
 {
   for(const size_t max_elements_exp : max_elements_exp_vals)
   {
     auto [tb, bitset] = prepare_random_data<TestType>(max_elements_exp, 2);
-    for(auto it = crbegin(bitset); it != crend(bitset); ++it)
-    {
-      if(*it == false)
-      {
-        const size_t max_id = size(bitset) - std::distance(crbegin(bitset), it) - 1;
-        REQUIRE(tb.max_used_id() == max_id);
-        break;
-      }
-    }
-  }
-}
 
-TEMPLATE_TEST_CASE(
-  "Determines max_id after obtaining 1/2 elements at each step", "[max_id]", uint16_t, uint32_t, uint64_t)
-{
-  for(const size_t max_elements_exp : max_elements_exp_vals)
-  {
-    TreeBitset<TreeBitsetConfig<TestType>> tb{max_elements_exp};
-    for(size_t idx = 0; idx < tb.max_elements() / 2; ++idx)
+    std::vector<size_t> free_ids;
+    for(size_t idx = 0; idx < size(bitset); ++idx)
+      if(bitset[idx])
+        free_ids.emplace_back(idx);
+
+    const size_t n_first = free_ids.size() / 3;
+    const size_t n_rest  = free_ids.size() - n_first;
+
+    std::vector<size_t> obtained;
+    REQUIRE(tb.obtain_ids(n_first, std::back_inserter(obtained)) == n_first);
+    REQUIRE(tb.obtain_ids(tb.max_elements(), std::back_inserter(obtained)) == n_rest);
+    REQUIRE(obtained == free_ids);
+
+    for(size_t idx = 0; idx < tb.max_elements(); ++idx)
+      REQUIRE_FALSE(tb.is_free(idx));
+    REQUIRE(tb.max_used_id() == tb.max_elements() - 1);
+    REQUIRE(tb.obtain_ids(1, std::back_inserter(obtained)) == 0);
+    REQUIRE(tb.obtain_id() == decltype(tb)::invalid_id);
+
+    SECTION("freed ids can be obtained again")
     {
-      const size_t new_id = tb.obtain_id();
-      REQUIRE(tb.max_used_id() == new_id);
+      tb.set_free(free_ids.front(), true);
+      tb.set_free(free_ids.back(), true);
+      obtained.clear();
+      REQUIRE(tb.obtain_ids(3, std::back_inserter(obtained)) == 2);
+      REQUIRE(obtained == std::vector<size_t>{free_ids.front(), free_ids.back()});
     }
   }
 }
 
-TEMPLATE_TEST_CASE("Determines max_id after obtaining 1/2 elements and freeing max element at each step",
-                   "[max_id]",
-                   uint16_t,
-                   uint32_t,
-                   uint64_t)
+TEMPLATE_TEST_CASE("TreeBitset obtain near a hint", "[obtain]", uint16_t, uint32_t, uint64_t)
 {
   for(const size_t max_elements_exp : max_elements_exp_vals)
   {
-    TreeBitset<TreeBitsetConfig<TestType>> tb{max_elements_exp};
-    for(size_t idx = 0; idx < tb.max_elements() / 2; ++idx)
+    auto [tb, bitset] = prepare_random_data<TestType>(max_elements_exp, 2);
+
+    const size_t n_free = std::count(begin(bitset), end(bitset), true);
+    for(size_t i = 0; i < n_free; ++i)
     {
-      const size_t new_id = tb.obtain_id();
-      REQUIRE(tb.max_used_id() == new_id);
-      tb.set_free(new_id, true);
-      if(idx == 0)
-        REQUIRE(tb.max_used_id() == decltype(tb)::invalid_id);
-      else
-        REQUIRE(tb.max_used_id() == new_id - 1);
-      // reobtain ID
-      tb.obtain_id();
+      const size_t hint = g() & (tb.max_elements() - 1);
+      INFO("hint: " << hint);
+      auto expected = std::find(begin(bitset) + hint, end(bitset), true);
+      if(expected == end(bitset))
+        expected = std::find(std::make_reverse_iterator(begin(bitset) + hint), rend(bitset), true).base() - 1;
+
+      const size_t id = tb.obtain_id_near(hint);
+      REQUIRE(id == static_cast<size_t>(std::distance(begin(bitset), expected)));
+      bitset[id] = false;
+      REQUIRE_FALSE(tb.is_free(id));
     }
+
+    REQUIRE(tb.obtain_id_near(0) == decltype(tb)::invalid_id);
+    REQUIRE(tb.obtain_id_near(tb.max_elements() - 1) == decltype(tb)::invalid_id);
   }
 }
 
-TEMPLATE_TEST_CASE("Determines max_id at each step while freeing IDs from max to min",
-                   "[max_id]",
-
-                   uint16_t,
-                   uint32_t,
-                   uint64_t)
+TEMPLATE_TEST_CASE("Successor and predecessor queries", "[find]", uint16_t, uint32_t, uint64_t)
 {
   for(const size_t max_elements_exp : max_elements_exp_vals)
   {
-    auto [tb, bitset] = prepare_random_data<TestType>(max_elements_exp, 2);
+    auto [tb, bitset] = prepare_random_data<TestType>(max_elements_exp, 8);
 
-    for(auto it = crbegin(bitset); it != crend(bitset); ++it)
+    const size_t invalid_id = decltype(tb)::invalid_id;
+    const size_t n          = size(bitset);
+    auto         find_next  = [&](const size_t id, const bool free) {
+      const auto it = std::find(begin(bitset) + id, end(bitset), free);
+      return it != end(bitset) ? static_cast<size_t>(std::distance(begin(bitset), it)) : invalid_id;
+    };
+    auto find_prev = [&](const size_t id, const bool free) {
+      const auto it = std::find(std::make_reverse_iterator(begin(bitset) + id + 1), rend(bitset), free);
+      return it != rend(bitset) ? std::distance(begin(bitset), it.base()) - size_t{1} : invalid_id;
+    };
+
+    for(size_t id = 0; id < n; ++id)
     {
-      if(*it == false)
-      {
-        const size_t max_id = size(bitset) - std::distance(crbegin(bitset), it) - 1;
-        REQUIRE(tb.max_used_id() == max_id);
-        tb.set_free(max_id, true);
-      }
+      INFO("id: " << id);
+      REQUIRE(tb.find_next_free(id) == find_next(id, true));
+      REQUIRE(tb.find_prev_free(id) == find_prev(id, true));
+      REQUIRE(tb.find_next_used(id) == find_next(id, false));
+      REQUIRE(tb.find_prev_used(id) == find_prev(id, false));
     }
+    REQUIRE(tb.find_next_free(n) == invalid_id);
+    REQUIRE(tb.find_next_used(n) == invalid_id);
+    REQUIRE(tb.find_prev_free(invalid_id) == find_prev(n - 1, true));
+    REQUIRE(tb.find_prev_used(invalid_id) == find_prev(n - 1, false));
   }
 }
 
-TEMPLATE_TEST_CASE("Determines max_id at each step while freeing IDs in random order",
-                   "[max_id]",
-                   uint16_t,
-                   uint32_t,
-                   uint64_t)
+TEMPLATE_TEST_CASE("Used IDs tree", "[find]", uint16_t, uint32_t, uint64_t)
 {
+  using Policies = PoliciesWith<UsedIDsTreePolicy::maintain>;
   for(const size_t max_elements_exp : max_elements_exp_vals)
   {
-    auto [tb, bitset] = prepare_random_data<TestType>(max_elements_exp, 2);
+    auto [tb, bitset] = prepare_random_data<TestType, Policies>(max_elements_exp, 4);
 
-    for(size_t idx = 0; idx < tb.max_elements(); ++idx)
-      REQUIRE(bitset[idx] == tb.is_free(idx));
+    const size_t invalid_id     = decltype(tb)::invalid_id;
+    const size_t max_elements   = tb.max_elements();
+    auto         check_used_ids = [&, &tb = tb, &bitset = bitset] {
+      std::vector<size_t> used_ids;
+      for(size_t id = 0; id < max_elements; ++id)
+        if(!bitset[id])
+          used_ids.emplace_back(id);
 
-    std::vector<size_t> max_id_history;
-    for(auto it = begin(bitset); it != end(bitset); ++it)
-    {
-      if(*it == false)
-        max_id_history.emplace_back(static_cast<size_t>(std::distance(begin(bitset), it)));
-    }
-    size_t * max_id = &max_id_history.back();
+      const auto iter = tb.used_ids_iter();
+      REQUIRE(tb.max_used_id() == (used_ids.empty() ? invalid_id : used_ids.back()));
+      REQUIRE(std::equal(begin(used_ids), end(used_ids), iter.begin(), iter.end()));
+      for(size_t idx = 0; idx < used_ids.size(); ++idx)
+      {
+        REQUIRE(tb.find_next_used(idx ? used_ids[idx - 1] + 1 : 0) == used_ids[idx]);
+        REQUIRE(tb.find_prev_used(used_ids[idx]) == used_ids[idx]);
+      }
+    };
+    check_used_ids();
 
-    std::vector<size_t> shuffled_ids{max_id_history};
-    std::shuffle(begin(shuffled_ids), end(shuffled_ids), g);
-    std::unordered_set<size_t> freed_ids;
-    for(const size_t id : shuffled_ids)
+    for(size_t step = 0; step < 16; ++step)
     {
-      freed_ids.emplace(id);
-      INFO("id: " << id);
-      REQUIRE(tb.max_used_id() == *max_id);
-      tb.set_free(id, true);
-      if(id == *max_id)
+      size_t min_id = g() & (max_elements - 1);
+      size_t max_id = g() & (max_elements - 1);
+      if(min_id > max_id)
+        std::swap(min_id, max_id);
+      const bool value = g() & 1;
+      tb.set_free_for_range(min_id, max_id, value);
+      std::fill(begin(bitset) + min_id, begin(bitset) + max_id + 1, value);
+      check_used_ids();
+
+      std::vector<size_t> obtained;
+      tb.obtain_ids(max_elements / 8, std::back_inserter(obtained));
+      obtained.emplace_back(tb.obtain_id());
+      for(const size_t id : obtained)
+        if(id != invalid_id)
+          bitset[id] = false;
+      check_used_ids();
+
+      // Free used ids from the max one down
+      for(size_t idx = 0; idx < 8 && tb.max_used_id() != invalid_id; ++idx)
       {
-        while(freed_ids.count(*max_id))
-          --max_id;
+        bitset[tb.max_used_id()] = true;
+        tb.set_free(tb.max_used_id(), true);
       }
+      check_used_ids();
     }
   }
 }
 
-TEMPLATE_TEST_CASE("Used IDs iterator", "[iter]", uint16_t, uint32_t, uint64_t)
+// Check used_count(), count_used() of random ranges and rank/select of random ids against a plain bitset if
+// the policies maintain them
+template <typename Policies, typename Bitset>
+void check_used_counts(const Bitset & tb, const std::vector<bool> & bitset)
 {
-  for(const size_t max_elements_exp : max_elements_exp_vals)
+  if constexpr(Policies::template get<UsedCountPolicy>() == UsedCountPolicy::maintain)
   {
-    TreeBitset<TreeBitsetConfig<TestType>> empty{max_elements_exp};
-    for(size_t id : empty.used_ids_iter())
+    const size_t num_used = std::count(begin(bitset), end(bitset), false);
+    REQUIRE(tb.used_count() == num_used);
+    REQUIRE(tb.free_count() == bitset.size() - num_used);
+    REQUIRE(tb.count_used(0, bitset.size() - 1) == num_used);
+    for(size_t idx = 0; idx < 16; ++idx)
     {
-      (void)id;
-      REQUIRE(false);
+      size_t min_id = g() % bitset.size();
+      size_t max_id = g() % bitset.size();
+      if(min_id > max_id)
+        std::swap(min_id, max_id);
+      REQUIRE(tb.count_used(min_id, max_id) ==
+              size_t(std::count(begin(bitset) + min_id, begin(bitset) + max_id + 1, false)));
     }
 
-    auto [tb, bitset] = prepare_random_data<TestType>(max_elements_exp, 2);
-    for(size_t id : tb.used_ids_iter())
+    REQUIRE(tb.rank(bitset.size()) == num_used);
+    REQUIRE(tb.select(num_used) == Bitset::invalid_id);
+    if(num_used)
     {
-      INFO("id: " << id);
-      INFO("max elements: " << tb.max_elements());
-      REQUIRE(!bitset[id]);
-      bitset[id] = true;
+      const auto last_used = std::find(bitset.rbegin(), bitset.rend(), false);
+      REQUIRE(tb.select(0) == size_t(std::find(begin(bitset), end(bitset), false) - begin(bitset)));
+      REQUIRE(tb.select(num_used - 1) == size_t(bitset.rend() - last_used - 1));
     }
-    size_t id = 0;
-    for(const bool bit : bitset)
+    for(size_t idx = 0; idx < 16; ++idx)
     {
-      INFO("id: " << id);
-      REQUIRE(bit);
-      id++;
+      const size_t id   = g() % bitset.size();
+      const size_t rank = std::count(begin(bitset), begin(bitset) + id, false);
+      REQUIRE(tb.rank(id) == rank);
+      if(!bitset[id])
+        REQUIRE(tb.select(rank) == id);
+      if(num_used)
+      {
+        const size_t k = g() % num_used;
+        REQUIRE(tb.rank(tb.select(k)) == k);
+        REQUIRE(!tb.is_free(tb.select(k)));
+      }
     }
   }
 }
 
-TEMPLATE_TEST_CASE("(Un)packing", "[pack]", uint16_t, uint32_t, uint64_t)
+// Run random operations on a TreeBitset with the given policies and check all queries against a plain bitset
+template <typename BlockT, typename Policies>
+void check_against_reference_bitset(
+  const std::vector<size_t> & max_elements_exps = {begin(max_elements_exp_vals), end(max_elements_exp_vals)})
 {
-  for(const size_t max_elements_exp : max_elements_exp_vals)
+  for(const size_t max_elements_exp : max_elements_exps)
   {
-    auto [tb, _] = prepare_random_data<TestType>(max_elements_exp, 2);
+    auto [tb, bitset] = prepare_random_data<BlockT, Policies>(max_elements_exp, 2);
 
-    std::vector<RLEBitAbbreviation> abbreviations;
-    std::vector<TestType>           packed_blocks;
-    tb.pack([&abbreviations](const RLEBitAbbreviation & a) { abbreviations.emplace_back(a); },
-            [&packed_blocks](const TestType block) { packed_blocks.emplace_back(block); });
+    const size_t invalid_id   = decltype(tb)::invalid_id;
+    const size_t max_elements = tb.max_elements();
+    auto         check_ids    = [&, &tb = tb, &bitset = bitset] {
+      std::vector<size_t> used_ids;
+      for(size_t id = 0; id < max_elements; ++id)
+      {
+        REQUIRE(tb.is_free(id) == bitset[id]);
+        if(!bitset[id])
+          used_ids.emplace_back(id);
+      }
+      const auto iter = tb.used_ids_iter();
+      REQUIRE(std::equal(begin(used_ids), end(used_ids), iter.begin(), iter.end()));
+      REQUIRE(tb.max_used_id() == (used_ids.empty() ? invalid_id : used_ids.back()));
 
-    REQUIRE(!packed_blocks.empty());
+      const auto first_free = std::find(begin(bitset), end(bitset), true);
+      REQUIRE(tb.find_next_free(0) ==
+              (first_free == end(bitset) ? invalid_id : size_t(first_free - begin(bitset))));
+      check_used_counts<Policies>(tb, bitset);
+    };
+    check_ids();
+
+    for(size_t step = 0; step < 8; ++step)
+    {
+      size_t min_id = g() & (max_elements - 1);
+      size_t max_id = g() & (max_elements - 1);
+      if(min_id > max_id)
+        std::swap(min_id, max_id);
+      const bool value = g() & 1;
+      tb.set_free_for_range(min_id, max_id, value);
+      std::fill(begin(bitset) + min_id, begin(bitset) + max_id + 1, value);
+      check_ids();
+
+      std::vector<size_t> obtained;
+      tb.obtain_ids(max_elements / 8, std::back_inserter(obtained));
+      obtained.emplace_back(tb.obtain_id());
+      for(const size_t id : obtained)
+        if(id != invalid_id)
+          bitset[id] = false;
+      check_ids();
+    }
 
+    std::vector<RLEBitAbbreviation> abbreviations;
+    std::vector<BlockT>             packed_blocks;
+    tb.pack([&abbreviations](const RLEBitAbbreviation & a) { abbreviations.emplace_back(a); },
+            [&packed_blocks](const BlockT block) { packed_blocks.emplace_back(block); });
     auto unpacked =
       decltype(tb)::unpack(max_elements_exp, packed_blocks.data(), abbreviations.data(), size(abbreviations));
-
     REQUIRE(unpacked == tb);
+
+    tb.clean();
+    std::fill(begin(bitset), end(bitset), true);
+    check_ids();
+    REQUIRE(tb.obtain_id() == 0);
+    bitset[0] = false;
+    tb.set_free(max_elements - 1, false);
+    bitset[max_elements - 1] = false;
+    check_ids();
   }
 }
 
-/// BENCHMARKS
-
-TEST_CASE("TreeBitset<uint64> with 2^23 elements", "[bench]")
+// Levels of every capacity: the root tracks at least 2 children unless it's the only data block, and the
+// other levels are complete
+template <size_t BitsPerBlock, size_t NodeBlocks>
+constexpr bool tree_levels_are_minimal()
 {
-  BENCHMARK("init + obtain all in order")
-  {
-    TreeBitset tb{23};
-    for(size_t idx = 0; idx < tb.max_elements(); ++idx)
-      tb.obtain_id();
-    REQUIRE_FALSE(tb.is_free(123));
-  };
-
-  BENCHMARK_ADVANCED("obtain 1024 in order")(Catch::Benchmark::Chronometer meter)
+  constexpr size_t node_bits_log2 = math::int_log2(BitsPerBlock * NodeBlocks);
+  for(size_t exp_max = 0; exp_max < std::numeric_limits<size_t>::digits; ++exp_max)
   {
-    TreeBitset<> tb{23};
-    meter.measure([&] {
-      for(size_t idx = 0; idx < 1024; ++idx)
-        tb.obtain_id();
-      REQUIRE_FALSE(tb.is_free(123));
-    });
-  };
+    const auto levels = detail::pow2_tree_levels<BitsPerBlock, NodeBlocks>(exp_max);
+    const size_t num_levels          = levels.num_metadata_levels;
+    const size_t element_blocks_log2 = math::int_log2(levels.num_element_blocks);
+    if(num_levels * node_bits_log2 < element_blocks_log2 ||
+       (num_levels && (num_levels - 1) * node_bits_log2 >= element_blocks_log2))
+      return false;
+  }
+  return true;
+}
 
-  BENCHMARK_ADVANCED("obtain all in order")(Catch::Benchmark::Chronometer meter)
-  {
-    TreeBitset<> tb{23};
-    meter.measure([&] {
-      for(size_t idx = 0; idx < tb.max_elements(); ++idx)
-        tb.obtain_id();
-      REQUIRE_FALSE(tb.is_free(123));
-    });
-  };
+TEST_CASE("Tree levels beyond the block width", "[properties]")
+{
+  static_assert(tree_levels_are_minimal<16, 1>() && tree_levels_are_minimal<16, 32>());
+  static_assert(tree_levels_are_minimal<32, 1>() && tree_levels_are_minimal<32, 16>());
+  static_assert(tree_levels_are_minimal<64, 1>() && tree_levels_are_minimal<64, 8>());
+  static_assert(math::int_log_ceil<size_t>(16, 1) == 0 && math::int_log_ceil<size_t>(16, 16) == 1 &&
+                math::int_log_ceil<size_t>(16, 17) == 2 &&
+                math::int_log_ceil<size_t>(64, size_t{1} << 57) == 10);
 
-  BENCHMARK_ADVANCED("obtain half in order")(Catch::Benchmark::Chronometer meter)
-  {
-    TreeBitset<> tb{23};
-    const size_t n_elements = tb.max_elements() / 2;
-    meter.measure([&] {
-      for(size_t idx = 0; idx < n_elements; ++idx)
-        tb.obtain_id();
-      REQUIRE_FALSE(tb.is_free(123));
-    });
-  };
+  TreeBitset<TreeBitsetConfig<uint16_t>> tb{24};
+  REQUIRE(tb.num_metadata_levels() == 5);
+  REQUIRE(tb.num_element_blocks() == size_t{1} << 20);
+  REQUIRE(tb.num_metadata_blocks() == 1 + 16 + 256 + 4096 + 65536);
 
-  BENCHMARK_ADVANCED("obtain half - random free order")(Catch::Benchmark::Chronometer meter)
-  {
-    TreeBitset<> tb{23};
+  check_against_reference_bitset<uint16_t, PoliciesWith<>>({16, 17, 20});
+  check_against_reference_bitset<uint16_t, PoliciesWith<UsedIDsTreePolicy::maintain, FreeBitPolicy::zero>>(
+    {16, 19});
+  using CacheLineLazyPolicies = PoliciesWith<MetadataNodePolicy::cache_line, StorageInitPolicy::lazy>;
+  check_against_reference_bitset<uint16_t, CacheLineLazyPolicies>({16, 19});
 
-    const size_t max_elements = tb.max_elements();
-    for(size_t idx = 0; idx < max_elements / 2; ++idx)
-      tb.set_free(g() % max_elements, false);
+  // Only the ends of the lazily initialized 2^33 ids are touched
+  using LazyConfig =
+    TreeBitsetConfig<uint32_t, PoliciesWith<StorageInitPolicy::lazy, UsedIDsTreePolicy::maintain>>;
+  TreeBitset<LazyConfig> wide{33};
+  const size_t           last_id = wide.max_elements() - 1;
+  REQUIRE(wide.obtain_id() == 0);
+  wide.set_free(last_id, false);
+  REQUIRE(wide.max_used_id() == last_id);
+  REQUIRE(wide.find_prev_used(last_id - 1) == 0);
+  REQUIRE(wide.find_prev_free(last_id) == last_id - 1);
+  REQUIRE(wide.find_next_used(1) == last_id);
+  wide.set_free_for_range(1, size_t{1} << 16, false);
+  REQUIRE(wide.obtain_id() == (size_t{1} << 16) + 1);
+  REQUIRE(wide.find_next_free(last_id) == decltype(wide)::invalid_id);
+}
 
-    meter.measure([&] {
-      const size_t max_elements = tb.max_elements();
-      for(size_t idx = 0; idx < max_elements / 2; ++idx)
-        tb.obtain_id();
-      return tb.is_free(0);
-    });
-  };
+TEMPLATE_TEST_CASE("Zero means free bit polarity", "[set]", uint16_t, uint32_t, uint64_t)
+{
+  check_against_reference_bitset<TestType, PoliciesWith<FreeBitPolicy::zero>>();
+  check_against_reference_bitset<TestType, PoliciesWith<FreeBitPolicy::zero, UsedIDsTreePolicy::maintain>>();
+}
 
-  BENCHMARK_ADVANCED("set all unfree manually")(Catch::Benchmark::Chronometer meter)
-  {
-    TreeBitset<> tb{23};
+TEMPLATE_TEST_CASE("Lazy storage initialization", "[set]", uint16_t, uint32_t, uint64_t)
+{
+  check_against_reference_bitset<TestType, PoliciesWith<StorageInitPolicy::lazy>>();
+  check_against_reference_bitset<TestType,
+                                 PoliciesWith<StorageInitPolicy::lazy, UsedIDsTreePolicy::maintain>>();
+  check_against_reference_bitset<TestType, PoliciesWith<StorageInitPolicy::lazy, FreeBitPolicy::zero>>();
+}
 
-    const size_t max_elements = tb.max_elements();
-    for(size_t idx = 0; idx < max_elements / 2; ++idx)
-      tb.set_free(g() % max_elements, false);
+TEMPLATE_TEST_CASE("External and memory resource storage", "[storage]", uint16_t, uint32_t, uint64_t)
+{
+  static_assert(TreeBitset<>::required_blocks(13) == 1 + 2 + 128);
 
-    meter.measure([&] {
-      const size_t max_elements = tb.max_elements();
-      for(size_t idx = 0; idx < max_elements; ++idx)
-        tb.set_free(idx, false);
-      REQUIRE_FALSE(tb.is_free(123));
-    });
-  };
+  using UsedIDsTreePolicies = PoliciesWith<UsedIDsTreePolicy::maintain>;
+  using ExternalPolicies    = PoliciesWith<UsedIDsTreePolicy::maintain, StoragePolicy::external>;
+  using ResourcePolicies    = PoliciesWith<UsedIDsTreePolicy::maintain, StoragePolicy::memory_resource>;
+  check_against_reference_bitset<TestType, ResourcePolicies>();
+  check_against_reference_bitset<
+    TestType,
+    PoliciesWith<StoragePolicy::memory_resource, StorageInitPolicy::lazy, FreeBitPolicy::zero>>();
 
-  BENCHMARK_ADVANCED("pack+unpack to a pre-allocated buffers")(Catch::Benchmark::Chronometer meter)
+  const TestType canary = 0x5a5a;
+  for(const size_t max_elements_exp : max_elements_exp_vals)
   {
-    TreeBitset<> tb{23};
+    auto [reference, _] = prepare_random_data<TestType, UsedIDsTreePolicies>(max_elements_exp, 2);
 
-    const size_t max_elements = tb.max_elements();
-    for(size_t idx = 0; idx < max_elements / 2; ++idx)
-      tb.set_free(g() % max_elements, false);
+    std::vector<RLEBitAbbreviation> abbreviations;
+    std::vector<TestType>           packed_blocks;
+    reference.pack([&abbreviations](const RLEBitAbbreviation & a) { abbreviations.emplace_back(a); },
+                   [&packed_blocks](const TestType block) { packed_blocks.emplace_back(block); });
 
-    std::vector<uint64_t> packed_blocks(tb.max_elements(), 0);
-    size_t                packed_blocks_iter = 0;
+    using ExternalTreeBitset = TreeBitset<TreeBitsetConfig<TestType, ExternalPolicies>>;
+    std::vector<TestType> buffer(ExternalTreeBitset::required_blocks(max_elements_exp) + 1, canary);
+    {
+      auto external = ExternalTreeBitset::unpack(
+        max_elements_exp, packed_blocks.data(), abbreviations.data(), size(abbreviations), buffer.data());
+      for(size_t id = 0; id < reference.max_elements(); ++id)
+        REQUIRE(external.is_free(id) == reference.is_free(id));
+      REQUIRE(external.obtain_id() == reference.obtain_id());
+      REQUIRE(external.max_used_id() == reference.max_used_id());
+    }
+    REQUIRE(buffer.back() == canary);
+
+    std::pmr::monotonic_buffer_resource arena;
+    TreeBitset<TreeBitsetConfig<TestType, ResourcePolicies>> from_arena{max_elements_exp, &arena};
+    from_arena.set_free_for_range(0, from_arena.max_elements() - 1, false);
+    REQUIRE(from_arena.max_used_id() == from_arena.max_elements() - 1);
+    REQUIRE(from_arena.obtain_id() == decltype(from_arena)::invalid_id);
+  }
+}
+
+TEST_CASE("Mapped memory resource", "[storage]")
+{
+  using ResourcePolicies = PoliciesWith<StoragePolicy::memory_resource, UsedIDsTreePolicy::maintain>;
+  for(const bool huge_pages : {false, true})
+  {
+    for(const NumaPlacement numa : {NumaPlacement::any, NumaPlacement::bind, NumaPlacement::interleave})
+    {
+      MappedMemoryResource resource{{huge_pages, numa, 1}};
+      // Bitsets which are constructed without a resource take the default one
+      std::pmr::memory_resource * const default_resource = std::pmr::set_default_resource(&resource);
+      check_against_reference_bitset<uint64_t, ResourcePolicies>();
+      std::pmr::set_default_resource(default_resource);
+
+      TreeBitset<TreeBitsetConfig<uint64_t, ResourcePolicies>> tb{22, &resource};
+      REQUIRE((huge_pages || resource.last_pages() == MappedMemoryResource::Pages::base));
+      tb.set_free_for_range(0, tb.max_elements() - 1, false);
+      tb.set_free(12345, true);
+      REQUIRE(tb.obtain_id() == 12345);
+      REQUIRE(tb.obtain_id() == decltype(tb)::invalid_id);
+      REQUIRE(tb.max_used_id() == tb.max_elements() - 1);
+    }
+  }
+}
+
+// Run random operations on a file-backed TreeBitset, reopen it after a sync and after its process is killed
+// without one and compare it to an owning TreeBitset which went through the same operations
+template <typename BlockT, auto... Overrides>
+void check_mapped_file_reopening()
+{
+  using FilePolicies   = PoliciesWith<Overrides..., StoragePolicy::mapped_file>;
+  using FileTreeBitset = TreeBitset<TreeBitsetConfig<BlockT, FilePolicies>>;
+
+  const std::string path =
+    (std::filesystem::temp_directory_path() / "tree_bitset_mapped_file_test.bin").string();
+
+  auto apply_random_ops = [](auto & tb, const uint32_t seed) {
+    std::mt19937 ops_g{seed};
+    const size_t max_elements = tb.max_elements();
+    for(size_t step = 0; step < 4; ++step)
+    {
+      for(size_t idx = 0; idx < max_elements / 4; ++idx)
+        tb.set_free(ops_g() & (max_elements - 1), ops_g() & 1);
+      size_t min_id = ops_g() & (max_elements - 1);
+      size_t max_id = ops_g() & (max_elements - 1);
+      if(min_id > max_id)
+        std::swap(min_id, max_id);
+      tb.set_free_for_range(min_id, max_id, ops_g() & 1);
+      std::vector<size_t> obtained;
+      tb.obtain_ids(ops_g() & (max_elements / 4 - 1), std::back_inserter(obtained));
+    }
+  };
+  auto require_same_ids = [](const FileTreeBitset & tb, const auto & reference) {
+    for(size_t id = 0; id < reference.max_elements(); ++id)
+      REQUIRE(tb.is_free(id) == reference.is_free(id));
+    REQUIRE(tb.max_used_id() == reference.max_used_id());
+    const size_t last_id = reference.max_elements() - 1;
+    REQUIRE(tb.find_prev_used(last_id) == reference.find_prev_used(last_id));
+    if constexpr(FilePolicies::template get<UsedCountPolicy>() == UsedCountPolicy::maintain)
+      REQUIRE(tb.used_count() == reference.used_count());
+  };
+
+  for(const size_t max_elements_exp : max_elements_exp_vals)
+  {
+    std::filesystem::remove(path);
+    TreeBitset<TreeBitsetConfig<BlockT, PoliciesWith<Overrides...>>> reference{max_elements_exp};
+    {
+      FileTreeBitset tb{max_elements_exp, path.c_str()};
+      require_same_ids(tb, reference);
+      const uint32_t seed = g();
+      apply_random_ops(tb, seed);
+      apply_random_ops(reference, seed);
+      tb.sync();
+    }
+    {
+      FileTreeBitset tb{max_elements_exp, path.c_str()};
+      require_same_ids(tb, reference);
+      // Opening the file doesn't modify it
+      REQUIRE(tb == FileTreeBitset{max_elements_exp, path.c_str()});
+    }
+
+#if defined(__linux__)
+    // Modifications which weren't synced are still in the page cache after the process is killed
+    const uint32_t seed = g();
+    const pid_t    pid  = fork();
+    REQUIRE(pid >= 0);
+    if(!pid)
+    {
+      // The child mustn't return to the test runner, the parent notices a failure by the file contents
+      try
+      {
+        FileTreeBitset tb{max_elements_exp, path.c_str()};
+        apply_random_ops(tb, seed);
+      }
+      catch(...)
+      {
+      }
+      raise(SIGKILL);
+    }
+    int status = 0;
+    REQUIRE(waitpid(pid, &status, 0) == pid);
+    REQUIRE((WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL));
+    apply_random_ops(reference, seed);
+    {
+      FileTreeBitset tb{max_elements_exp, path.c_str()};
+      require_same_ids(tb, reference);
+      tb.sync();
+      tb.clean();
+      reference.clean();
+      require_same_ids(tb, reference);
+    }
+    {
+      FileTreeBitset tb{max_elements_exp, path.c_str()};
+      require_same_ids(tb, reference);
+    }
+#endif
+
+    // Files only open with the configuration which created them
+    constexpr MaxIDPolicy other_max_id_policy =
+      FilePolicies::template get<MaxIDPolicy>() == MaxIDPolicy::keep_max_id_current
+        ? MaxIDPolicy::on_demand_max_id_calc
+        : MaxIDPolicy::keep_max_id_current;
+    using OtherPolicies   = PoliciesWith<Overrides..., StoragePolicy::mapped_file, other_max_id_policy>;
+    using OtherTreeBitset = TreeBitset<TreeBitsetConfig<BlockT, OtherPolicies>>;
+    REQUIRE_THROWS_AS((OtherTreeBitset{max_elements_exp, path.c_str()}), std::runtime_error);
+    REQUIRE_THROWS_AS((FileTreeBitset{max_elements_exp + 1, path.c_str()}), std::runtime_error);
+  }
+  std::filesystem::remove(path);
+}
+
+TEMPLATE_TEST_CASE("Mapped file storage", "[storage]", uint16_t, uint32_t, uint64_t)
+{
+  check_mapped_file_reopening<TestType>();
+  check_mapped_file_reopening<TestType, UsedIDsTreePolicy::maintain>();
+  check_mapped_file_reopening<TestType, StorageInitPolicy::lazy, FreeBitPolicy::zero>();
+  check_mapped_file_reopening<TestType, MetadataNodePolicy::cache_line>();
+  check_mapped_file_reopening<TestType, MaxIDPolicy::on_demand_max_id_calc>();
+
+  // Only the runs of the modified chunks are flushed
+  constexpr size_t    chunk_bytes = size_t{1} << 24;
+  detail::DirtyChunks chunks{64 * chunk_bytes};
+  REQUIRE(!chunks.any());
+  chunks.mark(0, sizeof(TestType) - 1);
+  chunks.mark(64 * chunk_bytes - sizeof(TestType), 64 * chunk_bytes - 1);
+  chunks.mark(3 * chunk_bytes + 1, 5 * chunk_bytes);
+  REQUIRE(chunks.any());
+  std::vector<std::pair<size_t, size_t>> runs;
+  chunks.flush(
+    [&runs](const size_t first_byte, const size_t bytes) { runs.emplace_back(first_byte, bytes); });
+  const std::vector<std::pair<size_t, size_t>> expected_runs = {
+    {0, chunk_bytes}, {3 * chunk_bytes, 3 * chunk_bytes}, {63 * chunk_bytes, chunk_bytes}};
+  REQUIRE(runs == expected_runs);
+  REQUIRE(!chunks.any());
+}
+
+TEMPLATE_TEST_CASE("Concurrent TreeBitset on a single thread", "[concurrent]", uint16_t, uint32_t, uint64_t)
+{
+  for(const size_t max_elements_exp : max_elements_exp_vals)
+  {
+    ConcurrentTreeBitset<TreeBitsetConfig<TestType>> tb{max_elements_exp};
+    std::vector<bool>                                bitset(tb.max_elements(), true);
+    const size_t                                     max_elements = tb.max_elements();
+    for(size_t step = 0; step < 4; ++step)
+    {
+      for(size_t idx = 0; idx < max_elements; ++idx)
+      {
+        const size_t id   = g() & (max_elements - 1);
+        const bool   free = g() & 1;
+        tb.set_free(id, free);
+        bitset[id] = free;
+      }
+      // Obtained ids are the first free ones while there're no other threads
+      for(size_t idx = 0; idx < max_elements / 2; ++idx)
+      {
+        const auto   first_free = std::find(begin(bitset), end(bitset), true);
+        const size_t expected =
+          first_free == end(bitset) ? decltype(tb)::invalid_id : size_t(first_free - begin(bitset));
+        REQUIRE(tb.obtain_id() == expected);
+        if(expected != decltype(tb)::invalid_id)
+          bitset[expected] = false;
+      }
+      for(size_t id = 0; id < max_elements; ++id)
+        REQUIRE(tb.is_free(id) == bitset[id]);
+    }
+    tb.clean();
+    for(size_t id = 0; id < max_elements; ++id)
+      REQUIRE(tb.obtain_id() == id);
+    REQUIRE(tb.obtain_id() == decltype(tb)::invalid_id);
+  }
+}
+
+TEMPLATE_TEST_CASE("Concurrent TreeBitset on multiple threads", "[concurrent]", uint16_t, uint32_t, uint64_t)
+{
+  constexpr size_t num_threads = 8;
+  for(const size_t max_elements_exp : {12, 13, 15})
+  {
+    ConcurrentTreeBitset<TreeBitsetConfig<TestType>> tb{max_elements_exp};
+    const size_t                                     max_elements = tb.max_elements();
+
+    // Threads keep 3/4 of the ids they obtain and free the rest, so they run out of free ids eventually
+    std::vector<std::vector<size_t>> kept_ids(num_threads);
+    std::vector<std::thread>         threads;
+    std::atomic<bool>                failed{false};
+    for(size_t thread_idx = 0; thread_idx < num_threads; ++thread_idx)
+    {
+      threads.emplace_back([&, seed = g(), &kept = kept_ids[thread_idx]] {
+        std::mt19937 thread_g{seed};
+        for(size_t id = tb.obtain_id(); id != decltype(tb)::invalid_id; id = tb.obtain_id())
+        {
+          if(tb.is_free(id))
+            failed = true;
+          if(thread_g() & 3)
+            kept.emplace_back(id);
+          else
+            tb.set_free(id, true);
+        }
+      });
+    }
+    for(std::thread & thread : threads)
+      thread.join();
+    REQUIRE(!failed);
+
+    // Every id has been kept by a single thread, so none of them got lost or obtained twice
+    std::vector<size_t> all_kept;
+    for(const auto & kept : kept_ids)
+      all_kept.insert(end(all_kept), begin(kept), end(kept));
+    std::sort(begin(all_kept), end(all_kept));
+    REQUIRE(all_kept.size() == max_elements);
+    for(size_t id = 0; id < max_elements; ++id)
+      REQUIRE(all_kept[id] == id);
+
+    // Free the ids concurrently, each of them becomes obtainable again
+    threads.clear();
+    for(size_t thread_idx = 0; thread_idx < num_threads; ++thread_idx)
+      threads.emplace_back([&, &kept = kept_ids[thread_idx]] {
+        for(const size_t id : kept)
+          tb.set_free(id, true);
+      });
+    for(std::thread & thread : threads)
+      thread.join();
+    for(size_t id = 0; id < max_elements; ++id)
+      REQUIRE(tb.obtain_id() == id);
+    REQUIRE(tb.obtain_id() == decltype(tb)::invalid_id);
+  }
+}
+
+TEMPLATE_TEST_CASE("Sharded TreeBitset", "[concurrent]", uint16_t, uint32_t, uint64_t)
+{
+  for(const size_t max_elements_exp : {6, 12, 13})
+  {
+    for(const size_t shards_exp : {0, 2, 6})
+    {
+      ShardedTreeBitset<TreeBitsetConfig<TestType>> tb{max_elements_exp, shards_exp};
+      const size_t                                  max_elements = tb.max_elements();
+      const size_t                                  shard_size   = max_elements >> shards_exp;
+      REQUIRE(max_elements == size_t{1} << max_elements_exp);
+      REQUIRE(tb.num_shards() == size_t{1} << shards_exp);
+
+      // The home shard is drained first, then the shards after it are stolen from
+      const size_t home_shard = tb.num_shards() - 1;
+      for(size_t idx = 0; idx < max_elements; ++idx)
+        REQUIRE(tb.obtain_id(home_shard) == (home_shard * shard_size + idx) % max_elements);
+      REQUIRE(tb.obtain_id(0) == decltype(tb)::invalid_id);
+
+      // Freed ids go back to their shards, so the home shard one is obtained first
+      const size_t home_id = max_elements - 1, other_id = shard_size / 2;
+      tb.set_free(other_id, true);
+      tb.set_free(home_id, true);
+      REQUIRE(tb.is_free(other_id));
+      REQUIRE(tb.obtain_id(home_shard) == (shards_exp ? home_id : other_id));
+      REQUIRE(tb.obtain_id(home_shard) == (shards_exp ? other_id : home_id));
+      REQUIRE(!tb.is_free(other_id));
+      REQUIRE(tb.obtain_id(home_shard) == decltype(tb)::invalid_id);
+
+      // Threads keep 3/4 of the ids they obtain and free the rest, every id ends up kept by one of them
+      std::vector<std::vector<size_t>> kept_ids(8);
+      std::vector<std::thread>         threads;
+      tb.clean();
+      for(auto & kept : kept_ids)
+        threads.emplace_back([&, seed = g()] {
+          std::mt19937 thread_g{seed};
+          for(size_t id = tb.obtain_id(); id != decltype(tb)::invalid_id; id = tb.obtain_id())
+            if(thread_g() & 3)
+              kept.emplace_back(id);
+            else
+              tb.set_free(id, true);
+        });
+      for(std::thread & thread : threads)
+        thread.join();
+
+      std::vector<size_t> all_kept;
+      for(const auto & kept : kept_ids)
+        all_kept.insert(end(all_kept), begin(kept), end(kept));
+      std::sort(begin(all_kept), end(all_kept));
+      REQUIRE(all_kept.size() == max_elements);
+      for(size_t id = 0; id < max_elements; ++id)
+        REQUIRE(all_kept[id] == id);
+    }
+  }
+}
+
+TEMPLATE_TEST_CASE("Magazine TreeBitset", "[concurrent]", uint16_t, uint32_t, uint64_t)
+{
+  using MagazineBitset = MagazineTreeBitset<TreeBitsetConfig<TestType>>;
+  auto used_ids        = [](const MagazineBitset & tb) {
+    std::vector<size_t> ids;
+    tb.for_each_used_id([&ids](const size_t id) { ids.emplace_back(id); });
+    return ids;
+  };
+
+  for(const size_t max_elements_exp : max_elements_exp_vals)
+  {
+    for(const size_t magazine_size : {2, 8, 64})
+    {
+      MagazineBitset tb{max_elements_exp, magazine_size};
+      const size_t   max_elements = tb.max_elements();
+
+      // Ids are obtained in ascending order and the released ones are reused first
+      for(size_t id = 0; id < max_elements; ++id)
+        REQUIRE(tb.obtain_id() == id);
+      REQUIRE(tb.obtain_id() == MagazineBitset::invalid_id);
+      tb.release(3);
+      tb.release(1);
+      REQUIRE(tb.obtain_id() == 1);
+      tb.release(max_elements - 1);
+      tb.release(max_elements - 2);
+      // Released ids stay in the magazine until it's flushed
+      REQUIRE(tb.max_used_id() == max_elements - 1);
+      tb.flush();
+      REQUIRE(tb.max_used_id() == max_elements - 3);
+      std::vector<size_t> expected(max_elements - 2);
+      std::iota(begin(expected), end(expected), size_t{0});
+      expected.erase(begin(expected) + 3);
+      REQUIRE(used_ids(tb) == expected);
+
+      // Threads keep 3/4 of the ids they obtain and release the rest. Each of them gives up once its magazine
+      // and the shared bitset are empty, while the others might still hold released ids, which they return
+      // when they exit
+      std::vector<std::vector<size_t>> kept_ids(8);
+      std::vector<std::thread>         threads;
+      MagazineBitset                   shared{max_elements_exp, magazine_size};
+      for(auto & kept : kept_ids)
+        threads.emplace_back([&, seed = g()] {
+          std::mt19937 thread_g{seed};
+          for(size_t id = shared.obtain_id(); id != MagazineBitset::invalid_id; id = shared.obtain_id())
+            if(thread_g() & 3)
+              kept.emplace_back(id);
+            else
+              shared.release(id);
+        });
+      for(std::thread & thread : threads)
+        thread.join();
+
+      std::vector<size_t> all_kept;
+      for(const auto & kept : kept_ids)
+        all_kept.insert(end(all_kept), begin(kept), end(kept));
+      std::sort(begin(all_kept), end(all_kept));
+      REQUIRE(std::adjacent_find(begin(all_kept), end(all_kept)) == end(all_kept));
+      REQUIRE(used_ids(shared) == all_kept);
+    }
+  }
+
+  // flush_all() drains the magazines of the threads which are still running
+  MagazineBitset    tb{12, 16};
+  std::atomic<bool> released{false}, flushed{false};
+  std::thread       thread{[&] {
+    for(size_t idx = 0; idx < 100; ++idx)
+      tb.obtain_id();
+    for(size_t id = 50; id < 100; ++id)
+      tb.release(id);
+    released = true;
+    while(!flushed)
+      std::this_thread::yield();
+  }};
+  while(!released)
+    std::this_thread::yield();
+  REQUIRE(tb.max_used_id() > 49);
+  tb.flush_all();
+  REQUIRE(tb.max_used_id() == 49);
+  flushed = true;
+  thread.join();
+  REQUIRE(tb.max_used_id() == 49);
+}
+
+TEMPLATE_TEST_CASE("Entity allocator", "[entity]", uint16_t, uint32_t, uint64_t)
+{
+  for(const size_t max_elements_exp : max_elements_exp_vals)
+  {
+    EntityAllocator<TreeBitsetConfig<TestType>> entities{max_elements_exp};
+    REQUIRE(!entities.is_alive(decltype(entities)::invalid_handle));
+
+    std::vector<EntityHandle> alive;
+    for(size_t index = 0; index < entities.max_entities(); ++index)
+    {
+      alive.emplace_back(entities.create());
+      REQUIRE(alive.back().index() == index);
+      REQUIRE(entities.is_alive(alive.back()));
+    }
+    REQUIRE(entities.create() == decltype(entities)::invalid_handle);
+
+    // Destroyed handles stay dead after their indices are reused
+    std::vector<EntityHandle> dead;
+    for(size_t step = 0; step < entities.max_entities(); ++step)
+    {
+      const size_t victim = g() % alive.size();
+      REQUIRE(entities.destroy(alive[victim]));
+      REQUIRE(!entities.destroy(alive[victim]));
+      dead.emplace_back(alive[victim]);
+      alive[victim] = entities.create();
+      REQUIRE(alive[victim].index() == dead.back().index());
+      REQUIRE(alive[victim].generation() != dead.back().generation());
+    }
+    for(const EntityHandle handle : alive)
+      REQUIRE(entities.is_alive(handle));
+    for(const EntityHandle handle : dead)
+      REQUIRE(!entities.is_alive(handle));
+
+    std::sort(begin(alive), end(alive), [](auto lhs, auto rhs) { return lhs.index() < rhs.index(); });
+    std::vector<EntityHandle> iterated;
+    entities.for_each_alive([&iterated](const EntityHandle handle) { iterated.emplace_back(handle); });
+    REQUIRE(iterated == alive);
+    REQUIRE(!entities.is_alive(EntityHandle{static_cast<uint32_t>(entities.max_entities()), 1}));
+  }
+
+  // Generations wrap around while keeping their parity
+  EntityAllocator<TreeBitsetConfig<TestType>, uint8_t> entities{4};
+  for(size_t cycle = 0; cycle < 1000; ++cycle)
+  {
+    const EntityHandle handle = entities.create();
+    REQUIRE(handle.index() == 0);
+    REQUIRE(handle.generation() == (2 * cycle + 1) % 256);
+    REQUIRE(entities.destroy(handle));
+    REQUIRE(!entities.is_alive(handle));
+  }
+}
+
+TEMPLATE_TEST_CASE("Sparse TreeBitset", "[sparse]", uint16_t, uint32_t, uint64_t)
+{
+  using Bitset = SparseTreeBitset<TreeBitsetConfig<TestType>>;
+  for(const size_t max_elements_exp : {3, 6, 7, 12, 13})
+  {
+    Bitset            tb{max_elements_exp};
+    std::vector<bool> bitset(tb.max_elements(), true);
+    auto              check_ids = [&] {
+      for(size_t id = 0; id < tb.max_elements(); ++id)
+        REQUIRE(tb.is_free(id) == bitset[id]);
+    };
+
+    // Ids are obtained in order until there're none left
+    for(size_t id = 0; id < tb.max_elements(); ++id)
+    {
+      REQUIRE(tb.obtain_id() == id);
+      bitset[id] = false;
+    }
+    REQUIRE(tb.obtain_id() == Bitset::invalid_id);
+    check_ids();
+
+    for(size_t step = 0; step < tb.max_elements() * 2; ++step)
+    {
+      const size_t id    = g() & (tb.max_elements() - 1);
+      const bool   value = g() & 1;
+      tb.set_free(id, value);
+      bitset[id] = value;
+    }
+    check_ids();
+    const auto first_free = std::find(begin(bitset), end(bitset), true);
+    REQUIRE(tb.obtain_id() ==
+            (first_free == end(bitset) ? Bitset::invalid_id : size_t(first_free - begin(bitset))));
+
+    tb.clean();
+    REQUIRE(tb.num_leaf_pages() == 0);
+    REQUIRE(tb.obtain_id() == 0);
+  }
+
+  // Pages are only allocated for the used ids and released once they're free again. Metadata of the smaller
+  // blocks takes more address space, 2^40 ids of uint16_t would reserve 8 GiB for it
+  constexpr size_t max_elements_exp = sizeof(TestType) == sizeof(uint64_t) ? 40 : 36;
+  Bitset           tb{max_elements_exp};
+  const size_t     page_ids = Bitset::leaf_page_blocks * std::numeric_limits<TestType>::digits;
+  REQUIRE(tb.num_leaf_pages() == 0);
+
+  std::unordered_set<size_t> used;
+  for(size_t idx = 0; idx < 4096; ++idx)
+  {
+    const size_t id = (size_t{g()} << 32 | g()) & (tb.max_elements() - 1);
+    tb.set_free(id, false);
+    used.insert(id);
+  }
+  std::unordered_set<size_t> used_pages;
+  for(const size_t id : used)
+  {
+    REQUIRE(!tb.is_free(id));
+    REQUIRE(tb.is_free(id ^ 1) == !used.count(id ^ 1));
+    used_pages.insert(id / page_ids);
+  }
+  REQUIRE(tb.num_leaf_pages() == used_pages.size());
+
+  // The whole block of the last id gets used, then the first free id is after the filled ones
+  const size_t last_block_first_id = tb.max_elements() - std::numeric_limits<TestType>::digits;
+  for(size_t id = last_block_first_id; id < tb.max_elements(); ++id)
+  {
+    tb.set_free(id, false);
+    used.insert(id);
+  }
+  const size_t obtained = tb.obtain_id();
+  REQUIRE(!used.count(obtained));
+  REQUIRE(obtained < last_block_first_id);
+  used.insert(obtained);
+
+  // Released pages are given back to the OS, so the resident memory of the used pages goes away with them
+  const size_t rss_used = resident_memory();
+  for(const size_t id : used)
+    tb.set_free(id, true);
+  REQUIRE(tb.num_leaf_pages() == 0);
+  REQUIRE(tb.is_free(tb.max_elements() - 1));
+  const size_t rss_freed = resident_memory();
+  if(rss_used && detail::os_page_bytes() <= Bitset::leaf_page_bytes)
+    REQUIRE(rss_freed + used_pages.size() * Bitset::leaf_page_bytes / 2 < rss_used);
+
+  // Released pages read as zero when they're reused
+  for(const size_t id : used)
+    tb.set_free(id, false);
+  for(const size_t id : used)
+  {
+    used_pages.insert(id / page_ids);
+    REQUIRE(!tb.is_free(id));
+    REQUIRE(tb.is_free(id ^ 1) == !used.count(id ^ 1));
+  }
+  REQUIRE(tb.num_leaf_pages() == used_pages.size());
+}
+
+// Run the same random operations on a compile-time and a runtime capacity TreeBitset
+template <typename BlockT, size_t ExpMax, typename Policies = TreeBitsetPoliciesBuilder::default_>
+void check_static_against_dynamic()
+{
+  using Config = TreeBitsetConfig<BlockT, Policies>;
+  StaticTreeBitset<Config, ExpMax> static_tb;
+  TreeBitset<Config>               tb{ExpMax};
+  REQUIRE(static_tb.num_metadata_levels() == tb.num_metadata_levels());
+  REQUIRE(static_tb.num_metadata_blocks() == tb.num_metadata_blocks());
+
+  const size_t max_elements = tb.max_elements();
+  for(size_t step = 0; step < 4; ++step)
+  {
+    for(size_t idx = 0; idx < max_elements / 4; ++idx)
+    {
+      const size_t id    = g() & (max_elements - 1);
+      const bool   value = g() & 1;
+      static_tb.set_free(id, value);
+      tb.set_free(id, value);
+    }
+    for(size_t idx = 0; idx < max_elements / 8; ++idx)
+      REQUIRE(static_tb.obtain_id() == tb.obtain_id());
+    for(size_t id = 0; id < max_elements; ++id)
+      REQUIRE(static_tb.is_free(id) == tb.is_free(id));
+    REQUIRE(static_tb.max_used_id() == tb.max_used_id());
+  }
+
+  auto pack = [](const auto & tb) {
+    std::vector<BlockT> packed_blocks;
+    tb.pack([](const RLEBitAbbreviation &) {}, [&](const BlockT block) { packed_blocks.emplace_back(block); });
+    return packed_blocks;
+  };
+  REQUIRE(pack(static_tb) == pack(tb));
+}
+
+TEMPLATE_TEST_CASE("Compile-time capacity", "[static]", uint16_t, uint32_t, uint64_t)
+{
+  check_static_against_dynamic<TestType, 6>();
+  check_static_against_dynamic<TestType, 7>();
+  check_static_against_dynamic<TestType, 12>();
+  check_static_against_dynamic<TestType, 13>();
+  check_static_against_dynamic<TestType, 13, PoliciesWith<UsedIDsTreePolicy::maintain, FreeBitPolicy::zero>>();
+  check_static_against_dynamic<TestType, 13, PoliciesWith<StorageInitPolicy::lazy>>();
+}
+
+TEMPLATE_TEST_CASE("Cache line metadata nodes", "[set]", uint16_t, uint32_t, uint64_t)
+{
+  using CacheLinePolicies = PoliciesWith<MetadataNodePolicy::cache_line>;
+  using CacheLineConfig   = TreeBitsetConfig<TestType, CacheLinePolicies>;
+  // The smallest capacity with 2 levels of 512 bit nodes
+  constexpr size_t two_levels_exp = std::numeric_limits<TestType>::digits > 16 ? 16 : 15;
+
+  const TreeBitset<CacheLineConfig> two_levels{two_levels_exp};
+  REQUIRE(two_levels.num_metadata_levels() == 2);
+  REQUIRE(two_levels.num_metadata_blocks() ==
+          64 / sizeof(TestType) * (1 + two_levels.num_element_blocks() / 512));
+
+  const std::vector<size_t> max_elements_exps = {6, 7, 12, 13, two_levels_exp};
+  check_against_reference_bitset<TestType, CacheLinePolicies>(max_elements_exps);
+  check_against_reference_bitset<
+    TestType,
+    PoliciesWith<MetadataNodePolicy::cache_line, UsedIDsTreePolicy::maintain, FreeBitPolicy::zero>>(
+    max_elements_exps);
+  check_against_reference_bitset<
+    TestType,
+    PoliciesWith<MetadataNodePolicy::cache_line, UsedIDsTreePolicy::maintain, StorageInitPolicy::lazy>>(
+    max_elements_exps);
+  check_static_against_dynamic<TestType, 7, CacheLinePolicies>();
+  check_static_against_dynamic<TestType, two_levels_exp, CacheLinePolicies>();
+  check_static_against_dynamic<TestType,
+                               two_levels_exp,
+                               PoliciesWith<MetadataNodePolicy::cache_line, UsedIDsTreePolicy::maintain>>();
+
+  // Zeroed storage of FreeBitPolicy::zero and StorageInitPolicy::lazy keeps the nodes within cache lines too
+  for(const size_t bytes : {size_t{8}, size_t{100}, size_t{4096}, size_t{1} << 16, (size_t{1} << 16) + 8})
+  {
+    auto * const ptr = static_cast<unsigned char *>(detail::allocate_zeroed(bytes, 64));
+    REQUIRE(reinterpret_cast<uintptr_t>(ptr) % 64 == 0);
+    REQUIRE(std::all_of(ptr, ptr + bytes, [](const unsigned char byte) { return byte == 0; }));
+    detail::deallocate_zeroed(ptr, bytes);
+  }
+}
+
+TEMPLATE_TEST_CASE("Prefetching ancestors", "[set]", uint16_t, uint32_t, uint64_t)
+{
+  using PrefetchPolicies = PoliciesWith<PrefetchPolicy::ancestors, UsedIDsTreePolicy::maintain>;
+  check_against_reference_bitset<TestType, PrefetchPolicies>();
+  check_against_reference_bitset<TestType,
+                                 PoliciesWith<PrefetchPolicy::ancestors, MetadataNodePolicy::cache_line>>();
+
+  // set_free_for_ids is the same as set_free calls one by one
+  for(const size_t max_elements_exp : max_elements_exp_vals)
+  {
+    TreeBitset<TreeBitsetConfig<TestType, PrefetchPolicies>> tb{max_elements_exp};
+    TreeBitset<TreeBitsetConfig<TestType>>                   reference{max_elements_exp};
+
+    std::vector<size_t> ids(tb.max_elements() / 2);
+    for(size_t & id : ids)
+      id = g() & (tb.max_elements() - 1);
+    for(const bool value : {false, true})
+    {
+      const auto last = value ? begin(ids) + ids.size() / 2 : end(ids);
+      tb.set_free_for_ids(begin(ids), last, value);
+      std::for_each(begin(ids), last, [&](const size_t id) { reference.set_free(id, value); });
+      for(size_t id = 0; id < tb.max_elements(); ++id)
+        REQUIRE(tb.is_free(id) == reference.is_free(id));
+      REQUIRE(tb.max_used_id() == reference.max_used_id());
+      REQUIRE(tb.find_prev_used(tb.max_elements() - 1) == reference.find_prev_used(tb.max_elements() - 1));
+    }
+  }
+}
+
+// Grow or shrink random bitsets and compare them with the ones which got the same ids set one by one
+template <typename BlockT, typename Policies>
+void check_resizing()
+{
+  using Bitset                 = TreeBitset<TreeBitsetConfig<BlockT, Policies>>;
+  constexpr size_t max_exp     = std::min(std::numeric_limits<BlockT>::digits - 1, 18);
+  constexpr bool   is_external = Policies::template get<StoragePolicy>() == StoragePolicy::external;
+  for(const size_t max_elements_exp : {3, 6, 7, 12})
+  {
+    for(const size_t new_exp : {max_elements_exp + 1, max_elements_exp + 3, max_exp})
+    {
+      std::vector<BlockT> buffer, grown_buffer(Bitset::required_blocks(new_exp));
+      auto                make_bitset = [&](const size_t exp, std::vector<BlockT> & storage) {
+        storage.resize(Bitset::required_blocks(exp));
+        if constexpr(is_external)
+          return Bitset{exp, storage.data()};
+        else
+          return Bitset{exp};
+      };
+      Bitset tb = make_bitset(max_elements_exp, buffer);
+      for(size_t idx = 0; idx < tb.max_elements() / 2; ++idx)
+        tb.set_free(g() & (tb.max_elements() - 1), g() & 1);
+      // Some of the bitsets have no free ids left
+      if(g() & 1)
+        tb.set_free_for_range(0, tb.max_elements() / 2, false);
+
+      std::vector<BlockT> reference_buffer;
+      Bitset              reference = make_bitset(new_exp, reference_buffer);
+      for(size_t id = 0; id < tb.max_elements(); ++id)
+        if(!tb.is_free(id))
+          reference.set_free(id, false);
+
+      if constexpr(is_external)
+        tb.grow(new_exp, grown_buffer.data());
+      else
+        tb.grow(new_exp);
+      REQUIRE(tb.max_elements() == size_t{1} << new_exp);
+      REQUIRE(tb == reference);
+      REQUIRE(tb.max_used_id() == reference.max_used_id());
+      REQUIRE(tb.obtain_id() == reference.obtain_id());
+      REQUIRE(tb.find_prev_free(tb.max_elements() - 1) == tb.max_elements() - 1);
+      tb.set_free(tb.max_elements() - 1, false);
+      reference.set_free(reference.max_elements() - 1, false);
+      REQUIRE(tb == reference);
+
+      // Shrinking back to the ids below a random one, which are kept as they are
+      const size_t kept_ids = g() & ((size_t{1} << max_elements_exp) - 1);
+      tb.set_free_for_range(kept_ids, tb.max_elements() - 1, true);
+      const size_t max_used_id = tb.max_used_id();
+      size_t       shrunk_exp  = 0;
+      while(max_used_id != Bitset::invalid_id && size_t{1} << shrunk_exp <= max_used_id)
+        ++shrunk_exp;
+      std::vector<BlockT> shrunk_buffer(Bitset::required_blocks(shrunk_exp));
+      if constexpr(is_external)
+        tb.shrink_to_fit(shrunk_buffer.data());
+      else
+        tb.shrink_to_fit();
+      REQUIRE(tb.max_elements() == size_t{1} << shrunk_exp);
+      REQUIRE(tb.memory_footprint() == Bitset::required_blocks(shrunk_exp) * sizeof(BlockT));
+
+      std::vector<BlockT> shrunk_reference_buffer;
+      Bitset              shrunk_reference = make_bitset(shrunk_exp, shrunk_reference_buffer);
+      for(size_t id = 0; id < shrunk_reference.max_elements(); ++id)
+        if(!reference.is_free(id) && id < kept_ids)
+          shrunk_reference.set_free(id, false);
+      REQUIRE(tb == shrunk_reference);
+      REQUIRE(tb.max_used_id() == shrunk_reference.max_used_id());
+    }
+  }
+}
+
+TEMPLATE_TEST_CASE("Growing and shrinking capacity", "[resize]", uint16_t, uint32_t, uint64_t)
+{
+  check_resizing<TestType, PoliciesWith<>>();
+  check_resizing<TestType, PoliciesWith<UsedIDsTreePolicy::maintain>>();
+  check_resizing<TestType, PoliciesWith<UsedIDsTreePolicy::maintain, FreeBitPolicy::zero>>();
+  check_resizing<TestType, PoliciesWith<UsedIDsTreePolicy::maintain, StorageInitPolicy::lazy>>();
+  check_resizing<TestType,
+                 PoliciesWith<MaxIDPolicy::on_demand_max_id_calc, MetadataNodePolicy::cache_line>>();
+  check_resizing<
+    TestType,
+    PoliciesWith<MetadataNodePolicy::cache_line, UsedIDsTreePolicy::maintain, StorageInitPolicy::lazy>>();
+  check_resizing<TestType, PoliciesWith<StoragePolicy::external, UsedIDsTreePolicy::maintain>>();
+  check_resizing<TestType, PoliciesWith<StoragePolicy::memory_resource, FreeBitPolicy::zero>>();
+}
+
+// Run random operations on the capacities which aren't powers of two and check them against a plain bitset.
+// The nonexisting ids are never obtained, growing frees them and shrinking drops them
+template <typename BlockT, typename Policies>
+void check_arbitrary_capacities()
+{
+  using Bitset            = TreeBitset<TreeBitsetConfig<BlockT, Policies>>;
+  constexpr size_t bits   = std::numeric_limits<BlockT>::digits;
+  const size_t invalid_id = Bitset::invalid_id;
+  // Partial nodes on one, two and more levels
+  const std::vector<size_t> capacities = {1, 5, bits - 1, bits + 1, 1000, bits * bits + 3, 100'003, 300'007};
+  for(const size_t max_elements : capacities)
+  {
+    Bitset            tb{MaxElements{max_elements}};
+    std::vector<bool> bitset(max_elements, true);
+    REQUIRE(tb.max_elements() == max_elements);
+    REQUIRE(tb.memory_footprint() == Bitset::required_blocks(MaxElements{max_elements}) * sizeof(BlockT));
+
+    auto check_ids = [&] {
+      std::vector<size_t> used_ids;
+      for(size_t id = 0; id < max_elements; ++id)
+      {
+        REQUIRE(tb.is_free(id) == bitset[id]);
+        if(!bitset[id])
+          used_ids.emplace_back(id);
+      }
+      const auto iter = tb.used_ids_iter();
+      REQUIRE(std::equal(begin(used_ids), end(used_ids), iter.begin(), iter.end()));
+      REQUIRE(tb.max_used_id() == (used_ids.empty() ? invalid_id : used_ids.back()));
+      REQUIRE(tb.find_next_used(0) == (used_ids.empty() ? invalid_id : used_ids.front()));
+      REQUIRE(tb.find_prev_used(max_elements - 1) == tb.max_used_id());
+      const auto last_free = std::find(rbegin(bitset), rend(bitset), true);
+      REQUIRE(tb.find_prev_free(max_elements - 1) ==
+              (last_free == rend(bitset) ? invalid_id : size_t(rend(bitset) - last_free) - 1));
+      check_used_counts<Policies>(tb, bitset);
+    };
+
+    for(size_t id = 0; id < max_elements; ++id)
+      REQUIRE(tb.obtain_id() == id);
+    REQUIRE(tb.obtain_id() == invalid_id);
+    REQUIRE(tb.find_next_free(0) == invalid_id);
+    std::fill(begin(bitset), end(bitset), false);
+    check_ids();
+
+    for(size_t step = 0; step < 4; ++step)
+    {
+      for(size_t idx = 0; idx < max_elements / 2 + 1; ++idx)
+      {
+        const size_t id    = g() % max_elements;
+        const bool   value = g() & 1;
+        tb.set_free(id, value);
+        bitset[id] = value;
+      }
+      size_t min_id = g() % max_elements;
+      size_t max_id = g() % max_elements;
+      if(min_id > max_id)
+        std::swap(min_id, max_id);
+      const bool value = g() & 1;
+      tb.set_free_for_range(min_id, max_id, value);
+      std::fill(begin(bitset) + min_id, begin(bitset) + max_id + 1, value);
+      check_ids();
+
+      std::vector<size_t> obtained;
+      tb.obtain_ids(max_elements, std::back_inserter(obtained));
+      for(const size_t id : obtained)
+      {
+        REQUIRE((id < max_elements && bitset[id]));
+        bitset[id] = false;
+      }
+      REQUIRE(tb.obtain_id() == invalid_id);
+      check_ids();
+
+      const size_t first_freed = g() % max_elements;
+      tb.set_free_for_range(first_freed, max_elements - 1, true);
+      std::fill(begin(bitset) + first_freed, end(bitset), true);
+      check_ids();
+    }
+
+    // Bitsets which got the used ids one by one
+    auto rebuilt = [&](const size_t capacity) {
+      Bitset result{MaxElements{capacity}};
+      for(size_t id = 0; id < std::min(capacity, max_elements); ++id)
+        if(!bitset[id])
+          result.set_free(id, false);
+      return result;
+    };
+    REQUIRE(tb == rebuilt(max_elements));
+
+    std::vector<RLEBitAbbreviation> abbreviations;
+    std::vector<BlockT>             packed_blocks;
+    tb.pack([&abbreviations](const RLEBitAbbreviation & a) { abbreviations.emplace_back(a); },
+            [&packed_blocks](const BlockT block) { packed_blocks.emplace_back(block); });
+    const Bitset unpacked = Bitset::unpack(
+      MaxElements{max_elements}, packed_blocks.data(), abbreviations.data(), size(abbreviations));
+    REQUIRE(unpacked == tb);
+    REQUIRE(unpacked.max_used_id() == tb.max_used_id());
+    REQUIRE(unpacked.find_prev_free(max_elements - 1) == tb.find_prev_free(max_elements - 1));
+
+    Bitset       grown     = rebuilt(max_elements);
+    const size_t grown_exp = math::int_log2(max_elements) + 1;
+    grown.grow(grown_exp);
+    REQUIRE(grown == rebuilt(size_t{1} << grown_exp));
+    REQUIRE(grown.find_next_free(max_elements) == max_elements);
+
+    const size_t kept_ids = g() % max_elements;
+    tb.set_free_for_range(kept_ids, max_elements - 1, true);
+    std::fill(begin(bitset) + kept_ids, end(bitset), true);
+    size_t shrunk_capacity = 1;
+    while(tb.max_used_id() != invalid_id && shrunk_capacity <= tb.max_used_id())
+      shrunk_capacity *= 2;
+    tb.shrink_to_fit();
+    REQUIRE(tb.max_elements() == std::min(shrunk_capacity, max_elements));
+    REQUIRE(tb == rebuilt(tb.max_elements()));
+
+    tb.clean();
+    std::fill(begin(bitset), end(bitset), true);
+    REQUIRE(tb.obtain_id() == 0);
+    const size_t last_id = tb.max_elements() - 1;
+    REQUIRE(tb.find_prev_free(last_id) == (last_id ? last_id : invalid_id));
+  }
+}
+
+TEMPLATE_TEST_CASE("Arbitrary capacities", "[resize]", uint16_t, uint32_t, uint64_t)
+{
+  check_arbitrary_capacities<TestType, PoliciesWith<>>();
+  check_arbitrary_capacities<TestType, PoliciesWith<UsedIDsTreePolicy::maintain, FreeBitPolicy::zero>>();
+  check_arbitrary_capacities<TestType, PoliciesWith<MaxIDPolicy::on_demand_max_id_calc>>();
+  check_arbitrary_capacities<
+    TestType,
+    PoliciesWith<MetadataNodePolicy::cache_line, UsedIDsTreePolicy::maintain, StorageInitPolicy::lazy>>();
+  check_arbitrary_capacities<TestType,
+                             PoliciesWith<PrefetchPolicy::ancestors, UsedIDsTreePolicy::maintain>>();
+
+  // Files are only opened with the capacity which created them
+  using FileTreeBitset = TreeBitset<TreeBitsetConfig<TestType, PoliciesWith<StoragePolicy::mapped_file>>>;
+  const std::string path =
+    (std::filesystem::temp_directory_path() / "tree_bitset_arbitrary_capacity_test.bin").string();
+  std::filesystem::remove(path);
+  {
+    FileTreeBitset      tb{MaxElements{1000}, path.c_str()};
+    std::vector<size_t> obtained;
+    REQUIRE(tb.obtain_ids(2000, std::back_inserter(obtained)) == 1000);
+    tb.sync();
+  }
+  {
+    FileTreeBitset tb{MaxElements{1000}, path.c_str()};
+    REQUIRE(tb.max_used_id() == 999);
+    REQUIRE(tb.obtain_id() == FileTreeBitset::invalid_id);
+  }
+  REQUIRE_THROWS_AS((FileTreeBitset{MaxElements{1001}, path.c_str()}), std::runtime_error);
+  std::filesystem::remove(path);
+}
+
+TEMPLATE_TEST_CASE("Used counts", "[count]", uint16_t, uint32_t, uint64_t)
+{
+  using CountPolicies = PoliciesWith<UsedCountPolicy::maintain>;
+  check_against_reference_bitset<TestType, CountPolicies>();
+  check_against_reference_bitset<
+    TestType,
+    PoliciesWith<UsedCountPolicy::maintain, UsedIDsTreePolicy::maintain, FreeBitPolicy::zero>>();
+  check_against_reference_bitset<
+    TestType,
+    PoliciesWith<UsedCountPolicy::maintain, MetadataNodePolicy::cache_line, StorageInitPolicy::lazy>>();
+  check_against_reference_bitset<TestType,
+                                 PoliciesWith<UsedCountPolicy::maintain, PrefetchPolicy::ancestors>>();
+  check_arbitrary_capacities<TestType, CountPolicies>();
+  using CountUsedIDsTreePolicies =
+    PoliciesWith<UsedCountPolicy::maintain, UsedIDsTreePolicy::maintain, MaxIDPolicy::on_demand_max_id_calc>;
+  check_arbitrary_capacities<TestType, CountUsedIDsTreePolicies>();
+  // Counts of the resized bitsets are the same as the ones of the bitsets which got their ids one by one
+  check_resizing<TestType, CountPolicies>();
+  check_resizing<TestType, PoliciesWith<UsedCountPolicy::maintain, StorageInitPolicy::lazy>>();
+  check_resizing<TestType, PoliciesWith<UsedCountPolicy::maintain, MetadataNodePolicy::cache_line>>();
+  check_static_against_dynamic<TestType, 13, CountPolicies>();
+  check_mapped_file_reopening<TestType, UsedCountPolicy::maintain>();
+  check_mapped_file_reopening<TestType, UsedCountPolicy::maintain, StorageInitPolicy::lazy>();
+
+  TreeBitset<TreeBitsetConfig<TestType, CountPolicies>> tb{20};
+  REQUIRE(tb.free_count() == tb.max_elements());
+  tb.set_free_for_range(1000, 99'999, false);
+  REQUIRE(tb.used_count() == 99'000);
+  REQUIRE(tb.count_used(0, 999) == 0);
+  REQUIRE(tb.count_used(999, 1000) == 1);
+  REQUIRE(tb.count_used(50'000, tb.max_elements() - 1) == 50'000);
+  REQUIRE(tb.rank(1000) == 0);
+  REQUIRE(tb.rank(2024) == 1024);
+  REQUIRE(tb.select(0) == 1000);
+  REQUIRE(tb.select(1024) == 2024);
+  REQUIRE(tb.select(98'999) == 99'999);
+  REQUIRE(tb.select(99'000) == decltype(tb)::invalid_id);
+  tb.set_free(5000, true);
+  tb.set_free(5000, true);
+  REQUIRE(tb.obtain_id() == 0);
+  REQUIRE(tb.used_count() == 99'000);
+  tb.clean();
+  REQUIRE(tb.used_count() == 0);
+}
+
+TEMPLATE_TEST_CASE("Invalid max_id by default", "[max_id]", uint16_t, uint32_t, uint64_t)
+{
+  TreeBitset<TreeBitsetConfig<TestType>> tb{2};
+  REQUIRE(decltype(tb)::invalid_id == tb.max_used_id());
+}
+
+TEMPLATE_TEST_CASE("Determines max_id after unsetting random 1/2", "[max_id]", uint16_t, uint32_t, uint64_t)
+{
+  for(const size_t max_elements_exp : max_elements_exp_vals)
+  {
+    auto [tb, bitset] = prepare_random_data<TestType>(max_elements_exp, 2);
+    for(auto it = crbegin(bitset); it != crend(bitset); ++it)
+    {
+      if(*it == false)
+      {
+        const size_t max_id = size(bitset) - std::distance(crbegin(bitset), it) - 1;
+        REQUIRE(tb.max_used_id() == max_id);
+        break;
+      }
+    }
+  }
+}
+
+TEMPLATE_TEST_CASE(
+  "Determines max_id after obtaining 1/2 elements at each step", "[max_id]", uint16_t, uint32_t, uint64_t)
+{
+  for(const size_t max_elements_exp : max_elements_exp_vals)
+  {
+    TreeBitset<TreeBitsetConfig<TestType>> tb{max_elements_exp};
+    for(size_t idx = 0; idx < tb.max_elements() / 2; ++idx)
+    {
+      const size_t new_id = tb.obtain_id();
+      REQUIRE(tb.max_used_id() == new_id);
+    }
+  }
+}
+
+TEMPLATE_TEST_CASE("Determines max_id after obtaining 1/2 elements and freeing max element at each step",
+                   "[max_id]",
+                   uint16_t,
+                   uint32_t,
+                   uint64_t)
+{
+  for(const size_t max_elements_exp : max_elements_exp_vals)
+  {
+    TreeBitset<TreeBitsetConfig<TestType>> tb{max_elements_exp};
+    for(size_t idx = 0; idx < tb.max_elements() / 2; ++idx)
+    {
+      const size_t new_id = tb.obtain_id();
+      REQUIRE(tb.max_used_id() == new_id);
+      tb.set_free(new_id, true);
+      if(idx == 0)
+        REQUIRE(tb.max_used_id() == decltype(tb)::invalid_id);
+      else
+        REQUIRE(tb.max_used_id() == new_id - 1);
+      // reobtain ID
+      tb.obtain_id();
+    }
+  }
+}
+
+TEMPLATE_TEST_CASE("Determines max_id at each step while freeing IDs from max to min",
+                   "[max_id]",
+
+                   uint16_t,
+                   uint32_t,
+                   uint64_t)
+{
+  for(const size_t max_elements_exp : max_elements_exp_vals)
+  {
+    auto [tb, bitset] = prepare_random_data<TestType>(max_elements_exp, 2);
+
+    for(auto it = crbegin(bitset); it != crend(bitset); ++it)
+    {
+      if(*it == false)
+      {
+        const size_t max_id = size(bitset) - std::distance(crbegin(bitset), it) - 1;
+        REQUIRE(tb.max_used_id() == max_id);
+        tb.set_free(max_id, true);
+      }
+    }
+  }
+}
+
+TEMPLATE_TEST_CASE("Determines max_id at each step while freeing IDs in random order",
+                   "[max_id]",
+                   uint16_t,
+                   uint32_t,
+                   uint64_t)
+{
+  for(const size_t max_elements_exp : max_elements_exp_vals)
+  {
+    auto [tb, bitset] = prepare_random_data<TestType>(max_elements_exp, 2);
+
+    for(size_t idx = 0; idx < tb.max_elements(); ++idx)
+      REQUIRE(bitset[idx] == tb.is_free(idx));
+
+    std::vector<size_t> max_id_history;
+    for(auto it = begin(bitset); it != end(bitset); ++it)
+    {
+      if(*it == false)
+        max_id_history.emplace_back(static_cast<size_t>(std::distance(begin(bitset), it)));
+    }
+    size_t * max_id = &max_id_history.back();
+
+    std::vector<size_t> shuffled_ids{max_id_history};
+    std::shuffle(begin(shuffled_ids), end(shuffled_ids), g);
+    std::unordered_set<size_t> freed_ids;
+    for(const size_t id : shuffled_ids)
+    {
+      freed_ids.emplace(id);
+      INFO("id: " << id);
+      REQUIRE(tb.max_used_id() == *max_id);
+      tb.set_free(id, true);
+      if(id == *max_id)
+      {
+        while(freed_ids.count(*max_id))
+          --max_id;
+      }
+    }
+  }
+}
+
+TEMPLATE_TEST_CASE("Determines max_id on demand", "[max_id]", uint16_t, uint32_t, uint64_t)
+{
+  using OnDemandPolicies = PoliciesWith<MaxIDPolicy::on_demand_max_id_calc>;
+  using OnDemandUsedIDsTreePolicies =
+    PoliciesWith<MaxIDPolicy::on_demand_max_id_calc, UsedIDsTreePolicy::maintain>;
+
+  auto check = [](auto & tb, std::vector<bool> & bitset) {
+    const size_t invalid_id = std::remove_reference_t<decltype(tb)>::invalid_id;
+    for(size_t step = 0; step < tb.max_elements(); ++step)
+    {
+      const size_t max_id =
+        std::distance(std::find(crbegin(bitset), crend(bitset), false), crend(bitset)) - size_t{1};
+      REQUIRE(tb.max_used_id() == max_id);
+      if(max_id == invalid_id)
+        break;
+      size_t n_used = 0;
+      for(const size_t id : tb.used_ids_iter())
+      {
+        REQUIRE_FALSE(bitset[id]);
+        ++n_used;
+      }
+      REQUIRE(n_used == static_cast<size_t>(std::count(begin(bitset), end(bitset), false)));
+
+      const size_t id = g() & (tb.max_elements() - 1);
+      tb.set_free(id, true);
+      bitset[id] = true;
+      if(step % 4 == 0)
+      {
+        tb.set_free(max_id, true);
+        bitset[max_id] = true;
+      }
+    }
+  };
+
+  for(const size_t max_elements_exp : max_elements_exp_vals)
+  {
+    auto [tb, bitset] = prepare_random_data<TestType, OnDemandPolicies>(max_elements_exp, 2);
+    check(tb, bitset);
+
+    auto [tree_tb, tree_bitset] =
+      prepare_random_data<TestType, OnDemandUsedIDsTreePolicies>(max_elements_exp, 2);
+    check(tree_tb, tree_bitset);
+  }
+}
+
+TEMPLATE_TEST_CASE("Used IDs iterator", "[iter]", uint16_t, uint32_t, uint64_t)
+{
+  for(const size_t max_elements_exp : max_elements_exp_vals)
+  {
+    TreeBitset<TreeBitsetConfig<TestType>> empty{max_elements_exp};
+    for(size_t id : empty.used_ids_iter())
+    {
+      (void)id;
+      REQUIRE(false);
+    }
+
+    auto [tb, bitset] = prepare_random_data<TestType>(max_elements_exp, 2);
+    for(size_t id : tb.used_ids_iter())
+    {
+      INFO("id: " << id);
+      INFO("max elements: " << tb.max_elements());
+      REQUIRE(!bitset[id]);
+      bitset[id] = true;
+    }
+    size_t id = 0;
+    for(const bool bit : bitset)
+    {
+      INFO("id: " << id);
+      REQUIRE(bit);
+      id++;
+    }
+  }
+}
+
+TEMPLATE_TEST_CASE("(Un)packing", "[pack]", uint16_t, uint32_t, uint64_t)
+{
+  for(const size_t max_elements_exp : max_elements_exp_vals)
+  {
+    auto [tb, _] = prepare_random_data<TestType>(max_elements_exp, 2);
+
+    std::vector<RLEBitAbbreviation> abbreviations;
+    std::vector<TestType>           packed_blocks;
+    tb.pack([&abbreviations](const RLEBitAbbreviation & a) { abbreviations.emplace_back(a); },
+            [&packed_blocks](const TestType block) { packed_blocks.emplace_back(block); });
+
+    REQUIRE(!packed_blocks.empty());
+
+    auto unpacked =
+      decltype(tb)::unpack(max_elements_exp, packed_blocks.data(), abbreviations.data(), size(abbreviations));
+
+    REQUIRE(unpacked == tb);
+  }
+}
+
+/// BENCHMARKS
+
+TEST_CASE("TreeBitset<uint64> with 2^23 elements", "[bench]")
+{
+  BENCHMARK("init + obtain all in order")
+  {
+    TreeBitset tb{23};
+    for(size_t idx = 0; idx < tb.max_elements(); ++idx)
+      tb.obtain_id();
+    REQUIRE_FALSE(tb.is_free(123));
+  };
+
+  BENCHMARK_ADVANCED("obtain 1024 in order")(Catch::Benchmark::Chronometer meter)
+  {
+    TreeBitset<> tb{23};
+    meter.measure([&] {
+      for(size_t idx = 0; idx < 1024; ++idx)
+        tb.obtain_id();
+      REQUIRE_FALSE(tb.is_free(123));
+    });
+  };
+
+  BENCHMARK_ADVANCED("obtain all in order")(Catch::Benchmark::Chronometer meter)
+  {
+    TreeBitset<> tb{23};
+    meter.measure([&] {
+      for(size_t idx = 0; idx < tb.max_elements(); ++idx)
+        tb.obtain_id();
+      REQUIRE_FALSE(tb.is_free(123));
+    });
+  };
+
+  BENCHMARK_ADVANCED("obtain 1024 near random hints")(Catch::Benchmark::Chronometer meter)
+  {
+    TreeBitset<> tb{23};
+
+    const size_t max_elements = tb.max_elements();
+    for(size_t idx = 0; idx < max_elements / 2; ++idx)
+      tb.set_free(g() % max_elements, false);
+
+    std::vector<size_t> hints(1024);
+    for(size_t & hint : hints)
+      hint = g() % max_elements;
+
+    meter.measure([&] {
+      size_t result = 0;
+      for(const size_t hint : hints)
+        result ^= tb.obtain_id_near(hint);
+      return result;
+    });
+  };
+
+  BENCHMARK_ADVANCED("obtain half in order")(Catch::Benchmark::Chronometer meter)
+  {
+    TreeBitset<> tb{23};
+    const size_t n_elements = tb.max_elements() / 2;
+    meter.measure([&] {
+      for(size_t idx = 0; idx < n_elements; ++idx)
+        tb.obtain_id();
+      REQUIRE_FALSE(tb.is_free(123));
+    });
+  };
+
+  BENCHMARK_ADVANCED("obtain half - random free order")(Catch::Benchmark::Chronometer meter)
+  {
+    TreeBitset<> tb{23};
+
+    const size_t max_elements = tb.max_elements();
+    for(size_t idx = 0; idx < max_elements / 2; ++idx)
+      tb.set_free(g() % max_elements, false);
+
+    meter.measure([&] {
+      const size_t max_elements = tb.max_elements();
+      for(size_t idx = 0; idx < max_elements / 2; ++idx)
+        tb.obtain_id();
+      return tb.is_free(0);
+    });
+  };
+
+  BENCHMARK_ADVANCED("set all unfree manually")(Catch::Benchmark::Chronometer meter)
+  {
+    TreeBitset<> tb{23};
+
+    const size_t max_elements = tb.max_elements();
+    for(size_t idx = 0; idx < max_elements / 2; ++idx)
+      tb.set_free(g() % max_elements, false);
+
+    meter.measure([&] {
+      const size_t max_elements = tb.max_elements();
+      for(size_t idx = 0; idx < max_elements; ++idx)
+        tb.set_free(idx, false);
+      REQUIRE_FALSE(tb.is_free(123));
+    });
+  };
+
+  BENCHMARK_ADVANCED("pack+unpack to a pre-allocated buffers")(Catch::Benchmark::Chronometer meter)
+  {
+    TreeBitset<> tb{23};
+
+    const size_t max_elements = tb.max_elements();
+    for(size_t idx = 0; idx < max_elements / 2; ++idx)
+      tb.set_free(g() % max_elements, false);
+
+    std::vector<uint64_t> packed_blocks(tb.max_elements(), 0);
+    size_t                packed_blocks_iter = 0;
 
     std::vector<RLEBitAbbreviation> abbreviations(tb.max_elements(), RLEBitAbbreviation{});
     size_t                          abbreviations_iter = 0;
 
     meter.measure([&] {
-      // need to reset buffer positions, since it'll be run many times
-      packed_blocks_iter = 0;
-      abbreviations_iter = 0;
-      tb.pack([&](const RLEBitAbbreviation & a) { abbreviations[abbreviations_iter++] = a; },
-              [&](const uint64_t block) { packed_blocks[packed_blocks_iter++] = block; });
+      // need to reset buffer positions, since it'll be run many times
+      packed_blocks_iter = 0;
+      abbreviations_iter = 0;
+      tb.pack([&](const RLEBitAbbreviation & a) { abbreviations[abbreviations_iter++] = a; },
+              [&](const uint64_t block) { packed_blocks[packed_blocks_iter++] = block; });
+
+      auto unpacked =
+        TreeBitset<>::unpack(23, packed_blocks.data(), abbreviations.data(), size(abbreviations));
+      REQUIRE(unpacked.max_elements() == tb.max_elements());
+    });
+  };
+}
+
+TEST_CASE("TreeBitset<uint64> bulk obtain bursts", "[bench]")
+{
+  for(const size_t burst_exp : {10, 16, 20})
+  {
+    const size_t burst = size_t{1} << burst_exp;
+    // Each run gets its own bitset, so no run finds its bitset already exhausted
+    auto make_bitsets = [&](const int runs) {
+      std::vector<TreeBitset<>> bitsets;
+      bitsets.reserve(runs);
+      for(int run = 0; run < runs; ++run)
+        bitsets.emplace_back(burst_exp + 1);
+      return bitsets;
+    };
+    std::vector<size_t> ids(burst);
+
+    BENCHMARK_ADVANCED("obtain_id() x " + std::to_string(burst))(Catch::Benchmark::Chronometer meter)
+    {
+      auto bitsets = make_bitsets(meter.runs());
+      meter.measure([&](const int run) {
+        for(size_t idx = 0; idx < burst; ++idx)
+          ids[idx] = bitsets[run].obtain_id();
+        return ids.back();
+      });
+    };
+
+    BENCHMARK_ADVANCED("obtain_ids(" + std::to_string(burst) + ")")(Catch::Benchmark::Chronometer meter)
+    {
+      auto bitsets = make_bitsets(meter.runs());
+      meter.measure([&](const int run) { return bitsets[run].obtain_ids(burst, begin(ids)); });
+    };
+  }
+}
+
+TEST_CASE("TreeBitset<uint64> range set of 2^22 ids", "[bench]")
+{
+  constexpr size_t range_size = size_t{1} << 22;
+
+  BENCHMARK_ADVANCED("set_free_for_range - unfree + free")(Catch::Benchmark::Chronometer meter)
+  {
+    TreeBitset<> tb{23};
+    tb.set_free(range_size, false);
+    meter.measure([&] {
+      tb.set_free_for_range(0, range_size - 1, false);
+      tb.set_free_for_range(0, range_size - 1, true);
+      return tb.is_free(123);
+    });
+  };
+
+  BENCHMARK_ADVANCED("memset of the same bits x2")(Catch::Benchmark::Chronometer meter)
+  {
+    std::vector<uint64_t> bits(range_size / 64);
+    meter.measure([&] {
+      memset(bits.data(), 0, bits.size() * sizeof(uint64_t));
+      memset(bits.data(), 0xff, bits.size() * sizeof(uint64_t));
+      return bits[123];
+    });
+  };
+}
+
+TEST_CASE("TreeBitset<uint64> successor and predecessor queries", "[bench]")
+{
+  for(const size_t max_elements_exp : {23, 30})
+  {
+    const std::string suffix = " at 2^" + std::to_string(max_elements_exp);
+
+    TreeBitset<> sparse{max_elements_exp};
+    TreeBitset<> dense{max_elements_exp};
+
+    const size_t max_elements = sparse.max_elements();
+    dense.set_free_for_range(0, max_elements - 1, false);
+    for(size_t idx = 0; idx < 4096; ++idx)
+    {
+      sparse.set_free(g() % max_elements, false);
+      dense.set_free(g() % max_elements, true);
+    }
+
+    std::vector<size_t> ids(1024);
+    for(size_t & id : ids)
+      id = g() % max_elements;
+
+    BENCHMARK("find_next_free x 1024 - dense" + suffix)
+    {
+      size_t result = 0;
+      for(const size_t id : ids)
+        result ^= dense.find_next_free(id);
+      return result;
+    };
+
+    BENCHMARK("find_next_used x 1024 - sparse" + suffix)
+    {
+      size_t result = 0;
+      for(const size_t id : ids)
+        result ^= sparse.find_next_used(id);
+      return result;
+    };
+
+    BENCHMARK("find_prev_used x 1024 - sparse" + suffix)
+    {
+      size_t result = 0;
+      for(const size_t id : ids)
+        result ^= sparse.find_prev_used(id);
+      return result;
+    };
+  }
+}
+
+TEST_CASE("TreeBitset<uint64> max id recalculation worst case", "[bench]")
+{
+  using UsedIDsTreeConfig = TreeBitsetConfig<uint64_t, PoliciesWith<UsedIDsTreePolicy::maintain>>;
+  constexpr size_t prev_used_id = 123;
+  constexpr size_t max_used_id  = prev_used_id + (size_t{1} << 22);
+
+  BENCHMARK_ADVANCED("free max id - data blocks scan")(Catch::Benchmark::Chronometer meter)
+  {
+    TreeBitset<> tb{23};
+    tb.set_free(prev_used_id, false);
+    meter.measure([&] {
+      tb.set_free(max_used_id, false);
+      tb.set_free(max_used_id, true);
+      return tb.max_used_id();
+    });
+  };
+
+  BENCHMARK_ADVANCED("free max id - used IDs tree")(Catch::Benchmark::Chronometer meter)
+  {
+    TreeBitset<UsedIDsTreeConfig> tb{23};
+    tb.set_free(prev_used_id, false);
+    meter.measure([&] {
+      tb.set_free(max_used_id, false);
+      tb.set_free(max_used_id, true);
+      return tb.max_used_id();
+    });
+  };
+}
+
+TEST_CASE("TreeBitset<uint64> obtain/free churn with 2^23 elements", "[bench]")
+{
+  auto churn = [](auto & tb, std::vector<size_t> & ids) {
+    for(size_t & id : ids)
+    {
+      tb.set_free(id, true);
+      id = tb.obtain_id();
+    }
+    return ids.back();
+  };
+
+  auto prepare = [](auto & tb, std::vector<size_t> & ids) {
+    const size_t max_elements = tb.max_elements();
+    for(size_t idx = 0; idx < max_elements / 2; ++idx)
+      tb.set_free(g() % max_elements, false);
+    for(size_t & id : ids)
+    {
+      id = g() % max_elements;
+      tb.set_free(id, false);
+    }
+    std::shuffle(begin(ids), end(ids), g);
+  };
+
+  BENCHMARK_ADVANCED("keep_max_id_current")(Catch::Benchmark::Chronometer meter)
+  {
+    TreeBitset<>        tb{23};
+    std::vector<size_t> ids(size_t{1} << 16);
+    prepare(tb, ids);
+    meter.measure([&] { return churn(tb, ids); });
+  };
+
+  BENCHMARK_ADVANCED("on_demand_max_id_calc")(Catch::Benchmark::Chronometer meter)
+  {
+    using OnDemandConfig = TreeBitsetConfig<uint64_t, PoliciesWith<MaxIDPolicy::on_demand_max_id_calc>>;
+    TreeBitset<OnDemandConfig> tb{23};
+    std::vector<size_t>        ids(size_t{1} << 16);
+    prepare(tb, ids);
+    meter.measure([&] { return churn(tb, ids); });
+  };
+}
+
+TEST_CASE("TreeBitset<uint64> construction with 2^30 elements", "[bench]")
+{
+  using ZeroConfig = TreeBitsetConfig<uint64_t, PoliciesWith<FreeBitPolicy::zero>>;
+  using LazyConfig = TreeBitsetConfig<uint64_t, PoliciesWith<StorageInitPolicy::lazy>>;
+
+  auto report_rss = [](const char * policy_name, auto make_tb) {
+    const size_t rss_before = resident_memory();
+    auto         tb         = make_tb();
+    tb.obtain_id();
+    tb.set_free(tb.max_elements() - 1, false);
+    printf("%s RSS growth: %zu KiB\n", policy_name, (resident_memory() - rss_before) / 1024);
+  };
+  report_rss("FreeBitPolicy::one", [] { return TreeBitset<>{30}; });
+  report_rss("FreeBitPolicy::zero", [] { return TreeBitset<ZeroConfig>{30}; });
+  report_rss("StorageInitPolicy::lazy", [] { return TreeBitset<LazyConfig>{30}; });
+
+  // Capacity independent with the lazy initialization
+  for(const size_t max_elements_exp : {23, 30})
+  {
+    const std::string suffix      = " - 2^" + std::to_string(max_elements_exp);
+    auto              obtain_1024 = [](auto & tb) {
+      for(size_t idx = 0; idx < 1024; ++idx)
+        tb.obtain_id();
+      return tb.is_free(123);
+    };
+
+    BENCHMARK("construct + obtain 1024 - StorageInitPolicy::eager" + suffix)
+    {
+      TreeBitset<> tb{max_elements_exp};
+      return obtain_1024(tb);
+    };
+
+    BENCHMARK("construct + obtain 1024 - StorageInitPolicy::lazy" + suffix)
+    {
+      TreeBitset<LazyConfig> tb{max_elements_exp};
+      return obtain_1024(tb);
+    };
+  }
+
+  BENCHMARK("construct - FreeBitPolicy::one")
+  {
+    return TreeBitset<>{30}.obtain_id();
+  };
+
+  BENCHMARK("construct - FreeBitPolicy::zero")
+  {
+    return TreeBitset<ZeroConfig>{30}.obtain_id();
+  };
+
+  BENCHMARK_ADVANCED("clean - FreeBitPolicy::one")(Catch::Benchmark::Chronometer meter)
+  {
+    TreeBitset<> tb{30};
+    meter.measure([&] {
+      tb.clean();
+      return tb.obtain_id();
+    });
+  };
+
+  BENCHMARK_ADVANCED("clean - FreeBitPolicy::zero")(Catch::Benchmark::Chronometer meter)
+  {
+    TreeBitset<ZeroConfig> tb{30};
+    meter.measure([&] {
+      tb.clean();
+      return tb.obtain_id();
+    });
+  };
+
+  BENCHMARK_ADVANCED("clean - StorageInitPolicy::lazy")(Catch::Benchmark::Chronometer meter)
+  {
+    TreeBitset<LazyConfig> tb{30};
+    meter.measure([&] {
+      tb.clean();
+      return tb.obtain_id();
+    });
+  };
+}
+
+TEST_CASE("TreeBitset<uint64> create and destroy 100K bitsets with 2^12 elements", "[bench]")
+{
+  constexpr size_t max_elements_exp = 12;
+  constexpr size_t num_bitsets      = 100'000;
+
+  // All of the bitsets are alive at the same time, then they're destroyed
+  auto create_and_destroy = [](auto make_tb) {
+    using TreeBitsetT = decltype(make_tb(size_t{0}));
+    std::vector<TreeBitsetT> bitsets;
+    bitsets.reserve(num_bitsets);
+    size_t result = 0;
+    for(size_t idx = 0; idx < num_bitsets; ++idx)
+      result += bitsets.emplace_back(make_tb(idx)).obtain_id();
+    return result;
+  };
+
+  BENCHMARK("StoragePolicy::owning")
+  {
+    return create_and_destroy([](size_t) { return TreeBitset<>{max_elements_exp}; });
+  };
+
+  BENCHMARK_ADVANCED("StoragePolicy::memory_resource - monotonic arena")(Catch::Benchmark::Chronometer meter)
+  {
+    using ResourceConfig = TreeBitsetConfig<uint64_t, PoliciesWith<StoragePolicy::memory_resource>>;
+    const size_t bitset_bytes =
+      TreeBitset<ResourceConfig>::required_blocks(max_elements_exp) * sizeof(uint64_t);
+    std::vector<std::byte> arena_memory(num_bitsets * bitset_bytes);
+    meter.measure([&] {
+      std::pmr::monotonic_buffer_resource arena{
+        arena_memory.data(), arena_memory.size(), std::pmr::null_memory_resource()};
+      return create_and_destroy(
+        [&](size_t) { return TreeBitset<ResourceConfig>{max_elements_exp, &arena}; });
+    });
+  };
+
+  BENCHMARK_ADVANCED("StoragePolicy::external - bump arena")(Catch::Benchmark::Chronometer meter)
+  {
+    using ExternalConfig = TreeBitsetConfig<uint64_t, PoliciesWith<StoragePolicy::external>>;
+    constexpr size_t      bitset_blocks = TreeBitset<ExternalConfig>::required_blocks(max_elements_exp);
+    std::vector<uint64_t> arena(num_bitsets * bitset_blocks);
+    meter.measure([&] {
+      return create_and_destroy([&](const size_t idx) {
+        return TreeBitset<ExternalConfig>{max_elements_exp, arena.data() + idx * bitset_blocks};
+      });
+    });
+  };
+}
 
-      auto unpacked =
-        TreeBitset<>::unpack(23, packed_blocks.data(), abbreviations.data(), size(abbreviations));
-      REQUIRE(unpacked.max_elements() == tb.max_elements());
+TEST_CASE("TreeBitset<uint64> compile-time capacity with 2^23 elements", "[bench]")
+{
+  constexpr size_t max_elements_exp = 23;
+
+  std::vector<size_t> ids(1024);
+  for(size_t & id : ids)
+    id = g() & ((size_t{1} << max_elements_exp) - 1);
+
+  auto bench = [&](auto & tb, const std::string & suffix) {
+    BENCHMARK_ADVANCED("obtain 1024 in order" + suffix)(Catch::Benchmark::Chronometer meter)
+    {
+      tb.clean();
+      meter.measure([&] {
+        for(size_t idx = 0; idx < 1024; ++idx)
+          tb.obtain_id();
+        return tb.max_used_id();
+      });
+    };
+
+    BENCHMARK("set_free x 1024 random" + suffix)
+    {
+      for(const size_t id : ids)
+        tb.set_free(id, false);
+      for(const size_t id : ids)
+        tb.set_free(id, true);
+      return tb.max_used_id();
+    };
+  };
+
+  TreeBitset<> tb{max_elements_exp};
+  bench(tb, " - runtime capacity");
+
+  auto static_tb = std::make_unique<StaticTreeBitset<TreeBitsetConfig<>, max_elements_exp>>();
+  bench(*static_tb, " - compile-time capacity");
+}
+
+TEST_CASE("TreeBitset<uint64> cache line metadata nodes with 2^30 elements", "[bench]")
+{
+  constexpr size_t max_elements_exp = 30;
+  using CacheLineConfig = TreeBitsetConfig<uint64_t, PoliciesWith<MetadataNodePolicy::cache_line>>;
+
+  // Free ids are sparse, so every descent takes its own path through the metadata which is bigger than caches
+  std::vector<size_t> ids(4096);
+  for(size_t & id : ids)
+    id = g() & ((size_t{1} << max_elements_exp) - 1);
+
+  auto bench = [&](auto & tb, const std::string & policy_name) {
+    const std::string suffix = " - " + policy_name;
+    tb.set_free_for_range(0, tb.max_elements() - 1, false);
+    // Each level of a descent touches a single cache line
+    printf("%s: %d metadata levels, %zu KiB of metadata, %d cache lines per descent\n",
+           policy_name.c_str(),
+           tb.num_metadata_levels(),
+           tb.num_metadata_blocks() * sizeof(uint64_t) / 1024,
+           tb.num_metadata_levels() + 1);
+
+    BENCHMARK("free + obtain_id x 4096 random" + suffix)
+    {
+      for(const size_t id : ids)
+        tb.set_free(id, true);
+      size_t sum = 0;
+      for(size_t idx = 0; idx < ids.size(); ++idx)
+        sum += tb.obtain_id();
+      return sum;
+    };
+
+    for(const size_t id : ids)
+      tb.set_free(id, true);
+    BENCHMARK("find_next_free x 4096 random" + suffix)
+    {
+      size_t sum = 0;
+      for(const size_t id : ids)
+        sum += tb.find_next_free(id ^ 0x5555);
+      return sum;
+    };
+  };
+
+  {
+    TreeBitset<> tb{max_elements_exp};
+    bench(tb, "MetadataNodePolicy::block");
+  }
+  TreeBitset<CacheLineConfig> tb{max_elements_exp};
+  bench(tb, "MetadataNodePolicy::cache_line");
+}
+
+// Evict the memory from all cache levels where we can
+void flush_caches([[maybe_unused]] const void * ptr, [[maybe_unused]] const size_t bytes)
+{
+#if defined(__x86_64__) || defined(_M_X64)
+  for(size_t offset = 0; offset < bytes; offset += 64)
+    _mm_clflush(static_cast<const char *>(ptr) + offset);
+  _mm_mfence();
+#endif
+}
+
+// Catch benchmarks run the measured code back to back, so the caches are flushed and the time is taken
+// manually
+template <PrefetchPolicy Prefetch, typename FreeIDs>
+void report_cold_cache_updates(const char * name, FreeIDs free_ids)
+{
+  using ExternalConfig = TreeBitsetConfig<uint64_t, PoliciesWith<StoragePolicy::external, Prefetch>>;
+  constexpr size_t max_elements_exp = 30;
+  constexpr int    iterations       = 16;
+
+  std::vector<uint64_t>      storage(TreeBitset<ExternalConfig>::required_blocks(max_elements_exp));
+  TreeBitset<ExternalConfig> tb{max_elements_exp, storage.data()};
+  tb.set_free_for_range(0, tb.max_elements() - 1, false);
+
+  using clock = std::chrono::steady_clock;
+  clock::duration     free_time{}, obtain_time{};
+  std::vector<size_t> ids(256);
+  for(int iteration = 0; iteration < iterations; ++iteration)
+  {
+    for(size_t & id : ids)
+      id = g() & (tb.max_elements() - 1);
+
+    flush_caches(storage.data(), storage.size() * sizeof(uint64_t));
+    const auto free_start = clock::now();
+    free_ids(tb, ids);
+    free_time += clock::now() - free_start;
+
+    flush_caches(storage.data(), storage.size() * sizeof(uint64_t));
+    const auto obtain_start = clock::now();
+    for(size_t idx = 0; idx < ids.size(); ++idx)
+      tb.obtain_id();
+    obtain_time += clock::now() - obtain_start;
+  }
+  auto per_id_ns = [&](const clock::duration time) {
+    return std::chrono::duration<double, std::nano>(time).count() / (iterations * ids.size());
+  };
+  printf("%s: free %.1f ns, obtain_id %.1f ns per id\n", name, per_id_ns(free_time), per_id_ns(obtain_time));
+}
+
+TEST_CASE("TreeBitset<uint64> cold cache updates with 2^30 elements", "[bench]")
+{
+  auto set_free_each = [](auto & tb, const std::vector<size_t> & ids) {
+    for(const size_t id : ids)
+      tb.set_free(id, true);
+  };
+  auto set_free_for_ids = [](auto & tb, const std::vector<size_t> & ids) {
+    tb.set_free_for_ids(begin(ids), end(ids), true);
+  };
+  report_cold_cache_updates<PrefetchPolicy::none>("PrefetchPolicy::none - set_free", set_free_each);
+  report_cold_cache_updates<PrefetchPolicy::ancestors>("PrefetchPolicy::ancestors - set_free", set_free_each);
+  report_cold_cache_updates<PrefetchPolicy::ancestors>("PrefetchPolicy::ancestors - set_free_for_ids",
+                                                       set_free_for_ids);
+}
+
+TEST_CASE("TreeBitset<uint64> random access with 2^32 elements on 4 KiB and 2 MiB pages", "[bench]")
+{
+  using ResourceConfig = TreeBitsetConfig<uint64_t, PoliciesWith<StoragePolicy::memory_resource>>;
+  constexpr size_t max_elements_exp = 32;
+
+  std::vector<size_t> ids(size_t{1} << 16);
+  for(size_t & id : ids)
+    id = (size_t{g()} << 32 | g()) & ((size_t{1} << max_elements_exp) - 1);
+
+  for(const bool huge_pages : {false, true})
+  {
+    MappedMemoryResource       resource{{huge_pages}};
+    TreeBitset<ResourceConfig> tb{max_elements_exp, &resource};
+    const char * const         pages_names[] = {"base", "huge", "transparent_huge"};
+    const std::string          suffix =
+      std::string{" - "} + pages_names[static_cast<int>(resource.last_pages())] + " pages";
+
+    BENCHMARK("set_free x 65536 random" + suffix)
+    {
+      for(const size_t id : ids)
+        tb.set_free(id, false);
+      for(const size_t id : ids)
+        tb.set_free(id, true);
+      return tb.max_used_id();
+    };
+
+    BENCHMARK("is_free x 65536 random" + suffix)
+    {
+      size_t n_free = 0;
+      for(const size_t id : ids)
+        n_free += tb.is_free(id);
+      return n_free;
+    };
+  }
+}
+
+TEST_CASE("TreeBitset<uint64> opening a mapped file with 2^30 elements", "[bench]")
+{
+  using FileConfig = TreeBitsetConfig<uint64_t, PoliciesWith<StoragePolicy::mapped_file>>;
+  constexpr size_t max_elements_exp = 30;
+  const std::string path =
+    (std::filesystem::temp_directory_path() / "tree_bitset_open_bench.bin").string();
+  std::filesystem::remove(path);
+
+  std::vector<RLEBitAbbreviation> abbreviations;
+  std::vector<uint64_t>           packed_blocks;
+  {
+    TreeBitset<FileConfig> tb{max_elements_exp, path.c_str()};
+    std::vector<size_t>    obtained;
+    tb.obtain_ids(size_t{1} << 20, std::back_inserter(obtained));
+    for(size_t idx = 0; idx < (size_t{1} << 16); ++idx)
+      tb.set_free((size_t{g()} << 32 | g()) & (tb.max_elements() - 1), false);
+    tb.sync();
+    tb.pack([&abbreviations](const RLEBitAbbreviation & a) { abbreviations.emplace_back(a); },
+            [&packed_blocks](const uint64_t block) { packed_blocks.emplace_back(block); });
+  }
+  printf("packed blocks: %zu, abbreviations: %zu\n", size(packed_blocks), size(abbreviations));
+
+  BENCHMARK("open the mapped file")
+  {
+    return TreeBitset<FileConfig>{max_elements_exp, path.c_str()}.max_used_id();
+  };
+
+  BENCHMARK("unpack")
+  {
+    return TreeBitset<>::unpack(
+             max_elements_exp, packed_blocks.data(), abbreviations.data(), size(abbreviations))
+      .max_used_id();
+  };
+
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("TreeBitset<uint64> doubling the capacity from 2^20 to 2^30 elements and shrinking back", "[bench]")
+{
+  using LazyConfig = TreeBitsetConfig<uint64_t, PoliciesWith<StorageInitPolicy::lazy>>;
+  using clock      = std::chrono::steady_clock;
+  auto elapsed_ms  = [](const clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(clock::now() - start).count();
+  };
+
+  // The first half of the ids and some random ones are used before every doubling. Rebuilding sets the used
+  // ids of a new bitset one by one
+  auto run = [&](const char * policy_name, auto tb) {
+    using Bitset = decltype(tb);
+    double grow_total_ms = 0, rebuild_total_ms = 0;
+    for(size_t max_elements_exp = 21; max_elements_exp <= 30; ++max_elements_exp)
+    {
+      tb.set_free_for_range(0, tb.max_elements() / 2 - 1, false);
+      for(size_t idx = 0; idx < (size_t{1} << 16); ++idx)
+        tb.set_free(g() & (tb.max_elements() - 1), false);
+
+      auto         start = clock::now();
+      Bitset       rebuilt{max_elements_exp};
+      const auto   iter  = tb.used_ids_iter();
+      rebuilt.set_free_for_ids(iter.begin(), iter.end(), false);
+      const double rebuild_ms = elapsed_ms(start);
+
+      start = clock::now();
+      tb.grow(max_elements_exp);
+      const double grow_ms = elapsed_ms(start);
+      REQUIRE(tb == rebuilt);
+
+      printf("%s 2^%zu: grow %.3f ms, rebuild %.3f ms\n", policy_name, max_elements_exp, grow_ms, rebuild_ms);
+      grow_total_ms += grow_ms;
+      rebuild_total_ms += rebuild_ms;
+    }
+    printf("%s total: grow %.3f ms, rebuild %.3f ms\n", policy_name, grow_total_ms, rebuild_total_ms);
+
+    // Only the ids below 2^19 are kept
+    const size_t footprint = tb.memory_footprint();
+    tb.set_free_for_range(size_t{1} << 19, tb.max_elements() - 1, true);
+    const auto start = clock::now();
+    tb.shrink_to_fit();
+    printf("%s shrink to 2^%zu: %.3f ms, %zu KiB -> %zu KiB\n",
+           policy_name,
+           size_t(math::int_log2(tb.max_elements())),
+           elapsed_ms(start),
+           footprint / 1024,
+           tb.memory_footprint() / 1024);
+  };
+  run("StorageInitPolicy::eager", TreeBitset<>{20});
+  run("StorageInitPolicy::lazy", TreeBitset<LazyConfig>{20});
+}
+
+// Each thread keeps a window of the ids it has obtained and frees the oldest one for every new one
+template <typename Obtain, typename Free>
+double churn_ns_per_op(const size_t num_threads, const size_t total_ops, Obtain obtain, Free free)
+{
+  constexpr size_t         window = 64;
+  std::atomic<size_t>      ready{0};
+  std::atomic<bool>        go{false};
+  std::vector<std::thread> threads;
+  for(size_t thread_idx = 0; thread_idx < num_threads; ++thread_idx)
+    threads.emplace_back([&] {
+      std::array<size_t, window> held;
+      for(size_t & id : held)
+        id = obtain();
+      ++ready;
+      while(!go)
+        std::this_thread::yield();
+      for(size_t op_idx = 0; op_idx < total_ops / num_threads; ++op_idx)
+      {
+        size_t & id = held[op_idx % window];
+        free(id);
+        id = obtain();
+      }
+      for(const size_t id : held)
+        free(id);
     });
+  while(ready != num_threads)
+    std::this_thread::yield();
+
+  using clock      = std::chrono::steady_clock;
+  const auto start = clock::now();
+  go               = true;
+  for(std::thread & thread : threads)
+    thread.join();
+  return std::chrono::duration<double, std::nano>(clock::now() - start).count() / total_ops;
+}
+
+TEST_CASE("TreeBitset<uint64> with 600M elements against 2^30 elements", "[bench]")
+{
+  // Half of the ids are used at random, the churn frees and obtains them back
+  auto run = [](const std::string & name, auto & tb) {
+    const size_t max_elements = tb.max_elements();
+    for(size_t idx = 0; idx < max_elements / 2; ++idx)
+      tb.set_free(g() % max_elements, false);
+    std::vector<size_t> ids(size_t{1} << 16);
+    for(size_t & id : ids)
+    {
+      id = g() % max_elements;
+      tb.set_free(id, false);
+    }
+    printf("%s: %zu KiB\n", name.c_str(), tb.memory_footprint() / 1024);
+
+    BENCHMARK("obtain/free churn x 65536 - " + name)
+    {
+      for(size_t & id : ids)
+      {
+        tb.set_free(id, true);
+        id = tb.obtain_id();
+      }
+      return ids.back();
+    };
+  };
+
+  TreeBitset<> arbitrary{MaxElements{600'000'000}};
+  run("600M elements", arbitrary);
+  TreeBitset<> pow2{30};
+  run("2^30 elements", pow2);
+  for(const size_t exp : {20, 23})
+    printf("2^%zu elements: %zu KiB\n", exp, TreeBitset<>::required_blocks(exp) * sizeof(uint64_t) / 1024);
+}
+
+TEST_CASE("TreeBitset<uint64> used counts with 2^23 elements", "[bench]")
+{
+  using CountConfig = TreeBitsetConfig<uint64_t, PoliciesWith<UsedCountPolicy::maintain>>;
+
+  auto churn = [](auto & tb, std::vector<size_t> & ids) {
+    for(size_t & id : ids)
+    {
+      tb.set_free(id, true);
+      id = tb.obtain_id();
+    }
+    return ids.back();
+  };
+  auto prepare = [](auto & tb, std::vector<size_t> & ids) {
+    const size_t max_elements = tb.max_elements();
+    for(size_t idx = 0; idx < max_elements / 2; ++idx)
+      tb.set_free(g() % max_elements, false);
+    for(size_t & id : ids)
+    {
+      id = g() % max_elements;
+      tb.set_free(id, false);
+    }
+    std::shuffle(begin(ids), end(ids), g);
+  };
+
+  BENCHMARK_ADVANCED("obtain/free churn without counts")(Catch::Benchmark::Chronometer meter)
+  {
+    TreeBitset<>        tb{23};
+    std::vector<size_t> ids(size_t{1} << 16);
+    prepare(tb, ids);
+    meter.measure([&] { return churn(tb, ids); });
+  };
+
+  BENCHMARK_ADVANCED("obtain/free churn with counts")(Catch::Benchmark::Chronometer meter)
+  {
+    TreeBitset<CountConfig> tb{23};
+    std::vector<size_t>     ids(size_t{1} << 16);
+    prepare(tb, ids);
+    meter.measure([&] { return churn(tb, ids); });
+  };
+
+  TreeBitset<CountConfig> tb{23};
+  std::vector<size_t>     ids(size_t{1} << 16);
+  prepare(tb, ids);
+  std::vector<std::pair<size_t, size_t>> ranges(1024);
+  for(auto & [min_id, max_id] : ranges)
+  {
+    min_id = g() % tb.max_elements();
+    max_id = std::min(min_id + (g() % (size_t{1} << 20)), tb.max_elements() - 1);
+  }
+
+  BENCHMARK("used_count")
+  {
+    return tb.used_count();
+  };
+
+  BENCHMARK("count_used of 1024 random ranges up to 2^20 ids")
+  {
+    size_t sum = 0;
+    for(const auto & [min_id, max_id] : ranges)
+      sum += tb.count_used(min_id, max_id);
+    return sum;
+  };
+
+  BENCHMARK("used_ids_iter count of 4 random ranges up to 2^20 ids")
+  {
+    size_t sum = 0;
+    for(size_t idx = 0; idx < 4; ++idx)
+    {
+      const auto [min_id, max_id] = ranges[idx];
+      for(const size_t id : tb.used_ids_iter())
+      {
+        if(id > max_id)
+          break;
+        sum += id >= min_id;
+      }
+    }
+    return sum;
+  };
+}
+
+TEST_CASE("TreeBitset<uint64> rank/select with 2^23 and 2^30 elements", "[bench]")
+{
+  using CountConfig = TreeBitsetConfig<uint64_t, PoliciesWith<UsedCountPolicy::maintain>>;
+
+  // Naive walks go over rank used ids on average, so they're measured for a single query
+  auto bench = [](const size_t max_elements_exp, const size_t num_random_used_ids) {
+    TreeBitset<CountConfig> tb{max_elements_exp};
+    const size_t            id_mask = tb.max_elements() - 1;
+    for(size_t idx = 0; idx < num_random_used_ids; ++idx)
+      tb.set_free(g() & id_mask, false);
+    std::vector<size_t> ids(1024), ranks(1024);
+    for(size_t idx = 0; idx < ids.size(); ++idx)
+    {
+      ids[idx]   = g() & id_mask;
+      ranks[idx] = g() % tb.used_count();
+    }
+    const std::string suffix = " - 2^" + std::to_string(max_elements_exp) + " elements, " +
+                               std::to_string(tb.used_count()) + " used";
+
+    BENCHMARK("rank x 1024 random" + suffix)
+    {
+      size_t sum = 0;
+      for(const size_t id : ids)
+        sum += tb.rank(id);
+      return sum;
+    };
+
+    BENCHMARK("select x 1024 random" + suffix)
+    {
+      size_t sum = 0;
+      for(const size_t rank : ranks)
+        sum += tb.select(rank);
+      return sum;
+    };
+
+    size_t query_idx = 0;
+    BENCHMARK("used_ids_iter walk rank x 1 random" + suffix)
+    {
+      const size_t max_id = ids[query_idx++ & (ids.size() - 1)];
+      size_t       rank   = 0;
+      for(const size_t id : tb.used_ids_iter())
+      {
+        if(id >= max_id)
+          break;
+        ++rank;
+      }
+      return rank;
+    };
+
+    BENCHMARK("used_ids_iter walk select x 1 random" + suffix)
+    {
+      size_t rank = ranks[query_idx++ & (ranks.size() - 1)];
+      for(const size_t id : tb.used_ids_iter())
+      {
+        if(!rank--)
+          return id;
+      }
+      return decltype(tb)::invalid_id;
+    };
+  };
+
+  bench(23, size_t{1} << 22);
+  // 1/64 of the ids are used, so the walks take tens of milliseconds rather than seconds
+  bench(30, size_t{1} << 24);
+}
+
+TEST_CASE("ConcurrentTreeBitset<uint64> obtain/free churn scaling", "[bench]")
+{
+  constexpr size_t max_elements_exp = 20;
+  constexpr size_t total_ops        = size_t{1} << 22;
+  printf("hardware threads: %u\n", std::thread::hardware_concurrency());
+
+  for(const size_t num_threads : {1, 2, 4, 8, 16, 32, 64})
+  {
+    TreeBitset<> locked{max_elements_exp};
+    std::mutex   mutex;
+    const double locked_ns = churn_ns_per_op(
+      num_threads,
+      total_ops,
+      [&] {
+        std::lock_guard lock{mutex};
+        return locked.obtain_id();
+      },
+      [&](const size_t id) {
+        std::lock_guard lock{mutex};
+        locked.set_free(id, true);
+      });
+
+    ConcurrentTreeBitset<> concurrent{max_elements_exp};
+    const double           concurrent_ns = churn_ns_per_op(
+      num_threads,
+      total_ops,
+      [&] { return concurrent.obtain_id(); },
+      [&](const size_t id) { concurrent.set_free(id, true); });
+
+    printf("%2zu threads: mutex + TreeBitset %.1f ns, ConcurrentTreeBitset %.1f ns per obtain + free\n",
+           num_threads,
+           locked_ns,
+           concurrent_ns);
+  }
+}
+
+TEST_CASE("ShardedTreeBitset<uint64> obtain/free churn scaling", "[bench]")
+{
+  constexpr size_t max_elements_exp = 20;
+  constexpr size_t total_ops        = size_t{1} << 22;
+  printf("hardware threads: %u\n", std::thread::hardware_concurrency());
+
+  for(const size_t num_threads : {1, 2, 4, 8, 16, 32, 64})
+  {
+    ConcurrentTreeBitset<> single_tree{max_elements_exp};
+    const double           single_tree_ns = churn_ns_per_op(
+      num_threads,
+      total_ops,
+      [&] { return single_tree.obtain_id(); },
+      [&](const size_t id) { single_tree.set_free(id, true); });
+
+    // A shard per thread
+    ShardedTreeBitset<> sharded{max_elements_exp, math::int_log2(num_threads)};
+    const double        sharded_ns = churn_ns_per_op(
+      num_threads,
+      total_ops,
+      [&] { return sharded.obtain_id(); },
+      [&](const size_t id) { sharded.set_free(id, true); });
+
+    printf("%2zu threads: ConcurrentTreeBitset %.1f ns, ShardedTreeBitset %.1f ns per obtain + free\n",
+           num_threads,
+           single_tree_ns,
+           sharded_ns);
+  }
+}
+
+TEST_CASE("MagazineTreeBitset<uint64> obtain/release pairs", "[bench]")
+{
+  constexpr size_t max_elements_exp = 20;
+  constexpr size_t total_ops        = size_t{1} << 22;
+  printf("hardware threads: %u\n", std::thread::hardware_concurrency());
+
+  auto pairs_per_second = [](const double ns_per_pair) { return 1e3 / ns_per_pair; };
+  for(const size_t num_threads : {1, 2, 4, 8, 16, 32, 64})
+  {
+    TreeBitset<> locked{max_elements_exp};
+    std::mutex   mutex;
+    const double locked_ns = churn_ns_per_op(
+      num_threads,
+      total_ops,
+      [&] {
+        std::lock_guard lock{mutex};
+        return locked.obtain_id();
+      },
+      [&](const size_t id) {
+        std::lock_guard lock{mutex};
+        locked.set_free(id, true);
+      });
+    printf("%2zu threads: mutex + TreeBitset %.1f M pairs/s", num_threads, pairs_per_second(locked_ns));
+
+    for(const size_t magazine_size : {16, 256})
+    {
+      MagazineTreeBitset<> magazines{max_elements_exp, magazine_size};
+      const double         magazines_ns = churn_ns_per_op(
+        num_threads,
+        total_ops,
+        [&] { return magazines.obtain_id(); },
+        [&](const size_t id) { magazines.release(id); });
+      printf(", magazines of %zu %.1f M pairs/s", magazine_size, pairs_per_second(magazines_ns));
+    }
+    printf("\n");
+  }
+}
+
+TEST_CASE("EntityAllocator<uint64> create/destroy/validate churn", "[bench]")
+{
+  for(const size_t max_elements_exp : {16, 24})
+  {
+    const std::string suffix       = " - 2^" + std::to_string(max_elements_exp);
+    const size_t      max_entities = size_t{1} << max_elements_exp;
+
+    EntityAllocator<>         entities{max_elements_exp};
+    std::vector<EntityHandle> handles;
+    for(size_t idx = 0; idx < max_entities / 2; ++idx)
+      handles.emplace_back(entities.create());
+    // Half of the handles to validate are dead
+    std::vector<EntityHandle> to_validate;
+    for(size_t idx = 0; idx < 4096; ++idx)
+    {
+      EntityHandle & handle = handles[g() % handles.size()];
+      if(idx & 1)
+      {
+        entities.destroy(handle);
+        to_validate.emplace_back(handle);
+        handle = entities.create();
+      }
+      else
+        to_validate.emplace_back(handle);
+    }
+
+    BENCHMARK("destroy + create x 4096 random" + suffix)
+    {
+      for(size_t idx = 0; idx < 4096; ++idx)
+      {
+        EntityHandle & handle = handles[(idx * 7919) % handles.size()];
+        entities.destroy(handle);
+        handle = entities.create();
+      }
+      return handles[0];
+    };
+
+    BENCHMARK("is_alive x 4096 random - generation only" + suffix)
+    {
+      size_t n_alive = 0;
+      for(const EntityHandle handle : to_validate)
+        n_alive += entities.is_alive(handle);
+      return n_alive;
+    };
+
+    // The layout which is_alive avoids: the used bit of the data block has to be checked besides the
+    // generation, so a miss takes two cache lines
+    TreeBitset<>          used{max_elements_exp};
+    std::vector<uint32_t> generations(max_entities);
+    for(const EntityHandle handle : handles)
+    {
+      used.set_free(handle.index(), false);
+      generations[handle.index()] = handle.generation();
+    }
+    BENCHMARK("is_alive x 4096 random - used bit + generation" + suffix)
+    {
+      size_t n_alive = 0;
+      for(const EntityHandle handle : to_validate)
+        n_alive += !used.is_free(handle.index()) && generations[handle.index()] == handle.generation();
+      return n_alive;
+    };
+  }
+}
+
+TEST_CASE("SparseTreeBitset<uint64> with 10M ids spread over 2^40 elements", "[bench]")
+{
+  // Ids come in 2^14 clusters of consecutive ones, as object ids of separate allocations do. Uniformly
+  // random ids would take a leaf page each
+  constexpr size_t num_clusters = size_t{1} << 14;
+  constexpr size_t cluster_size = 10'000'000 / num_clusters;
+  auto fill = [](auto & tb) {
+    for(size_t cluster_idx = 0; cluster_idx < num_clusters; ++cluster_idx)
+    {
+      const size_t first_id = (size_t{g()} << 32 | g()) % (tb.max_elements() - cluster_size);
+      for(size_t id = first_id; id < first_id + cluster_size; ++id)
+        tb.set_free(id, false);
+    }
+  };
+
+  const size_t       rss_before = resident_memory();
+  SparseTreeBitset<> sparse{40};
+  fill(sparse);
+  printf("sparse 2^40: RSS growth %zu KiB, %zu leaf pages\n",
+         (resident_memory() - rss_before) / 1024,
+         sparse.num_leaf_pages());
+
+  const size_t       uniform_rss_before = resident_memory();
+  SparseTreeBitset<> uniform{40};
+  for(size_t idx = 0; idx < 100'000; ++idx)
+    uniform.set_free((size_t{g()} << 32 | g()) & (uniform.max_elements() - 1), false);
+  printf("sparse 2^40, 100K uniformly random ids: RSS growth %zu KiB, %zu leaf pages\n",
+         (resident_memory() - uniform_rss_before) / 1024,
+         uniform.num_leaf_pages());
+
+  // Dense bitset of the biggest capacity which fits into memory, for the latency reference
+  TreeBitset<> dense{30};
+  fill(dense);
+
+  // The first free id is usually in a missing page, which is allocated and released again by every pair
+  BENCHMARK("obtain + free - SparseTreeBitset 2^40")
+  {
+    const size_t id = sparse.obtain_id();
+    sparse.set_free(id, true);
+    return id;
+  };
+
+  const size_t held_id = sparse.obtain_id();
+  BENCHMARK("obtain + free within an allocated page - SparseTreeBitset 2^40")
+  {
+    const size_t id = sparse.obtain_id();
+    sparse.set_free(id, true);
+    return id;
+  };
+  sparse.set_free(held_id, true);
+
+  BENCHMARK("obtain + free - TreeBitset 2^30")
+  {
+    const size_t id = dense.obtain_id();
+    dense.set_free(id, true);
+    return id;
+  };
+
+  std::vector<size_t> ids(4096);
+  for(size_t & id : ids)
+    id = (size_t{g()} << 32 | g()) & (sparse.max_elements() - 1);
+  BENCHMARK("is_free x 4096 random - SparseTreeBitset 2^40")
+  {
+    size_t n_free = 0;
+    for(const size_t id : ids)
+      n_free += sparse.is_free(id);
+    return n_free;
+  };
+}
+
+TEST_CASE("TreeBitset<uint16> and <uint32> beyond the block width", "[bench]")
+{
+  // Half of the ids are used at random, obtained ids are freed right away
+  auto run = [](const std::string & name, auto & tb) {
+    for(size_t idx = 0; idx < tb.max_elements() / 2; ++idx)
+      tb.set_free((size_t{g()} << 32 | g()) & (tb.max_elements() - 1), false);
+
+    std::vector<size_t> ids(4096);
+    for(size_t & id : ids)
+      id = (size_t{g()} << 32 | g()) & (tb.max_elements() - 1);
+
+    BENCHMARK("obtain + free - " + name)
+    {
+      const size_t id = tb.obtain_id();
+      tb.set_free(id, true);
+      return id;
+    };
+
+    BENCHMARK("set + unset x 4096 random - " + name)
+    {
+      for(const size_t id : ids)
+        tb.set_free(id, false);
+      for(const size_t id : ids)
+        tb.set_free(id, true);
+      return tb.is_free(ids[0]);
+    };
+  };
+
+  TreeBitset<TreeBitsetConfig<uint16_t>> tb16{24};
+  TreeBitset<TreeBitsetConfig<uint64_t>> tb64{24};
+  run("TreeBitset<uint16> 2^24", tb16);
+  run("TreeBitset<uint64> 2^24", tb64);
+  BENCHMARK("find_next_free x 4096 random - TreeBitset<uint16> 2^24")
+  {
+    size_t sum = 0;
+    for(size_t idx = 0; idx < 4096; ++idx)
+      sum += tb16.find_next_free((idx * 7919) & (tb16.max_elements() - 1));
+    return sum;
+  };
+  BENCHMARK("find_next_free x 4096 random - TreeBitset<uint64> 2^24")
+  {
+    size_t sum = 0;
+    for(size_t idx = 0; idx < 4096; ++idx)
+      sum += tb64.find_next_free((idx * 7919) & (tb64.max_elements() - 1));
+    return sum;
+  };
+
+  // 2^36 dense bits take 8 GiB, so the sparse bitset is used with 2^16 random ids
+  auto run_sparse = [](const std::string & name, auto & tb) {
+    for(size_t idx = 0; idx < (size_t{1} << 16); ++idx)
+      tb.set_free((size_t{g()} << 32 | g()) & (tb.max_elements() - 1), false);
+    tb.set_free(0, false);
+
+    BENCHMARK("obtain + free - " + name)
+    {
+      const size_t id = tb.obtain_id();
+      tb.set_free(id, true);
+      return id;
+    };
   };
+  SparseTreeBitset<TreeBitsetConfig<uint32_t>> sparse32{36};
+  SparseTreeBitset<TreeBitsetConfig<uint64_t>> sparse64{36};
+  run_sparse("SparseTreeBitset<uint32> 2^36", sparse32);
+  run_sparse("SparseTreeBitset<uint64> 2^36", sparse64);
 }
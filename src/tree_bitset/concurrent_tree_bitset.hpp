@@ -0,0 +1,98 @@
+#pragma once
+#include <limits>
+#include <cinttypes>
+#include <memory>
+#include <atomic>
+
+#include "detail/bit"
+#include "detail/math_utils.hpp"
+#include "detail/tree_layout.hpp"
+
+#include "config.hpp"
+
+#undef max
+#undef min
+
+namespace treebitset {
+// TreeBitset whose obtain_id/set_free/is_free can be called from multiple threads without locking. Blocks
+// are atomics: data bits are claimed with CAS and metadata bits are updated with atomic or/and.
+//
+// A metadata bit may briefly stay set after its child has run out of free bits, in which case the descent
+// unsets it and retries. It's never left unset while the child has free bits: whoever empties a block
+// unsets its parent bit and then checks the block again, while whoever refills a block sets the parent bit
+// after it.
+//
+// Only the default storage layout is supported. MaxIDPolicy and PrefetchPolicy don't apply: there's no
+// max_used_id(), as it can't be kept current without serializing the updates
+template <typename Config = DefaultTreeBitsetConfig>
+class ConcurrentTreeBitset
+  : Config
+  , detail::TreeBitsetLayout<std::numeric_limits<typename Config::block_t>::digits,
+                             1,
+                             detail::dynamic_exp_max>
+{
+public:
+  using block_t = typename Config::block_t;
+  static_assert(sizeof(block_t) > 1, "block size must be bigger than 1 byte!");
+  static_assert(std::atomic<block_t>::is_always_lock_free, "blocks must be lock-free atomics");
+  static_assert(Config::template get<FreeBitPolicy>() == FreeBitPolicy::one &&
+                  Config::template get<UsedIDsTreePolicy>() == UsedIDsTreePolicy::none &&
+                  Config::template get<StorageInitPolicy>() == StorageInitPolicy::eager &&
+                  Config::template get<StoragePolicy>() == StoragePolicy::owning &&
+                  Config::template get<MetadataNodePolicy>() == MetadataNodePolicy::block,
+                "concurrent tree bitset only supports the default storage layout");
+
+  constexpr static inline size_t invalid_id     = std::numeric_limits<size_t>::max();
+  constexpr static inline size_t bits_per_block = std::numeric_limits<block_t>::digits;
+
+  // Concurrent tree bitset will have a capacity for 2^exp_max elements, all of them free
+  ConcurrentTreeBitset(const size_t exp_max);
+
+  // Get value of bit id
+  inline bool is_free(const size_t id) const;
+  // Set bit id value
+  inline void set_free(const size_t id, const bool free);
+  // Find a free bit id, unset it and get the id. Returns invalid_id only when there were no free ids at some
+  // point during the call
+  size_t obtain_id();
+  // Whether there're free ids. An id which is being freed concurrently might be missed, while a block which
+  // is being unset counts as having them
+  inline bool has_free_ids() const;
+
+  // Free all ids. Must not run concurrently with the other calls
+  void clean();
+
+  inline uint8_t num_metadata_levels() const;
+  inline size_t  num_element_blocks() const;
+  inline size_t  num_metadata_blocks() const;
+  inline size_t  max_elements() const;
+
+private:
+  using Layout = detail::TreeBitsetLayout<bits_per_block, 1, detail::dynamic_exp_max>;
+  using Layout::_num_metadata_blocks;
+  using Layout::_num_element_blocks;
+  using Layout::_num_metadata_levels;
+  using Layout::_max_elements;
+  using Layout::calculate_constants;
+
+  constexpr static inline size_t bits_per_block_log2 = math::int_log2(bits_per_block);
+
+  // Blocks are addressed by the tree level and their index on it. Level _num_metadata_levels is the data
+  // level
+  std::unique_ptr<std::atomic<block_t>[]> _storage;
+  // Parent bits are unset for a moment when a block is refilled during its propagate_unset. An empty root is
+  // only trusted when none of them is in progress. Kept on its own cache line, as every thread updates it
+  alignas(detail::cache_line_bytes) std::atomic<size_t> _unsets_in_progress{0};
+
+  constexpr static size_t metadata_level_offset(const uint8_t level);
+  inline std::atomic<block_t> &       block(const uint8_t level, const size_t block_idx);
+  inline const std::atomic<block_t> & block(const uint8_t level, const size_t block_idx) const;
+  // Mask of the existing children bits of the root block
+  inline block_t max_element_mask() const;
+  // Set the parent bits of a block which got its first free bit
+  inline void    propagate_set(uint8_t level, size_t block_idx);
+  // Unset the parent bits of a block which ran out of free bits
+  inline void    propagate_unset(uint8_t level, size_t block_idx);
+};
+}
+#include "detail/concurrent_tree_bitset.hpp"
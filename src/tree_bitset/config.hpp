@@ -6,17 +6,83 @@
 enum class MaxIDPolicy {
   // this mainly impacts set_free(<id>, false) performance
   keep_max_id_current,
+  // set_free/obtain_id don't do any max id bookkeeping, max_used_id() looks it up instead. The lookup is
+  // logarithmic with UsedIDsTreePolicy::maintain and scans the data blocks otherwise
   on_demand_max_id_calc,
 };
 
 enum class FreeBitPolicy {
-  //doesn't require memsetting on start, requires doing more bitwise NOT instructions
-  zero,
   // default. Requires memsetting all data blocks to 1 on startup
-  one
+  one,
+  // doesn't require memsetting on start, requires doing more bitwise NOT instructions. Big bitsets are mapped
+  // straight from the OS, so construction and clean() don't touch their pages
+  zero,
+};
+
+enum class UsedIDsTreePolicy {
+  // default. Used ids lookups and max_id recalculation scan the data blocks
+  none,
+  // maintain a second metadata tree which indicates whether a subtree has any used bits. Makes used ids
+  // lookups logarithmic at the expense of additional set_free/obtain_id work and metadata memory
+  maintain
+};
+
+enum class StorageInitPolicy {
+  // default. Construction and clean() fill the whole storage
+  eager,
+  // storage is initialized by page-sized chunks the first time they're modified, so construction and clean()
+  // are O(1). Every block access has to check whether its chunk is initialized
+  lazy
+};
+
+enum class StoragePolicy {
+  // default. TreeBitset allocates and owns its storage
+  owning,
+  // storage is a caller-provided buffer of TreeBitset::required_blocks(exp_max) blocks which must outlive the
+  // bitset
+  external,
+  // storage is allocated from a std::pmr::memory_resource passed to the constructor
+  memory_resource,
+  // storage is mapped from a file, so the bitset persists between runs. Opening an existing file is O(1) and
+  // sync() flushes the modified blocks to the disk
+  mapped_file
+};
+
+enum class MetadataNodePolicy {
+  // default. Metadata nodes are single blocks
+  block,
+  // metadata nodes span a whole 64-byte cache line, so the tree is shallower and each level of obtain_id
+  // costs a single cache line. Data blocks stay single blocks
+  cache_line
+};
+
+enum class PrefetchPolicy {
+  // default. No software prefetches
+  none,
+  // set_free prefetches the whole path from its data block to the root, whose addresses only depend on the
+  // id, so the misses of update_metadata overlap instead of being taken one level at a time.
+  // set_free_for_ids keeps the paths of several ids in flight. Pays off when the tree doesn't fit in caches
+  ancestors
+};
+
+enum class UsedCountPolicy {
+  // default. Used ids are only counted by iterating them
+  none,
+  // every metadata node keeps a 64-bit count of the used ids of its subtree after the trees, so used_count()
+  // is O(1) and count_used() sums at most node_bits counts per metadata level. Each changed bit costs a
+  // counter update per metadata level
+  maintain
 };
 
-struct TreeBitsetPoliciesBuilder : mm::ConfigBuilder<MaxIDPolicy, FreeBitPolicy>
+struct TreeBitsetPoliciesBuilder
+  : mm::ConfigBuilder<MaxIDPolicy,
+                      FreeBitPolicy,
+                      UsedIDsTreePolicy,
+                      StorageInitPolicy,
+                      StoragePolicy,
+                      MetadataNodePolicy,
+                      PrefetchPolicy,
+                      UsedCountPolicy>
 {
 };
 
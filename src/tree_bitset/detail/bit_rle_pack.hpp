@@ -5,6 +5,7 @@
 
 #include <cinttypes>
 #include <cstddef>
+#include <type_traits>
 
 namespace treebitset {
 struct RLEBitAbbreviation
@@ -15,12 +16,15 @@ struct RLEBitAbbreviation
 
 namespace detail {
 
-template <typename block_t, typename AddAbbreviationCallback, typename AddPackedBlockCallback>
-void rle_pack(const block_t *         blocks,
+// blocks is either a pointer to blocks or an object with the same operator[]
+template <typename Blocks, typename AddAbbreviationCallback, typename AddPackedBlockCallback>
+void rle_pack(const Blocks &          blocks,
               const size_t            nBlocks,
               AddAbbreviationCallback abbrev_cb,
               AddPackedBlockCallback  block_cb)
 {
+  using block_t = std::remove_cv_t<std::remove_reference_t<decltype(blocks[0])>>;
+
   block_t            block_value = blocks[0];
   RLEBitAbbreviation next_abbreviation{};
   next_abbreviation.nblocks = 1;
@@ -0,0 +1,197 @@
+#pragma once
+#include <cassert>
+#include "../concurrent_tree_bitset.hpp"
+
+namespace treebitset {
+
+template <typename Config>
+ConcurrentTreeBitset<Config>::ConcurrentTreeBitset(const size_t exp_max)
+{
+  calculate_constants(detail::pow2_capacity(exp_max));
+  // Blocks are addressed by the full level sizes, so the last metadata level is stored completely
+  _num_metadata_blocks = metadata_level_offset(_num_metadata_levels);
+  _storage.reset(new std::atomic<block_t>[_num_metadata_blocks + _num_element_blocks]);
+  clean();
+}
+
+template <typename Config>
+constexpr size_t ConcurrentTreeBitset<Config>::metadata_level_offset(const uint8_t level)
+{
+  // Sum of the geometric progression of the previous levels sizes. Level after the last one is the data level
+  return ((size_t{1} << (bits_per_block_log2 * static_cast<size_t>(level))) - 1) / (bits_per_block - 1);
+}
+
+template <typename Config>
+inline std::atomic<typename ConcurrentTreeBitset<Config>::block_t> &
+ConcurrentTreeBitset<Config>::block(const uint8_t level, const size_t block_idx)
+{
+  return _storage[metadata_level_offset(level) + block_idx];
+}
+
+template <typename Config>
+inline const std::atomic<typename ConcurrentTreeBitset<Config>::block_t> &
+ConcurrentTreeBitset<Config>::block(const uint8_t level, const size_t block_idx) const
+{
+  return _storage[metadata_level_offset(level) + block_idx];
+}
+
+template <typename Config>
+inline typename ConcurrentTreeBitset<Config>::block_t ConcurrentTreeBitset<Config>::max_element_mask() const
+{
+  const size_t root_bits =
+    _num_metadata_levels ? _max_elements >> (bits_per_block_log2 * _num_metadata_levels) : _max_elements;
+  return root_bits < bits_per_block ? static_cast<block_t>((block_t{1} << root_bits) - 1)
+                                    : static_cast<block_t>(~block_t{0});
+}
+
+template <typename Config>
+void ConcurrentTreeBitset<Config>::clean()
+{
+  const size_t num_blocks = _num_metadata_blocks + _num_element_blocks;
+  for(size_t storage_idx = 0; storage_idx < num_blocks; ++storage_idx)
+    _storage[storage_idx].store(static_cast<block_t>(~block_t{0}), std::memory_order_relaxed);
+  // Unset root level bits for nonexisting elements if the tree isn't T-pyramid
+  _storage[0].store(max_element_mask());
+}
+
+template <typename Config>
+inline void ConcurrentTreeBitset<Config>::propagate_set(uint8_t level, size_t block_idx)
+{
+  // Parents which already had free bits have their own parent bits set
+  while(level)
+  {
+    const size_t  parent_idx = block_idx >> bits_per_block_log2;
+    const block_t mask       = static_cast<block_t>(block_t{1} << (block_idx & (bits_per_block - 1)));
+    if(block(--level, parent_idx).fetch_or(mask))
+      return;
+    block_idx = parent_idx;
+  }
+}
+
+template <typename Config>
+inline void ConcurrentTreeBitset<Config>::propagate_unset(uint8_t level, size_t block_idx)
+{
+  if(!level)
+    return;
+  _unsets_in_progress.fetch_add(1);
+  while(level)
+  {
+    const uint8_t          parent_level = static_cast<uint8_t>(level - 1);
+    const size_t           parent_idx   = block_idx >> bits_per_block_log2;
+    const block_t          mask = static_cast<block_t>(block_t{1} << (block_idx & (bits_per_block - 1)));
+    std::atomic<block_t> & parent = block(parent_level, parent_idx);
+
+    const block_t old_parent = parent.fetch_and(static_cast<block_t>(~mask));
+    // The block could've been refilled right before its parent bit was unset and the refilling thread has
+    // seen the bit as set already, so it's restored here
+    if(block(level, block_idx).load())
+    {
+      if(!parent.fetch_or(mask))
+        propagate_set(parent_level, parent_idx);
+      break;
+    }
+    // Ancestors are only updated by the thread which has emptied the parent
+    if(old_parent != mask)
+      break;
+    level     = parent_level;
+    block_idx = parent_idx;
+  }
+  _unsets_in_progress.fetch_sub(1);
+}
+
+template <typename Config>
+inline bool ConcurrentTreeBitset<Config>::is_free(const size_t id) const
+{
+  const block_t value = block(_num_metadata_levels, id >> bits_per_block_log2).load();
+  return (value >> (id & (bits_per_block - 1))) & block_t{1};
+}
+
+template <typename Config>
+inline void ConcurrentTreeBitset<Config>::set_free(const size_t id, const bool free)
+{
+  assert(id < _max_elements);
+  const size_t           block_idx = id >> bits_per_block_log2;
+  const block_t          mask      = static_cast<block_t>(block_t{1} << (id & (bits_per_block - 1)));
+  std::atomic<block_t> & data      = block(_num_metadata_levels, block_idx);
+  if(free)
+  {
+    if(!data.fetch_or(mask))
+      propagate_set(_num_metadata_levels, block_idx);
+  }
+  else if(data.fetch_and(static_cast<block_t>(~mask)) == mask)
+    propagate_unset(_num_metadata_levels, block_idx);
+}
+
+template <typename Config>
+size_t ConcurrentTreeBitset<Config>::obtain_id()
+{
+  for(;;)
+  {
+    // Descend along the first set bits while the blocks have any
+    uint8_t level     = 0;
+    size_t  block_idx = 0;
+    block_t value     = block(0, 0).load();
+    for(; value && level < _num_metadata_levels; ++level)
+    {
+      block_idx = (block_idx << bits_per_block_log2) + std::countr_zero(value);
+      value     = block(static_cast<uint8_t>(level + 1), block_idx).load();
+    }
+
+    // Claim the first free bit of the data block, the CAS is retried while other bits of the block change
+    if(value)
+    {
+      std::atomic<block_t> & data = block(level, block_idx);
+      while(value && !data.compare_exchange_weak(value, static_cast<block_t>(value & (value - 1))))
+      {
+      }
+    }
+    if(value)
+    {
+      if(!static_cast<block_t>(value & (value - 1)))
+        propagate_unset(level, block_idx);
+      return (block_idx << bits_per_block_log2) + std::countr_zero(value);
+    }
+
+    // Empty root means there're no free ids, unless a root bit is about to be restored by an unset in
+    // progress. Other empty blocks had stale parent bits, which are fixed before the retry
+    if(!level)
+    {
+      if(!_unsets_in_progress.load() && !block(0, 0).load())
+        return invalid_id;
+      continue;
+    }
+    propagate_unset(level, block_idx);
+  }
+}
+
+template <typename Config>
+inline bool ConcurrentTreeBitset<Config>::has_free_ids() const
+{
+  return block(0, 0).load() || _unsets_in_progress.load();
+}
+
+template <typename Config>
+inline uint8_t ConcurrentTreeBitset<Config>::num_metadata_levels() const
+{
+  return _num_metadata_levels;
+}
+
+template <typename Config>
+inline size_t ConcurrentTreeBitset<Config>::num_element_blocks() const
+{
+  return _num_element_blocks;
+}
+
+template <typename Config>
+inline size_t ConcurrentTreeBitset<Config>::num_metadata_blocks() const
+{
+  return _num_metadata_blocks;
+}
+
+template <typename Config>
+inline size_t ConcurrentTreeBitset<Config>::max_elements() const
+{
+  return _max_elements;
+}
+
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <cassert>
+#include "../entity_allocator.hpp"
+
+namespace treebitset {
+
+template <typename Config, typename generation_t>
+EntityAllocator<Config, generation_t>::EntityAllocator(const size_t exp_max)
+  : _ids{checked_exp_max(exp_max)}, _generations{std::make_unique<generation_t[]>(size_t{1} << exp_max)}
+{
+}
+
+template <typename Config, typename generation_t>
+inline size_t EntityAllocator<Config, generation_t>::checked_exp_max(const size_t exp_max)
+{
+  assert(exp_max <= 32);
+  return exp_max;
+}
+
+template <typename Config, typename generation_t>
+inline EntityHandle EntityAllocator<Config, generation_t>::create()
+{
+  const size_t index = _ids.obtain_id();
+  if(index == TreeBitset<Config>::invalid_id)
+    return invalid_handle;
+  return {static_cast<uint32_t>(index), ++_generations[index]};
+}
+
+template <typename Config, typename generation_t>
+inline bool EntityAllocator<Config, generation_t>::destroy(const EntityHandle handle)
+{
+  if(!is_alive(handle))
+    return false;
+  ++_generations[handle.index()];
+  _ids.set_free(handle.index(), true);
+  return true;
+}
+
+template <typename Config, typename generation_t>
+inline bool EntityAllocator<Config, generation_t>::is_alive(const EntityHandle handle) const
+{
+  return handle.index() < max_entities() && _generations[handle.index()] == handle.generation() &&
+         (handle.generation() & 1);
+}
+
+template <typename Config, typename generation_t>
+template <typename F>
+void EntityAllocator<Config, generation_t>::for_each_alive(F && f) const
+{
+  for(const size_t index : _ids.used_ids_iter())
+    f(EntityHandle{static_cast<uint32_t>(index), _generations[index]});
+}
+
+template <typename Config, typename generation_t>
+inline size_t EntityAllocator<Config, generation_t>::max_entities() const
+{
+  return _ids.max_elements();
+}
+
+}
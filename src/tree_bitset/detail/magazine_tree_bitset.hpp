@@ -0,0 +1,236 @@
+#pragma once
+#include <cassert>
+#include <algorithm>
+#include <iterator>
+#include <thread>
+#include "../magazine_tree_bitset.hpp"
+
+namespace treebitset {
+
+template <typename Config>
+struct MagazineTreeBitset<Config>::Magazine
+{
+  // Only the owning thread and flush_all() access the ids, the lock is contended by the latter alone
+  alignas(detail::cache_line_bytes) std::atomic<bool> locked{false};
+  std::vector<size_t> ids;
+  // Ids on their way between the magazine and the shared bitset. The magazine isn't locked while the shared
+  // bitset is, so flush_all() can lock them in the other order
+  std::vector<size_t> transfer;
+
+  void lock()
+  {
+    while(locked.exchange(true, std::memory_order_acquire))
+      std::this_thread::yield();
+  }
+  void unlock() { locked.store(false, std::memory_order_release); }
+};
+
+template <typename Config>
+struct MagazineTreeBitset<Config>::Shared
+{
+  // Thread-local magazines are looked up by the id, since another bitset might reuse the address
+  const uint64_t          id;
+  const size_t            magazine_size;
+  mutable std::mutex      mutex;
+  TreeBitset<Config>      bitset;
+  std::vector<Magazine *> magazines;
+
+  Shared(const size_t exp_max, const size_t magazine_size_)
+    : id{next_id++}, magazine_size{magazine_size_}, bitset{exp_max}
+  {
+  }
+
+  // Must be called with both the mutex and the magazine locked
+  void drain_all(Magazine & magazine)
+  {
+    bitset.set_free_for_ids(begin(magazine.ids), end(magazine.ids), true);
+    magazine.ids.clear();
+  }
+
+private:
+  static inline std::atomic<uint64_t> next_id{0};
+};
+
+// Magazines of a thread for each bitset it has used. They're drained to the bitsets which are still alive
+// when the thread exits
+template <typename Config>
+struct MagazineTreeBitset<Config>::ThreadMagazines
+{
+  struct Entry
+  {
+    uint64_t                  shared_id;
+    std::weak_ptr<Shared>     shared;
+    std::unique_ptr<Magazine> magazine;
+  };
+  std::vector<Entry> entries;
+  uint64_t           last_shared_id = ~uint64_t{0};
+  Magazine *         last_magazine  = nullptr;
+
+  Magazine & find_or_register(const std::shared_ptr<Shared> & shared)
+  {
+    // Magazines of the destroyed bitsets aren't registered anywhere
+    auto expired = [](const Entry & e) { return e.shared.expired(); };
+    entries.erase(std::remove_if(begin(entries), end(entries), expired), end(entries));
+    auto entry = std::find_if(
+      begin(entries), end(entries), [&](const Entry & e) { return e.shared_id == shared->id; });
+    if(entry == end(entries))
+    {
+      auto magazine = std::make_unique<Magazine>();
+      magazine->ids.reserve(2 * shared->magazine_size);
+      magazine->transfer.reserve(shared->magazine_size);
+      {
+        std::lock_guard lock{shared->mutex};
+        shared->magazines.emplace_back(magazine.get());
+      }
+      entries.push_back({shared->id, shared, std::move(magazine)});
+      entry = end(entries) - 1;
+    }
+    last_shared_id = shared->id;
+    last_magazine  = entry->magazine.get();
+    return *last_magazine;
+  }
+
+  ~ThreadMagazines()
+  {
+    for(Entry & entry : entries)
+    {
+      const std::shared_ptr<Shared> shared = entry.shared.lock();
+      if(!shared)
+        continue;
+      std::lock_guard lock{shared->mutex};
+      entry.magazine->lock();
+      shared->drain_all(*entry.magazine);
+      entry.magazine->unlock();
+      auto & magazines = shared->magazines;
+      magazines.erase(std::find(begin(magazines), end(magazines), entry.magazine.get()));
+    }
+  }
+};
+
+template <typename Config>
+MagazineTreeBitset<Config>::MagazineTreeBitset(const size_t exp_max, const size_t magazine_size)
+  : _shared{std::make_shared<Shared>(exp_max, magazine_size)}
+{
+  assert(magazine_size > 0);
+}
+
+template <typename Config>
+inline typename MagazineTreeBitset<Config>::Magazine & MagazineTreeBitset<Config>::thread_magazine()
+{
+  thread_local ThreadMagazines thread_magazines;
+  if(thread_magazines.last_shared_id == _shared->id)
+    return *thread_magazines.last_magazine;
+  return thread_magazines.find_or_register(_shared);
+}
+
+template <typename Config>
+inline size_t MagazineTreeBitset<Config>::obtain_id()
+{
+  Magazine & magazine = thread_magazine();
+  magazine.lock();
+  if(magazine.ids.empty())
+  {
+    magazine.unlock();
+    return refill(magazine);
+  }
+  const size_t id = magazine.ids.back();
+  magazine.ids.pop_back();
+  magazine.unlock();
+  return id;
+}
+
+template <typename Config>
+inline void MagazineTreeBitset<Config>::release(const size_t id)
+{
+  Magazine & magazine = thread_magazine();
+  magazine.lock();
+  magazine.ids.push_back(id);
+  const bool full = magazine.ids.size() == 2 * _shared->magazine_size;
+  magazine.unlock();
+  if(full)
+    drain(magazine);
+}
+
+template <typename Config>
+size_t MagazineTreeBitset<Config>::refill(Magazine & magazine)
+{
+  magazine.transfer.clear();
+  {
+    std::lock_guard lock{_shared->mutex};
+    _shared->bitset.obtain_ids(_shared->magazine_size, std::back_inserter(magazine.transfer));
+  }
+  if(magazine.transfer.empty())
+    return invalid_id;
+
+  // The lowest id is returned and the rest are taken from the magazine in ascending order
+  magazine.lock();
+  magazine.ids.insert(end(magazine.ids), rbegin(magazine.transfer), rend(magazine.transfer) - 1);
+  magazine.unlock();
+  return magazine.transfer.front();
+}
+
+template <typename Config>
+void MagazineTreeBitset<Config>::drain(Magazine & magazine)
+{
+  // The least recently released ids go back, the recent ones are reused first
+  magazine.lock();
+  const size_t count = std::min(_shared->magazine_size, magazine.ids.size());
+  magazine.transfer.assign(begin(magazine.ids), begin(magazine.ids) + count);
+  magazine.ids.erase(begin(magazine.ids), begin(magazine.ids) + count);
+  magazine.unlock();
+
+  std::lock_guard lock{_shared->mutex};
+  _shared->bitset.set_free_for_ids(begin(magazine.transfer), end(magazine.transfer), true);
+}
+
+template <typename Config>
+void MagazineTreeBitset<Config>::flush()
+{
+  Magazine & magazine = thread_magazine();
+  std::lock_guard lock{_shared->mutex};
+  magazine.lock();
+  _shared->drain_all(magazine);
+  magazine.unlock();
+}
+
+template <typename Config>
+void MagazineTreeBitset<Config>::flush_all()
+{
+  std::lock_guard lock{_shared->mutex};
+  for(Magazine * magazine : _shared->magazines)
+  {
+    magazine->lock();
+    _shared->drain_all(*magazine);
+    magazine->unlock();
+  }
+}
+
+template <typename Config>
+size_t MagazineTreeBitset<Config>::max_used_id() const
+{
+  std::lock_guard lock{_shared->mutex};
+  return _shared->bitset.max_used_id();
+}
+
+template <typename Config>
+template <typename F>
+void MagazineTreeBitset<Config>::for_each_used_id(F && f) const
+{
+  std::lock_guard lock{_shared->mutex};
+  for(const size_t id : _shared->bitset.used_ids_iter())
+    f(id);
+}
+
+template <typename Config>
+inline size_t MagazineTreeBitset<Config>::magazine_size() const
+{
+  return _shared->magazine_size;
+}
+
+template <typename Config>
+inline size_t MagazineTreeBitset<Config>::max_elements() const
+{
+  return _shared->bitset.max_elements();
+}
+
+}
@@ -0,0 +1,194 @@
+#pragma once
+
+// Files which are mapped into memory, so the storage placed in them persists between runs. Writes reach the
+// page cache right away and the disk once they're flushed or the kernel writes the pages back by itself.
+
+#include <cstddef>
+#include <cinttypes>
+#include <cerrno>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+
+#include "bit"
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace treebitset { namespace detail {
+
+constexpr inline uint64_t mapped_file_magic   = 0x5354494245455254; // "TREEBITS"
+constexpr inline uint32_t mapped_file_version = 3;
+// Header takes a whole page, so the storage stays page aligned
+constexpr inline size_t mapped_file_header_bytes = 4096;
+
+struct MappedFileHeader
+{
+  // Zero until the file is completely initialized
+  uint64_t magic;
+  uint32_t version;
+  uint32_t bits_per_block;
+  uint64_t max_elements;
+  uint64_t policies;
+  uint64_t max_used_id;
+  uint64_t init_epoch;
+  // Nonzero when the storage was modified since the last sync, so max_used_id is stale. It's only written by
+  // the first modification after a sync and by the sync itself
+  uint64_t modified;
+};
+
+// Chunks of the mapped storage which were modified since the last flush. Storage is split into up to 64
+// page-aligned chunks of a power of two size, so marking them is a couple of shifts. Distant modifications
+// don't make the flush write back the chunks between them, while the number of flushes stays bounded
+class DirtyChunks
+{
+  uint64_t _bits             = 0;
+  size_t   _chunk_bytes_log2 = 0;
+
+public:
+  DirtyChunks() = default;
+  explicit DirtyChunks(const size_t bytes)
+  {
+    constexpr size_t max_chunks = 64;
+    for(_chunk_bytes_log2 = 12; (max_chunks << _chunk_bytes_log2) < bytes; ++_chunk_bytes_log2)
+      ;
+  }
+
+  bool any() const { return _bits != 0; }
+
+  // Mark the chunks of [first_byte, last_byte] range
+  void mark(const size_t first_byte, const size_t last_byte)
+  {
+    const size_t first_chunk = first_byte >> _chunk_bytes_log2;
+    const size_t last_chunk  = last_byte >> _chunk_bytes_log2;
+    _bits |= (~uint64_t{0} << first_chunk) & (~uint64_t{0} >> (63 - last_chunk));
+  }
+
+  // Call f(first_byte, bytes) for every run of consecutive dirty chunks and clear them. The last run may
+  // extend past the end of the storage
+  template <typename F>
+  void flush(F && f)
+  {
+    for(uint64_t bits = std::exchange(_bits, uint64_t{0}); bits;)
+    {
+      const size_t first_chunk = std::countr_zero(bits);
+      const size_t num_chunks  = std::countr_zero(static_cast<uint64_t>(~(bits >> first_chunk)));
+      f(first_chunk << _chunk_bytes_log2, num_chunks << _chunk_bytes_log2);
+      bits = first_chunk + num_chunks < 64 ? bits & (~uint64_t{0} << (first_chunk + num_chunks)) : 0;
+    }
+  }
+};
+
+// Storage which isn't mapped from a file has nothing to flush
+struct NoDirtyChunks
+{
+};
+
+[[noreturn]] inline void throw_last_os_error(const char * what)
+{
+#if defined(_WIN32)
+  throw std::system_error{static_cast<int>(GetLastError()), std::system_category(), what};
+#else
+  throw std::system_error{errno, std::generic_category(), what};
+#endif
+}
+
+// Map the file at path of exactly bytes size, which is created if it doesn't exist. New and empty files are
+// extended with zeroes
+inline void * map_file(const char * path, const size_t bytes)
+{
+#if defined(_WIN32)
+  const HANDLE file = CreateFileA(path,
+                                  GENERIC_READ | GENERIC_WRITE,
+                                  FILE_SHARE_READ,
+                                  nullptr,
+                                  OPEN_ALWAYS,
+                                  FILE_ATTRIBUTE_NORMAL,
+                                  nullptr);
+  if(file == INVALID_HANDLE_VALUE)
+    throw_last_os_error("can't open the bitset file");
+
+  LARGE_INTEGER file_size;
+  if(!GetFileSizeEx(file, &file_size) ||
+     (file_size.QuadPart && static_cast<size_t>(file_size.QuadPart) != bytes))
+  {
+    CloseHandle(file);
+    throw std::runtime_error{"bitset file size doesn't match its capacity"};
+  }
+  // The file is extended to the mapping size. Both handles can be closed, the view keeps them alive
+  const HANDLE mapping = CreateFileMappingA(file,
+                                            nullptr,
+                                            PAGE_READWRITE,
+                                            static_cast<DWORD>(uint64_t{bytes} >> 32),
+                                            static_cast<DWORD>(bytes),
+                                            nullptr);
+  CloseHandle(file);
+  if(!mapping)
+    throw_last_os_error("can't map the bitset file");
+  void * const ptr = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, bytes);
+  CloseHandle(mapping);
+  if(!ptr)
+    throw_last_os_error("can't map the bitset file");
+  return ptr;
+#else
+  const int file = open(path, O_RDWR | O_CREAT, 0644);
+  if(file < 0)
+    throw_last_os_error("can't open the bitset file");
+
+  struct stat file_stat;
+  if(fstat(file, &file_stat) || (!file_stat.st_size && ftruncate(file, static_cast<off_t>(bytes))))
+  {
+    const int error = errno;
+    close(file);
+    errno = error;
+    throw_last_os_error("can't resize the bitset file");
+  }
+  if(file_stat.st_size && static_cast<size_t>(file_stat.st_size) != bytes)
+  {
+    close(file);
+    throw std::runtime_error{"bitset file size doesn't match its capacity"};
+  }
+  // The mapping keeps the file referenced after it's closed
+  void * const ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+  close(file);
+  if(ptr == MAP_FAILED)
+    throw_last_os_error("can't map the bitset file");
+  return ptr;
+#endif
+}
+
+inline void unmap_file(void * ptr, [[maybe_unused]] const size_t bytes)
+{
+#if defined(_WIN32)
+  UnmapViewOfFile(ptr);
+#else
+  munmap(ptr, bytes);
+#endif
+}
+
+// Write the modified pages of the mapped range to the file and wait until they're written
+inline void flush_mapped_range(const void * ptr, const size_t bytes)
+{
+#if defined(_WIN32)
+  if(!FlushViewOfFile(ptr, bytes))
+    throw_last_os_error("can't flush the bitset file");
+#else
+  // msync only takes page aligned addresses
+  const uintptr_t page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+  const uintptr_t address   = reinterpret_cast<uintptr_t>(ptr);
+  const uintptr_t first     = address & ~(page_size - 1);
+  if(msync(reinterpret_cast<void *>(first), address + bytes - first, MS_SYNC))
+    throw_last_os_error("can't flush the bitset file");
+#endif
+}
+
+}}
@@ -22,9 +22,12 @@ constexpr std::enable_if_t<std::is_integral_v<T>, T> int_log2(T val)
   return result;
 }
 
+// Smallest exponent e such that base^e >= val. Base must be a power of two
 template <typename T>
-constexpr T int_log_ceil(T base, T val)
+constexpr std::enable_if_t<std::is_integral_v<T>, T> int_log_ceil(T base, T val)
 {
-  return static_cast<T>(ceil(static_cast<double>(int_log2(val)) / int_log2(base)));
+  const T base_log2     = int_log2(base);
+  const T val_log2_ceil = val > 1 ? static_cast<T>(int_log2(static_cast<T>(val - 1)) + 1) : T{0};
+  return static_cast<T>((val_log2_ceil + base_log2 - 1) / base_log2);
 }
 }
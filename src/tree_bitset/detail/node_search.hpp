@@ -0,0 +1,113 @@
+#pragma once
+
+// Bit search in the metadata nodes which consist of multiple blocks
+
+#include <cstddef>
+#include <cinttypes>
+#include <limits>
+#include <type_traits>
+
+#include "bit"
+
+#if defined(__AVX2__) || defined(__AVX512F__) || defined(__BMI2__)
+#include <immintrin.h>
+#endif
+
+namespace treebitset { namespace detail {
+
+// Index of the first set bit of the node blocks XORed with xor_mask or NodeBlocks * bits per block if
+// there's none. A cache line node is compared to zero at once and the first nonzero block or byte is found
+// with tzcnt of the compare mask
+template <size_t NodeBlocks, typename block_t>
+inline size_t first_set_bit(const block_t * node, const block_t xor_mask)
+{
+  constexpr size_t bits_per_block = std::numeric_limits<block_t>::digits;
+#if defined(__AVX512F__)
+  if constexpr(std::is_same_v<block_t, uint64_t> && NodeBlocks == 8)
+  {
+    const __m512i  blocks  = _mm512_xor_si512(_mm512_loadu_si512(node), _mm512_set1_epi64(xor_mask));
+    const unsigned nonzero = _mm512_test_epi64_mask(blocks, blocks);
+    if(!nonzero)
+      return NodeBlocks * bits_per_block;
+    const size_t block_idx = std::countr_zero(nonzero);
+    return block_idx * bits_per_block + std::countr_zero(static_cast<block_t>(node[block_idx] ^ xor_mask));
+  }
+#endif
+#if defined(__AVX2__)
+  if constexpr(NodeBlocks * sizeof(block_t) == 64)
+  {
+    // Blocks are little-endian, so the first set bit of the node is in its first nonzero byte
+    const __m256i * halves = reinterpret_cast<const __m256i *>(node);
+    const __m256i   mask   = _mm256_set1_epi8(static_cast<char>(xor_mask));
+    const __m256i   zero   = _mm256_setzero_si256();
+    const __m256i   low    = _mm256_xor_si256(_mm256_loadu_si256(halves), mask);
+    const __m256i   high   = _mm256_xor_si256(_mm256_loadu_si256(halves + 1), mask);
+    const uint64_t  zero_bytes =
+      static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, zero))) |
+      static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, zero)))) << 32;
+    if(!~zero_bytes)
+      return NodeBlocks * bits_per_block;
+    const size_t        byte_idx = std::countr_zero(~zero_bytes);
+    const unsigned char byte     = static_cast<unsigned char>(
+      reinterpret_cast<const unsigned char *>(node)[byte_idx] ^ static_cast<unsigned char>(xor_mask));
+    return byte_idx * 8 + std::countr_zero(byte);
+  }
+#endif
+  for(size_t block_idx = 0; block_idx < NodeBlocks; ++block_idx)
+  {
+    const block_t block = node[block_idx] ^ xor_mask;
+    if(block)
+      return block_idx * bits_per_block + std::countr_zero(block);
+  }
+  return NodeBlocks * bits_per_block;
+}
+
+// Whether any of the node blocks XORed with xor_mask has a set bit. A cache line node is compared to zero at
+// once
+template <size_t NodeBlocks, typename block_t>
+inline bool any_set_bit(const block_t * node, const block_t xor_mask)
+{
+#if defined(__AVX512F__)
+  if constexpr(std::is_same_v<block_t, uint64_t> && NodeBlocks == 8)
+  {
+    const __m512i blocks = _mm512_xor_si512(_mm512_loadu_si512(node), _mm512_set1_epi64(xor_mask));
+    return _mm512_test_epi64_mask(blocks, blocks) != 0;
+  }
+#endif
+#if defined(__AVX2__)
+  if constexpr(NodeBlocks * sizeof(block_t) == 64)
+  {
+    // xor_mask is either all zeros or all ones, so any of its bytes will do
+    const __m256i * halves = reinterpret_cast<const __m256i *>(node);
+    const __m256i   mask   = _mm256_set1_epi8(static_cast<char>(xor_mask));
+    const __m256i   low    = _mm256_xor_si256(_mm256_loadu_si256(halves), mask);
+    const __m256i   high   = _mm256_xor_si256(_mm256_loadu_si256(halves + 1), mask);
+    const __m256i   blocks = _mm256_or_si256(low, high);
+    return !_mm256_testz_si256(blocks, blocks);
+  }
+#endif
+  block_t blocks = 0;
+  for(size_t block_idx = 0; block_idx < NodeBlocks; ++block_idx)
+    blocks |= node[block_idx] ^ xor_mask;
+  return blocks != 0;
+}
+
+// Index of the k-th lowest set bit of the block, which has to have more than k of them. PDEP deposits bit k
+// of the source to the k-th set bit position of the block
+template <typename block_t>
+inline size_t select_set_bit(const block_t block, size_t k)
+{
+#if defined(__BMI2__)
+  if constexpr(sizeof(block_t) <= sizeof(uint32_t))
+    return std::countr_zero(_pdep_u32(uint32_t{1} << k, block));
+  else
+    return std::countr_zero(static_cast<uint64_t>(_pdep_u64(uint64_t{1} << k, block)));
+#else
+  block_t bits = block;
+  for(; k; --k)
+    bits = static_cast<block_t>(bits & (bits - 1));
+  return std::countr_zero(bits);
+#endif
+}
+
+}}
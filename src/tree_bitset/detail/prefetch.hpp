@@ -0,0 +1,20 @@
+#pragma once
+
+// Software prefetch hint. It's a no-op where the compiler doesn't provide one
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#endif
+
+namespace treebitset { namespace detail {
+
+inline void prefetch([[maybe_unused]] const void * ptr)
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+  _mm_prefetch(static_cast<const char *>(ptr), _MM_HINT_T0);
+#elif defined(__GNUC__) || defined(__clang__)
+  __builtin_prefetch(ptr);
+#endif
+}
+
+}}
@@ -0,0 +1,121 @@
+#pragma once
+#include <cassert>
+#include "../sharded_tree_bitset.hpp"
+
+namespace treebitset {
+
+template <typename Config>
+ShardedTreeBitset<Config>::ShardedTreeBitset(const size_t exp_max, const size_t shards_exp)
+{
+  assert(shards_exp <= exp_max && (size_t{1} << shards_exp) <= max_shards);
+  _shard_exp_max = exp_max - shards_exp;
+  for(size_t shard_idx = 0; shard_idx < (size_t{1} << shards_exp); ++shard_idx)
+    _shards.emplace_back(_shard_exp_max);
+  _shards_with_free_ids.store(all_shards_mask());
+}
+
+template <typename Config>
+inline uint64_t ShardedTreeBitset<Config>::all_shards_mask() const
+{
+  return num_shards() == max_shards ? ~uint64_t{0} : (uint64_t{1} << num_shards()) - 1;
+}
+
+template <typename Config>
+void ShardedTreeBitset<Config>::clean()
+{
+  for(Shard & shard : _shards)
+    shard.clean();
+  _shards_with_free_ids.store(all_shards_mask());
+}
+
+template <typename Config>
+inline bool ShardedTreeBitset<Config>::is_free(const size_t id) const
+{
+  return _shards[id >> _shard_exp_max].is_free(id & ((size_t{1} << _shard_exp_max) - 1));
+}
+
+template <typename Config>
+inline void ShardedTreeBitset<Config>::set_free(const size_t id, const bool free)
+{
+  const size_t shard_idx = id >> _shard_exp_max;
+  _shards[shard_idx].set_free(id & ((size_t{1} << _shard_exp_max) - 1), free);
+  // The summary bit is set after the id is freed, so a thread which unsets it concurrently sees the id when
+  // it checks the shard again. It's only loaded otherwise to keep its cache line shared
+  const uint64_t shard_mask = uint64_t{1} << shard_idx;
+  if(free && !(_shards_with_free_ids.load() & shard_mask))
+    _shards_with_free_ids.fetch_or(shard_mask);
+}
+
+template <typename Config>
+inline void ShardedTreeBitset<Config>::mark_shard_empty(const size_t shard_idx)
+{
+  const uint64_t shard_mask = uint64_t{1} << shard_idx;
+  if(!(_shards_with_free_ids.load() & shard_mask))
+    return;
+  _shards_with_free_ids.fetch_and(~shard_mask);
+  if(_shards[shard_idx].has_free_ids())
+    _shards_with_free_ids.fetch_or(shard_mask);
+}
+
+template <typename Config>
+inline size_t ShardedTreeBitset<Config>::obtain_from_shard(const size_t shard_idx)
+{
+  const size_t id = _shards[shard_idx].obtain_id();
+  if(id == Shard::invalid_id)
+  {
+    mark_shard_empty(shard_idx);
+    return invalid_id;
+  }
+  return shard_idx << _shard_exp_max | id;
+}
+
+template <typename Config>
+inline size_t ShardedTreeBitset<Config>::obtain_id()
+{
+  static std::atomic<size_t> threads_count{0};
+  thread_local const size_t  thread_idx = threads_count++;
+  return obtain_id(thread_idx & (num_shards() - 1));
+}
+
+template <typename Config>
+size_t ShardedTreeBitset<Config>::obtain_id(const size_t home_shard)
+{
+  assert(home_shard < num_shards());
+  size_t id = obtain_from_shard(home_shard);
+  if(id != invalid_id)
+    return id;
+
+  // Steal from the nearest shard after the home one which might have free ids
+  for(uint64_t shards = _shards_with_free_ids.load(); shards; shards = _shards_with_free_ids.load())
+  {
+    const uint64_t rotated   = home_shard ? (shards >> home_shard) | (shards << (max_shards - home_shard))
+                                          : shards;
+    const size_t   shard_idx = (home_shard + std::countr_zero(rotated)) & (max_shards - 1);
+    id                       = obtain_from_shard(shard_idx);
+    if(id != invalid_id)
+      return id;
+  }
+
+  // Summary misses the shards which are being refilled, so they're checked before giving up
+  for(size_t shard_idx = 0; shard_idx < num_shards(); ++shard_idx)
+  {
+    id = obtain_from_shard(shard_idx);
+    if(id != invalid_id)
+      return id;
+  }
+  return invalid_id;
+}
+
+template <typename Config>
+inline size_t ShardedTreeBitset<Config>::num_shards() const
+{
+  return _shards.size();
+}
+
+template <typename Config>
+inline size_t ShardedTreeBitset<Config>::max_elements() const
+{
+  return num_shards() << _shard_exp_max;
+}
+
+}
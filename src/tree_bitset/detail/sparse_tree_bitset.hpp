@@ -0,0 +1,252 @@
+#pragma once
+#include <cassert>
+#include "../sparse_tree_bitset.hpp"
+
+namespace treebitset {
+
+template <typename Config>
+SparseTreeBitset<Config>::SparseTreeBitset(const size_t exp_max)
+{
+  const auto levels = detail::pow2_tree_levels<bits_per_block, 1>(exp_max);
+  _max_elements        = levels.max_elements;
+  _num_element_blocks  = levels.num_element_blocks;
+  _num_metadata_levels = levels.num_metadata_levels;
+  _data_block_mask =
+    _max_elements < bits_per_block ? static_cast<block_t>((block_t{1} << _max_elements) - 1) : all_bits_set;
+
+  // Levels aren't padded to the full tree, each of them tracks only the existing blocks of the next one
+  std::array<size_t, std::numeric_limits<size_t>::digits> level_sizes{};
+  size_t children = _num_element_blocks;
+  for(uint8_t lvl_idx = _num_metadata_levels; lvl_idx-- > 0;)
+  {
+    level_sizes[lvl_idx] = (children + bits_per_block - 1) >> bits_per_block_log2;
+    children             = level_sizes[lvl_idx];
+  }
+  for(uint8_t lvl_idx = 0; lvl_idx < _num_metadata_levels; ++lvl_idx)
+    _metadata_level_offsets[lvl_idx + 1] = _metadata_level_offsets[lvl_idx] + level_sizes[lvl_idx];
+
+  const size_t num_metadata_blocks = std::max(size_t{1}, _metadata_level_offsets[_num_metadata_levels]);
+  const size_t metadata_bytes      = num_metadata_blocks * sizeof(block_t);
+  const size_t num_leaf_pages      = (_num_element_blocks + leaf_page_blocks - 1) >> leaf_page_blocks_log2;
+  const size_t directory_bytes     = num_leaf_pages * sizeof(LeafPageSlot);
+  _metadata = {static_cast<block_t *>(detail::allocate_zeroed(metadata_bytes)), {metadata_bytes}};
+  _leaf_page_directory = {static_cast<LeafPageSlot *>(detail::allocate_zeroed(directory_bytes)),
+                          {directory_bytes}};
+  clean();
+}
+
+template <typename Config>
+inline typename SparseTreeBitset<Config>::LeafPage *
+SparseTreeBitset<Config>::slot_page(const LeafPageSlot slot)
+{
+  return reinterpret_cast<LeafPage *>(slot & ~slot_count_mask);
+}
+
+template <typename Config>
+inline typename SparseTreeBitset<Config>::block_t &
+SparseTreeBitset<Config>::metadata_block(const uint8_t level, const size_t block_idx)
+{
+  return _metadata[_metadata_level_offsets[level] + block_idx];
+}
+
+template <typename Config>
+inline typename SparseTreeBitset<Config>::block_t
+SparseTreeBitset<Config>::data_block(const size_t block_idx) const
+{
+  const LeafPage * const page = slot_page(_leaf_page_directory[block_idx >> leaf_page_blocks_log2]);
+  return page ? page->blocks[block_idx & (leaf_page_blocks - 1)] : block_t{0};
+}
+
+template <typename Config>
+inline typename SparseTreeBitset<Config>::block_t &
+SparseTreeBitset<Config>::allocated_data_block(const size_t block_idx, LeafPageSlot *& slot)
+{
+  const size_t page_idx = block_idx >> leaf_page_blocks_log2;
+  slot                  = &_leaf_page_directory[page_idx];
+  if(!*slot)
+    allocate_leaf_page(page_idx);
+  return slot_page(*slot)->blocks[block_idx & (leaf_page_blocks - 1)];
+}
+
+template <typename Config>
+inline void SparseTreeBitset<Config>::allocate_leaf_page(const size_t page_idx)
+{
+  LeafPage * page = nullptr;
+  if(!_free_leaf_pages.empty())
+  {
+    page = _free_leaf_pages.back();
+    _free_leaf_pages.pop_back();
+  }
+  else
+  {
+    if(!_num_fresh_slab_pages)
+    {
+      constexpr size_t slab_bytes = leaf_slab_pages * leaf_page_bytes;
+      _leaf_slabs.emplace_back(static_cast<LeafPage *>(detail::allocate_zeroed(slab_bytes, leaf_page_bytes)),
+                               ZeroedDeleter{slab_bytes});
+      _num_fresh_slab_pages = leaf_slab_pages;
+    }
+    page = _leaf_slabs.back().get() + (leaf_slab_pages - _num_fresh_slab_pages--);
+  }
+  _leaf_page_directory[page_idx] = reinterpret_cast<LeafPageSlot>(page);
+  ++_num_leaf_pages;
+}
+
+template <typename Config>
+inline void SparseTreeBitset<Config>::release_leaf_page(const size_t page_idx)
+{
+  // All blocks of a released page are zero, so it can be reused as is even when its pages can't be discarded,
+  // or when the OS pages are bigger than it and it shares them with other leaf pages
+  LeafPage * const page          = slot_page(_leaf_page_directory[page_idx]);
+  _leaf_page_directory[page_idx] = 0;
+  if(detail::os_page_bytes() <= leaf_page_bytes)
+    detail::discard_zeroed_pages(page, leaf_page_bytes);
+  _free_leaf_pages.push_back(page);
+  --_num_leaf_pages;
+}
+
+template <typename Config>
+inline void SparseTreeBitset<Config>::propagate_full(size_t block_idx)
+{
+  // Parents which still have other non-full children keep their own parent bits
+  for(uint8_t level = _num_metadata_levels; level-- > 0;)
+  {
+    const size_t parent_idx = block_idx >> bits_per_block_log2;
+    block_t &    parent     = metadata_block(level, parent_idx);
+    parent |= static_cast<block_t>(block_t{1} << (block_idx & (bits_per_block - 1)));
+    if(parent != all_bits_set)
+      return;
+    block_idx = parent_idx;
+  }
+}
+
+template <typename Config>
+inline void SparseTreeBitset<Config>::propagate_not_full(size_t block_idx)
+{
+  for(uint8_t level = _num_metadata_levels; level-- > 0;)
+  {
+    const size_t  parent_idx = block_idx >> bits_per_block_log2;
+    block_t &     parent     = metadata_block(level, parent_idx);
+    const block_t old_parent = parent;
+    parent &= static_cast<block_t>(~(block_t{1} << (block_idx & (bits_per_block - 1))));
+    if(old_parent != all_bits_set)
+      return;
+    block_idx = parent_idx;
+  }
+}
+
+template <typename Config>
+void SparseTreeBitset<Config>::clean()
+{
+  _leaf_slabs.clear();
+  _num_fresh_slab_pages = 0;
+  _free_leaf_pages.clear();
+  _num_leaf_pages       = 0;
+  detail::reset_zeroed(_leaf_page_directory.get(), _leaf_page_directory.get_deleter().bytes);
+  detail::reset_zeroed(_metadata.get(), _metadata.get_deleter().bytes);
+
+  // Nonexisting children of the root are full
+  if(_num_metadata_levels)
+  {
+    const size_t root_bits = _num_metadata_levels > 1
+                               ? _metadata_level_offsets[2] - _metadata_level_offsets[1]
+                               : _num_element_blocks;
+    if(root_bits < bits_per_block)
+      _metadata[0] = static_cast<block_t>(all_bits_set << root_bits);
+  }
+}
+
+template <typename Config>
+inline bool SparseTreeBitset<Config>::is_free(const size_t id) const
+{
+  assert(id < _max_elements);
+  return !((data_block(id >> bits_per_block_log2) >> (id & (bits_per_block - 1))) & block_t{1});
+}
+
+template <typename Config>
+inline void SparseTreeBitset<Config>::set_free(const size_t id, const bool free)
+{
+  assert(id < _max_elements);
+  const size_t  block_idx = id >> bits_per_block_log2;
+  const block_t mask      = static_cast<block_t>(block_t{1} << (id & (bits_per_block - 1)));
+  if(free)
+  {
+    LeafPageSlot & slot = _leaf_page_directory[block_idx >> leaf_page_blocks_log2];
+    if(!slot)
+      return;
+    block_t &     block     = slot_page(slot)->blocks[block_idx & (leaf_page_blocks - 1)];
+    const block_t old_block = block;
+    if(!(old_block & mask))
+      return;
+    block = static_cast<block_t>(old_block & ~mask);
+    if(old_block == all_bits_set)
+      propagate_not_full(block_idx);
+    // The page had this block counted, so the count doesn't borrow from the address
+    if(!block && !(--slot & slot_count_mask))
+      release_leaf_page(block_idx >> leaf_page_blocks_log2);
+    return;
+  }
+
+  LeafPageSlot * slot      = nullptr;
+  block_t &      block     = allocated_data_block(block_idx, slot);
+  const block_t  old_block = block;
+  if(old_block & mask)
+    return;
+  *slot += !old_block;
+  block = static_cast<block_t>(old_block | mask);
+  if(block == all_bits_set)
+    propagate_full(block_idx);
+}
+
+template <typename Config>
+size_t SparseTreeBitset<Config>::obtain_id()
+{
+  // Descend along the first non-full children
+  size_t block_idx = 0;
+  for(uint8_t level = 0; level < _num_metadata_levels; ++level)
+  {
+    const block_t full_children = metadata_block(level, block_idx);
+    if(full_children == all_bits_set)
+      return invalid_id;
+    block_idx = (block_idx << bits_per_block_log2) + std::countr_zero(static_cast<block_t>(~full_children));
+  }
+
+  // Only the data block of a bitset without metadata levels can be full here, and it isn't missing then
+  LeafPageSlot * slot      = nullptr;
+  block_t &      block     = allocated_data_block(block_idx, slot);
+  const block_t  free_bits = static_cast<block_t>(~block & _data_block_mask);
+  if(!free_bits)
+    return invalid_id;
+  const int bit_idx = std::countr_zero(free_bits);
+  *slot += !block;
+  block = static_cast<block_t>(block | block_t{1} << bit_idx);
+  if(block == all_bits_set)
+    propagate_full(block_idx);
+  return (block_idx << bits_per_block_log2) + bit_idx;
+}
+
+template <typename Config>
+inline size_t SparseTreeBitset<Config>::num_leaf_pages() const
+{
+  return _num_leaf_pages;
+}
+
+template <typename Config>
+inline uint8_t SparseTreeBitset<Config>::num_metadata_levels() const
+{
+  return _num_metadata_levels;
+}
+
+template <typename Config>
+inline size_t SparseTreeBitset<Config>::num_element_blocks() const
+{
+  return _num_element_blocks;
+}
+
+template <typename Config>
+inline size_t SparseTreeBitset<Config>::max_elements() const
+{
+  return _max_elements;
+}
+
+}
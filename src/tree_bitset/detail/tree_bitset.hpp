@@ -4,280 +4,1574 @@
 #include "../tree_bitset.hpp"
 
 namespace treebitset {
-template <typename Config>
-inline void TreeBitset<Config>::calculate_constants(const size_t exp_max)
+template <typename Config, size_t ExpMax>
+constexpr size_t TreeBitset<Config, ExpMax>::required_blocks(const size_t exp_max)
 {
-  assert(exp_max < bits_per_block);
+  return required_blocks(MaxElements{detail::pow2_capacity(exp_max)});
+}
 
-  _max_elements = size_t{1} << exp_max;
+template <typename Config, size_t ExpMax>
+constexpr size_t TreeBitset<Config, ExpMax>::required_blocks(const MaxElements max_elements)
+{
+  return detail::required_blocks<bits_per_block, node_blocks>(
+    max_elements.value, has_used_ids_tree, counts_used, lazy_init, lazy_init_chunk_blocks_log2);
+}
 
-  _num_element_blocks = std::max(size_t{1}, _max_elements >> bits_per_block_log2);
+template <typename Config, size_t ExpMax>
+inline void TreeBitset<Config, ExpMax>::StorageDeleter::operator()(block_t * ptr) const
+{
+  if constexpr(storage_policy == StoragePolicy::memory_resource)
+    resource->deallocate(ptr, bytes, storage_alignment);
+  else if constexpr(owns_zeroed_pages)
+    detail::deallocate_zeroed(ptr, bytes);
+  else if constexpr(is_mapped_file)
+    detail::unmap_file(reinterpret_cast<char *>(ptr) - detail::mapped_file_header_bytes, bytes);
+  else if constexpr(storage_policy == StoragePolicy::owning)
+    ::operator delete[](ptr, std::align_val_t{storage_alignment});
+}
+
+template <typename Config, size_t ExpMax>
+TreeBitset<Config, ExpMax>::TreeBitset(const size_t exp_max)
+  : TreeBitset(MaxElements{detail::pow2_capacity(exp_max)})
+{
+}
 
-  _num_metadata_levels = static_cast<uint8_t>(math::int_log_ceil(bits_per_block, _max_elements));
-  if(_num_metadata_levels)
-    --_num_metadata_levels;
+template <typename Config, size_t ExpMax>
+TreeBitset<Config, ExpMax>::TreeBitset(const MaxElements max_elements)
+{
+  static_assert(storage_policy != StoragePolicy::external, "external storage requires a buffer");
+  calculate_constants(max_elements.value);
 
-  _num_metadata_blocks = 0;
-  for(uint8_t metadata_lvl_idx = 0; metadata_lvl_idx < _num_metadata_levels; ++metadata_lvl_idx)
-    _num_metadata_blocks += num_metadata_blocks_on_level(metadata_lvl_idx);
+  // Storage of the compile-time capacity is placed inline
+  if constexpr(!is_static_capacity)
+  {
+    const size_t storage_bytes = required_blocks(max_elements) * sizeof(block_t);
+    if constexpr(storage_policy == StoragePolicy::memory_resource)
+    {
+      std::pmr::memory_resource * resource = std::pmr::get_default_resource();
+      _storage = storage_t{static_cast<block_t *>(resource->allocate(storage_bytes, storage_alignment)),
+                           {storage_bytes, resource}};
+    }
+    else if constexpr(owns_zeroed_pages)
+      _storage = storage_t{static_cast<block_t *>(detail::allocate_zeroed(storage_bytes, storage_alignment)),
+                           {storage_bytes}};
+    else
+      _storage = storage_t{
+        static_cast<block_t *>(::operator new[](storage_bytes, std::align_val_t{storage_alignment}))};
+    assert(reinterpret_cast<uintptr_t>(blocks()) % storage_alignment == 0);
+  }
+  init_storage();
 }
 
-template <typename Config>
-TreeBitset<Config>::TreeBitset(const size_t exp_max)
+template <typename Config, size_t ExpMax>
+TreeBitset<Config, ExpMax>::TreeBitset()
 {
-  calculate_constants(exp_max);
-  _storage = std::make_unique<block_t[]>(_num_element_blocks + _num_metadata_blocks);
+  static_assert(is_static_capacity, "capacity has to be supplied to the constructor");
+  init_storage();
+}
+
+template <typename Config, size_t ExpMax>
+TreeBitset<Config, ExpMax>::TreeBitset(const size_t exp_max, block_t * buffer)
+  : TreeBitset(MaxElements{detail::pow2_capacity(exp_max)}, buffer)
+{
+}
+
+template <typename Config, size_t ExpMax>
+TreeBitset<Config, ExpMax>::TreeBitset(const MaxElements max_elements, block_t * buffer)
+{
+  static_assert(storage_policy == StoragePolicy::external, "buffer can only be supplied to external storage");
+  calculate_constants(max_elements.value);
+  _storage = storage_t{buffer};
+  init_storage();
+}
 
+template <typename Config, size_t ExpMax>
+TreeBitset<Config, ExpMax>::TreeBitset(const size_t exp_max, std::pmr::memory_resource * resource)
+  : TreeBitset(MaxElements{detail::pow2_capacity(exp_max)}, resource)
+{
+}
+
+template <typename Config, size_t ExpMax>
+TreeBitset<Config, ExpMax>::TreeBitset(const MaxElements max_elements, std::pmr::memory_resource * resource)
+{
+  static_assert(storage_policy == StoragePolicy::memory_resource,
+                "memory resource can only be supplied to memory_resource storage");
+  calculate_constants(max_elements.value);
+
+  const size_t storage_bytes = required_blocks(max_elements) * sizeof(block_t);
+  _storage                   = storage_t{
+    static_cast<block_t *>(resource->allocate(storage_bytes, storage_alignment)), {storage_bytes, resource}};
+  init_storage();
+}
+
+template <typename Config, size_t ExpMax>
+TreeBitset<Config, ExpMax>::TreeBitset(const size_t exp_max, const char * path)
+  : TreeBitset(MaxElements{detail::pow2_capacity(exp_max)}, path)
+{
+}
+
+template <typename Config, size_t ExpMax>
+TreeBitset<Config, ExpMax>::TreeBitset(const MaxElements max_elements, const char * path)
+{
+  static_assert(is_mapped_file, "file can only be supplied to mapped_file storage");
+  calculate_constants(max_elements.value);
+
+  const size_t file_bytes =
+    detail::mapped_file_header_bytes + required_blocks(max_elements) * sizeof(block_t);
+  char * const mapping    = static_cast<char *>(detail::map_file(path, file_bytes));
+  _storage =
+    storage_t{reinterpret_cast<block_t *>(mapping + detail::mapped_file_header_bytes), {file_bytes}};
+  _dirty_chunks = detail::DirtyChunks{file_bytes - detail::mapped_file_header_bytes};
+
+  detail::MappedFileHeader & header = *file_header();
+  if(header.magic)
+  {
+    if(header.magic != detail::mapped_file_magic || header.version != detail::mapped_file_version ||
+       header.bits_per_block != bits_per_block || header.max_elements != _max_elements ||
+       header.policies != file_policies)
+      throw std::runtime_error{"bitset file was created with another configuration"};
+
+    _init_epoch = static_cast<block_t>(header.init_epoch);
+    // max_used_id is only stored by sync(), so it's stale when the blocks were modified afterwards
+    if(!header.modified)
+      _max_used_id = header.max_used_id;
+    else if constexpr(keeps_max_id_current)
+      _max_used_id = find_new_smaller_max_used_id();
+    return;
+  }
+
+  // The file is new or its initialization was interrupted. The magic is written last, once the storage has
+  // reached the disk
+  header.version        = detail::mapped_file_version;
+  header.bits_per_block = bits_per_block;
+  header.max_elements   = _max_elements;
+  header.policies       = file_policies;
+  init_storage();
+  sync();
+  header.magic = detail::mapped_file_magic;
+  detail::flush_mapped_range(&header, sizeof(header));
+}
+
+template <typename Config, size_t ExpMax>
+inline void TreeBitset<Config, ExpMax>::init_storage()
+{
+  if constexpr(lazy_init && !owns_zeroed_pages)
+  {
+    const size_t num_chunks = detail::num_lazy_init_chunks(num_storage_blocks(), lazy_init_chunk_blocks_log2);
+    std::fill(chunk_init_epochs(), chunk_init_epochs() + num_chunks, block_t{0});
+    mark_dirty(num_storage_blocks(), num_storage_blocks() + num_chunks - 1);
+  }
   clean();
-  // Unset root level bits for nonexisting elements if the tree isn't T-pyramid
-  const block_t max_elements_mask = max_element_mask();
-  if(max_elements_mask)
-    _storage[0] &= max_elements_mask;
 }
 
-template <typename Config>
-inline typename TreeBitset<Config>::block_t TreeBitset<Config>::max_element_mask() const
+template <typename Config, size_t ExpMax>
+inline typename TreeBitset<Config, ExpMax>::block_t * TreeBitset<Config, ExpMax>::blocks()
+{
+  if constexpr(is_static_capacity)
+    return _storage.data();
+  else
+    return _storage.get();
+}
+
+template <typename Config, size_t ExpMax>
+inline const typename TreeBitset<Config, ExpMax>::block_t * TreeBitset<Config, ExpMax>::blocks() const
+{
+  if constexpr(is_static_capacity)
+    return _storage.data();
+  else
+    return _storage.get();
+}
+
+template <typename Config, size_t ExpMax>
+inline typename TreeBitset<Config, ExpMax>::block_t * TreeBitset<Config, ExpMax>::chunk_init_epochs()
+{
+  return blocks() + num_storage_blocks();
+}
+
+template <typename Config, size_t ExpMax>
+inline const typename TreeBitset<Config, ExpMax>::block_t *
+TreeBitset<Config, ExpMax>::chunk_init_epochs() const
+{
+  return blocks() + num_storage_blocks();
+}
+
+template <typename Config, size_t ExpMax>
+inline detail::MappedFileHeader * TreeBitset<Config, ExpMax>::file_header()
+{
+  return reinterpret_cast<detail::MappedFileHeader *>(reinterpret_cast<char *>(blocks()) -
+                                                      detail::mapped_file_header_bytes);
+}
+
+template <typename Config, size_t ExpMax>
+inline void TreeBitset<Config, ExpMax>::mark_dirty([[maybe_unused]] const size_t first_idx,
+                                                   [[maybe_unused]] const size_t last_idx)
+{
+  if constexpr(is_mapped_file)
+  {
+    // The header page is only dirtied once per sync
+    if(!_dirty_chunks.any())
+      file_header()->modified = 1;
+    _dirty_chunks.mark(first_idx * sizeof(block_t), last_idx * sizeof(block_t) + sizeof(block_t) - 1);
+  }
+}
+
+template <typename Config, size_t ExpMax>
+inline typename TreeBitset<Config, ExpMax>::block_t
+TreeBitset<Config, ExpMax>::last_element_block_mask() const
+{
+  const size_t last_block_bits = _max_elements & (bits_per_block - 1);
+  return last_block_bits ? static_cast<block_t>((block_t{1} << last_block_bits) - 1)
+                         : static_cast<block_t>(~block_t{0});
+}
+
+template <typename Config, size_t ExpMax>
+inline typename TreeBitset<Config, ExpMax>::block_t
+TreeBitset<Config, ExpMax>::raw_block(const size_t storage_idx) const
+{
+  if constexpr(lazy_init)
+  {
+    // Uninitialized blocks have the clean() values: all ids are free and none of them is used
+    if(chunk_init_epochs()[storage_idx >> lazy_init_chunk_blocks_log2] != _init_epoch)
+      return storage_idx < used_ids_tree_offset() ? static_cast<block_t>(~inverted_bits_mask) : block_t{0};
+  }
+  return _storage[storage_idx];
+}
+
+template <typename Config, size_t ExpMax>
+inline void TreeBitset<Config, ExpMax>::initialize_chunk(const size_t chunk_idx)
+{
+  const size_t chunk_size    = size_t{1} << lazy_init_chunk_blocks_log2;
+  const size_t first_idx     = chunk_idx * chunk_size;
+  const size_t end_idx       = std::min(first_idx + chunk_size, num_storage_blocks());
+  const size_t used_tree_idx = std::clamp(used_ids_tree_offset(), first_idx, end_idx);
+
+  block_t * const mem = blocks();
+  std::fill(mem + first_idx, mem + used_tree_idx, static_cast<block_t>(~inverted_bits_mask));
+  std::fill(mem + used_tree_idx, mem + end_idx, block_t{0});
+  chunk_init_epochs()[chunk_idx] = _init_epoch;
+  mark_dirty(first_idx, end_idx - 1);
+  mark_dirty(num_storage_blocks() + chunk_idx, num_storage_blocks() + chunk_idx);
+}
+
+template <typename Config, size_t ExpMax>
+inline void TreeBitset<Config, ExpMax>::initialize_blocks(const size_t first_idx,
+                                                  const size_t last_idx,
+                                                  const bool   overwritten)
+{
+  // Blocks are initialized right before they're written
+  mark_dirty(first_idx, last_idx);
+  if constexpr(lazy_init)
+  {
+    const size_t chunk_size = size_t{1} << lazy_init_chunk_blocks_log2;
+    for(size_t chunk_idx = first_idx >> lazy_init_chunk_blocks_log2;
+        chunk_idx <= last_idx >> lazy_init_chunk_blocks_log2;
+        ++chunk_idx)
+    {
+      if(chunk_init_epochs()[chunk_idx] == _init_epoch)
+        continue;
+      // Chunks which are about to be completely overwritten by the caller don't need the initial values
+      const size_t chunk_first_idx = chunk_idx * chunk_size;
+      const size_t chunk_last_idx  = std::min(chunk_first_idx + chunk_size, num_storage_blocks()) - 1;
+      if(overwritten && chunk_first_idx >= first_idx && chunk_last_idx <= last_idx)
+      {
+        chunk_init_epochs()[chunk_idx] = _init_epoch;
+        mark_dirty(num_storage_blocks() + chunk_idx, num_storage_blocks() + chunk_idx);
+      }
+      else
+        initialize_chunk(chunk_idx);
+    }
+  }
+}
+
+template <typename Config, size_t ExpMax>
+template <bool UsedIDsTree>
+inline typename TreeBitset<Config, ExpMax>::block_t
+TreeBitset<Config, ExpMax>::load_block(const size_t storage_idx) const
+{
+  return raw_block(storage_idx) ^ (UsedIDsTree ? block_t{0} : inverted_bits_mask);
+}
+
+template <typename Config, size_t ExpMax>
+template <bool UsedIDsTree>
+inline void TreeBitset<Config, ExpMax>::store_block(const size_t storage_idx, const block_t value)
+{
+  if constexpr(lazy_init)
+  {
+    const size_t chunk_idx = storage_idx >> lazy_init_chunk_blocks_log2;
+    if(chunk_init_epochs()[chunk_idx] != _init_epoch)
+      initialize_chunk(chunk_idx);
+  }
+  _storage[storage_idx] = value ^ (UsedIDsTree ? block_t{0} : inverted_bits_mask);
+  mark_dirty(storage_idx, storage_idx);
+}
+
+template <typename Config, size_t ExpMax>
+template <bool UsedIDsTree>
+inline size_t TreeBitset<Config, ExpMax>::first_set_bit_in_node(const size_t storage_idx) const
+{
+  if constexpr(node_blocks == 1)
+  {
+    const block_t block = load_block<UsedIDsTree>(storage_idx);
+    return block ? static_cast<size_t>(std::countr_zero(block)) : node_bits;
+  }
+  else
+  {
+    if constexpr(lazy_init)
+    {
+      // Nodes never cross the chunk boundaries and the uninitialized ones track all of their children
+      if(chunk_init_epochs()[storage_idx >> lazy_init_chunk_blocks_log2] != _init_epoch)
+        return UsedIDsTree ? node_bits : 0;
+    }
+    return detail::first_set_bit<node_blocks>(blocks() + storage_idx,
+                                               UsedIDsTree ? block_t{0} : inverted_bits_mask);
+  }
+}
+
+template <typename Config, size_t ExpMax>
+template <bool UsedIDsTree>
+inline size_t TreeBitset<Config, ExpMax>::next_set_bit_in_node(const size_t storage_idx,
+                                                               const size_t from_bit) const
+{
+  const block_t all_bits_set = static_cast<block_t>(~block_t{0});
+  for(size_t node_block_idx = from_bit >> bits_per_block_log2; node_block_idx < node_blocks; ++node_block_idx)
+  {
+    block_t block = load_block<UsedIDsTree>(storage_idx + node_block_idx);
+    if(node_block_idx == from_bit >> bits_per_block_log2)
+      block &= static_cast<block_t>(all_bits_set << (from_bit & (bits_per_block - 1)));
+    if(block)
+      return node_block_idx * bits_per_block + std::countr_zero(block);
+  }
+  return node_bits;
+}
+
+template <typename Config, size_t ExpMax>
+template <bool UsedIDsTree>
+inline size_t TreeBitset<Config, ExpMax>::prev_set_bit_in_node(const size_t storage_idx,
+                                                               const size_t end_bit) const
+{
+  for(size_t node_block_idx = (end_bit + bits_per_block - 1) >> bits_per_block_log2; node_block_idx-- > 0;)
+  {
+    block_t      block     = load_block<UsedIDsTree>(storage_idx + node_block_idx);
+    const size_t block_end = end_bit - node_block_idx * bits_per_block;
+    if(block_end < bits_per_block)
+      block &= static_cast<block_t>((block_t{1} << block_end) - 1);
+    if(block)
+      return node_block_idx * bits_per_block + bits_per_block - 1 - std::countl_zero(block);
+  }
+  return node_bits;
+}
+
+template <typename Config, size_t ExpMax>
+template <bool UsedIDsTree>
+inline bool TreeBitset<Config, ExpMax>::node_is_empty(const size_t storage_idx) const
 {
-  return static_cast<block_t>((size_t{1} << (_max_elements >> (_num_metadata_levels * bits_per_block_log2))) -
-                              1);
+  if constexpr(node_blocks == 1)
+    return load_block<UsedIDsTree>(storage_idx) == block_t{0};
+  else
+  {
+    if constexpr(lazy_init)
+    {
+      if(chunk_init_epochs()[storage_idx >> lazy_init_chunk_blocks_log2] != _init_epoch)
+        return UsedIDsTree;
+    }
+    return !detail::any_set_bit<node_blocks>(blocks() + storage_idx,
+                                             UsedIDsTree ? block_t{0} : inverted_bits_mask);
+  }
 }
 
-template <typename Config>
-inline uint8_t TreeBitset<Config>::num_metadata_levels() const
+template <typename Config, size_t ExpMax>
+inline bool TreeBitset<Config, ExpMax>::root_is_empty() const
+{
+  return node_blocks == 1 || !_num_metadata_levels ? load_block(0) == block_t{0} : node_is_empty(0);
+}
+
+template <typename Config, size_t ExpMax>
+inline uint8_t TreeBitset<Config, ExpMax>::num_metadata_levels() const
 {
   return _num_metadata_levels;
 }
-template <typename Config>
-inline size_t TreeBitset<Config>::num_element_blocks() const
+template <typename Config, size_t ExpMax>
+inline size_t TreeBitset<Config, ExpMax>::num_element_blocks() const
 {
   return _num_element_blocks;
 }
-template <typename Config>
-inline size_t TreeBitset<Config>::num_metadata_blocks() const
+template <typename Config, size_t ExpMax>
+inline size_t TreeBitset<Config, ExpMax>::num_metadata_blocks() const
 {
   return _num_metadata_blocks;
 }
-template <typename Config>
-inline size_t TreeBitset<Config>::max_elements() const
+template <typename Config, size_t ExpMax>
+inline size_t TreeBitset<Config, ExpMax>::max_elements() const
 {
   return _max_elements;
 }
 
-template <typename Config>
-inline size_t TreeBitset<Config>::max_used_id() const
+template <typename Config, size_t ExpMax>
+inline size_t TreeBitset<Config, ExpMax>::max_used_id() const
 {
-  return _max_used_id;
+  if constexpr(keeps_max_id_current)
+    return _max_used_id;
+  else
+    return find_prev_used(_max_elements - 1);
 }
 
-template <typename Config>
-inline size_t TreeBitset<Config>::num_metadata_blocks_on_level(const uint8_t level) const
+template <typename Config, size_t ExpMax>
+inline void TreeBitset<Config, ExpMax>::track_max_used_id(const size_t used_id)
 {
-  return size_t{1} << (bits_per_block_log2 * static_cast<size_t>(level));
+  if constexpr(keeps_max_id_current)
+    _max_used_id = _max_used_id == invalid_id ? used_id : std::max(_max_used_id, used_id);
 }
 
-template <typename Config>
-void TreeBitset<Config>::clean()
+template <typename Config, size_t ExpMax>
+constexpr size_t TreeBitset<Config, ExpMax>::num_metadata_blocks_on_level(const uint8_t level)
 {
-  auto mem = _storage.get();
-  std::fill(mem, mem + _num_element_blocks + _num_metadata_blocks, static_cast<block_t>(~block_t{0}));
+  return node_blocks << (node_bits_log2 * static_cast<size_t>(level));
+}
+
+template <typename Config, size_t ExpMax>
+constexpr size_t TreeBitset<Config, ExpMax>::metadata_level_offset(const uint8_t level)
+{
+  // Sum of the geometric progression of the previous levels sizes. The data level starts before the level
+  // after the last one when the last level is shorter than its full size. The division is exact, so it goes
+  // first to keep the deepest levels of the biggest capacities in range
+  return ((size_t{1} << (node_bits_log2 * static_cast<size_t>(level))) - 1) / (node_bits - 1) * node_blocks;
+}
+
+template <typename Config, size_t ExpMax>
+inline size_t TreeBitset<Config, ExpMax>::level_offset_at_height(const uint8_t height) const
+{
+  return height ? metadata_level_offset(static_cast<uint8_t>(_num_metadata_levels - height))
+                : _num_metadata_blocks;
+}
+
+template <typename Config, size_t ExpMax>
+template <typename F>
+inline void TreeBitset<Config, ExpMax>::for_each_metadata_level(F && f) const
+{
+  if constexpr(is_static_capacity)
+    detail::unrolled_for(f, std::make_index_sequence<_num_metadata_levels>{});
+  else
+  {
+    for(uint8_t lvl_idx = 0; lvl_idx < _num_metadata_levels; ++lvl_idx)
+      if(!f(lvl_idx))
+        break;
+  }
+}
+
+template <typename Config, size_t ExpMax>
+inline size_t TreeBitset<Config, ExpMax>::used_ids_tree_offset() const
+{
+  // Used ids tree has the same layout as the default metadata tree and is placed right after the data blocks
+  return detail::used_ids_tree_offset(_num_metadata_blocks, _num_element_blocks, node_blocks);
+}
+
+template <typename Config, size_t ExpMax>
+inline size_t TreeBitset<Config, ExpMax>::used_counts_offset() const
+{
+  // Initial values of the blocks starting with the used ids tree offset are zero even without the tree
+  return detail::used_counts_offset(used_ids_tree_offset() + (has_used_ids_tree ? _num_metadata_blocks : 0),
+                                    used_count_blocks);
+}
+
+template <typename Config, size_t ExpMax>
+inline size_t TreeBitset<Config, ExpMax>::num_storage_blocks() const
+{
+  if constexpr(counts_used)
+    return used_counts_offset() + _num_metadata_blocks / node_blocks * used_count_blocks;
+  else
+    return has_used_ids_tree ? used_ids_tree_offset() + _num_metadata_blocks
+                             : _num_metadata_blocks + _num_element_blocks;
+}
+
+template <typename Config, size_t ExpMax>
+void TreeBitset<Config, ExpMax>::clean()
+{
+  auto mem = blocks();
+  if constexpr(lazy_init)
+  {
+    // Invalidate all initialized chunks. Epochs can only repeat after a wraparound, which resets them all
+    if(++_init_epoch == 0)
+    {
+      const size_t num_chunks =
+        detail::num_lazy_init_chunks(num_storage_blocks(), lazy_init_chunk_blocks_log2);
+      std::fill(chunk_init_epochs(), chunk_init_epochs() + num_chunks, block_t{0});
+      mark_dirty(num_storage_blocks(), num_storage_blocks() + num_chunks - 1);
+      _init_epoch = 1;
+    }
+    // Chunks of the file are only valid with the epoch which they were initialized with. No blocks may be
+    // marked dirty then, so the stored max_used_id has to be valid already
+    if constexpr(is_mapped_file)
+    {
+      file_header()->init_epoch  = _init_epoch;
+      file_header()->max_used_id = invalid_id;
+    }
+  }
+  else if constexpr(zero_means_free)
+  {
+    // Pages can only be given back to the OS when we've mapped them
+    if constexpr(owns_zeroed_pages)
+      detail::reset_zeroed(mem, num_storage_blocks() * sizeof(block_t));
+    else
+      std::fill(mem, mem + num_storage_blocks(), block_t{0});
+  }
+  else
+  {
+    std::fill(mem, mem + _num_element_blocks + _num_metadata_blocks, static_cast<block_t>(~block_t{0}));
+    // Padding before the used ids tree is zeroed as well, so the storage can be compared
+    std::fill(mem + _num_element_blocks + _num_metadata_blocks, mem + num_storage_blocks(), block_t{0});
+  }
+  if constexpr(!lazy_init)
+    mark_dirty(0, num_storage_blocks() - 1);
+  mask_nonexisting();
 
   _max_used_id = invalid_id;
 }
 
-template <typename Config>
-inline bool TreeBitset<Config>::is_free(const size_t id) const
+template <typename Config, size_t ExpMax>
+inline void TreeBitset<Config, ExpMax>::mask_nonexisting()
+{
+  for_each_partial_block([this](const uint8_t height, const size_t block_idx, const block_t mask) {
+    const size_t storage_idx = level_offset_at_height(height) + block_idx;
+    store_block(storage_idx, load_block(storage_idx) & mask);
+    // The used ids tree tracks the last data block from now on, so its bit doesn't change on the hot paths
+    if constexpr(has_used_ids_tree)
+    {
+      if(height)
+        store_block<true>(used_ids_tree_offset() + storage_idx,
+                          load_block<true>(used_ids_tree_offset() + storage_idx) & mask);
+      else
+        update_metadata<true>(block_idx * bits_per_block, true);
+    }
+  });
+}
+
+template <typename Config, size_t ExpMax>
+template <typename F>
+inline void TreeBitset<Config, ExpMax>::for_each_partial_block(F && f) const
+{
+  // Each level has the nodes which its children on the level below need, starting with the data blocks
+  // which the ids need. Only the last node of a level can be partial, the root is partial if the tree isn't
+  // T-pyramid
+  size_t num_children = _max_elements;
+  for(uint8_t height = 0; height <= _num_metadata_levels; ++height)
+  {
+    const size_t node_bits_on_level_log2 = height ? node_bits_log2 : bits_per_block_log2;
+    const size_t blocks_per_node         = height ? node_blocks : 1;
+    const size_t last_node               = (num_children - 1) >> node_bits_on_level_log2;
+    const size_t last_node_bits          = num_children - (last_node << node_bits_on_level_log2);
+    // The first partial block may still have some existing bits, the following ones have none
+    for(size_t node_block_idx = last_node_bits >> bits_per_block_log2; node_block_idx < blocks_per_node;
+        ++node_block_idx)
+    {
+      const size_t existing_bits =
+        node_block_idx == last_node_bits >> bits_per_block_log2 ? last_node_bits & (bits_per_block - 1) : 0;
+      f(height,
+        last_node * blocks_per_node + node_block_idx,
+        static_cast<block_t>((block_t{1} << existing_bits) - 1));
+    }
+    num_children = last_node + 1;
+  }
+}
+
+template <typename Config, size_t ExpMax>
+void TreeBitset<Config, ExpMax>::sync()
+{
+  static_assert(is_mapped_file, "only mapped_file storage can be synced");
+  const size_t storage_bytes = _storage.get_deleter().bytes - detail::mapped_file_header_bytes;
+  char * const storage       = reinterpret_cast<char *>(blocks());
+  _dirty_chunks.flush([storage, storage_bytes](const size_t first_byte, const size_t bytes) {
+    detail::flush_mapped_range(storage + first_byte, std::min(bytes, storage_bytes - first_byte));
+  });
+  // The header is flushed last, so it doesn't claim the blocks are synced before they are
+  detail::MappedFileHeader & header = *file_header();
+  header.max_used_id                = _max_used_id;
+  header.modified                   = 0;
+  detail::flush_mapped_range(&header, sizeof(header));
+}
+
+template <typename Config, size_t ExpMax>
+inline void TreeBitset<Config, ExpMax>::copy_blocks_to(TreeBitset & dst,
+                                                      const size_t src_idx,
+                                                      const size_t dst_idx,
+                                                      const size_t count) const
+{
+  if(!count)
+    return;
+  dst.initialize_blocks(dst_idx, dst_idx + count - 1, true);
+  block_t * const dst_blocks = dst.blocks() + dst_idx;
+  if constexpr(lazy_init)
+  {
+    for(size_t block_idx = 0; block_idx < count; ++block_idx)
+      dst_blocks[block_idx] = raw_block(src_idx + block_idx);
+  }
+  else
+    std::copy(blocks() + src_idx, blocks() + src_idx + count, dst_blocks);
+}
+
+template <typename Config, size_t ExpMax>
+template <typename... StorageArgs>
+TreeBitset<Config, ExpMax> TreeBitset<Config, ExpMax>::resized(const size_t new_exp_max,
+                                                               StorageArgs... storage_args) const
+{
+  static_assert(!is_static_capacity, "compile-time capacity can't be changed");
+  static_assert(!is_mapped_file, "capacity of the mapped file can't be changed");
+  if constexpr(storage_policy == StoragePolicy::memory_resource && !sizeof...(StorageArgs))
+    return TreeBitset{new_exp_max, _storage.get_deleter().resource};
+  else
+    return TreeBitset{new_exp_max, storage_args...};
+}
+
+template <typename Config, size_t ExpMax>
+void TreeBitset<Config, ExpMax>::copy_tree_to(TreeBitset & dst) const
+{
+  // The tree of the smaller capacity is a prefix of the bigger one at every height above the data level, as
+  // the children of the node n are always the nodes [n * node_bits, (n + 1) * node_bits) of the level below.
+  // Only the existing nodes of the smaller tree are copied, the other blocks keep their clean() values
+  const size_t  num_element_blocks = std::min(_num_element_blocks, dst._num_element_blocks);
+  const uint8_t num_common_levels  = std::min(_num_metadata_levels, dst._num_metadata_levels);
+  for(uint8_t height = 1; height <= num_common_levels; ++height)
+  {
+    const size_t num_blocks = (((num_element_blocks - 1) >> (node_bits_log2 * height)) + 1) * node_blocks;
+    const size_t src_idx    = level_offset_at_height(height);
+    const size_t dst_idx    = dst.level_offset_at_height(height);
+    copy_blocks_to(dst, src_idx, dst_idx, num_blocks);
+    if constexpr(has_used_ids_tree)
+      copy_blocks_to(
+        dst, used_ids_tree_offset() + src_idx, dst.used_ids_tree_offset() + dst_idx, num_blocks);
+  }
+  copy_blocks_to(dst, _num_metadata_blocks, dst._num_metadata_blocks, num_element_blocks);
+}
+
+template <typename Config, size_t ExpMax>
+template <typename... StorageArgs>
+void TreeBitset<Config, ExpMax>::grow(const size_t new_exp_max, StorageArgs... storage_args)
+{
+  assert(size_t{1} << new_exp_max >= _max_elements);
+  TreeBitset grown = resized(new_exp_max, storage_args...);
+  copy_tree_to(grown);
+
+  // Nonexisting children and ids of the old last nodes have only free ids now. Only the root of the new tree
+  // is partial, so its mask is applied once the parent bits are updated
+  for_each_partial_block([&grown](const uint8_t height, const size_t block_idx, const block_t mask) {
+    const size_t storage_idx = grown.level_offset_at_height(height) + block_idx;
+    grown.store_block(storage_idx, grown.load_block(storage_idx) | static_cast<block_t>(~mask));
+  });
+
+  // Parent bits along the path of the old last data block are updated up to the new root in both trees. New
+  // levels are clean otherwise, as the first bits of their first nodes track the old root
+  auto set_bit = [&grown](const size_t storage_idx, const size_t bit, const bool value, auto used_ids_tree) {
+    constexpr bool UsedIDsTree = decltype(used_ids_tree)::value;
+    const block_t  block       = grown.template load_block<UsedIDsTree>(storage_idx);
+    const block_t  mask        = static_cast<block_t>(block_t{1} << bit);
+    grown.template store_block<UsedIDsTree>(storage_idx, value ? block | mask : block & ~mask);
+  };
+  size_t child_idx = _num_element_blocks - 1;
+  for(uint8_t height = 1; height <= grown._num_metadata_levels; ++height)
+  {
+    const size_t storage_idx  = grown.level_offset_at_height(height) + (child_idx >> bits_per_block_log2);
+    const size_t bit          = child_idx & (bits_per_block - 1);
+    const size_t child_offset = grown.level_offset_at_height(static_cast<uint8_t>(height - 1));
+    const bool   is_data      = height == 1;
+    set_bit(storage_idx,
+            bit,
+            is_data ? grown.load_block(child_offset + child_idx) != block_t{0}
+                    : !grown.node_is_empty(child_offset + child_idx * node_blocks),
+            std::false_type{});
+    if constexpr(has_used_ids_tree)
+    {
+      const size_t used_child_idx = grown.used_ids_tree_offset() + child_offset + child_idx * node_blocks;
+      set_bit(grown.used_ids_tree_offset() + storage_idx,
+              bit,
+              is_data ? grown.load_block(child_offset + child_idx) != static_cast<block_t>(~block_t{0})
+                      : !grown.template node_is_empty<true>(used_child_idx),
+              std::true_type{});
+    }
+    child_idx >>= node_bits_log2;
+  }
+  grown.mask_nonexisting();
+  // Counts aren't copied, the ones of the new levels would've been different anyway
+  if constexpr(counts_used)
+    grown.recount_used(0, _num_element_blocks - 1);
+
+  grown._max_used_id = _max_used_id;
+  *this              = std::move(grown);
+}
+
+template <typename Config, size_t ExpMax>
+template <typename... StorageArgs>
+void TreeBitset<Config, ExpMax>::shrink_to_fit(StorageArgs... storage_args)
+{
+  const size_t used_id     = max_used_id();
+  const size_t new_exp_max = used_id == invalid_id || !used_id ? 0 : math::int_log2(used_id) + 1;
+  if(size_t{1} << new_exp_max >= _max_elements)
+    return;
+
+  // All ids past the new capacity are free, so the dropped blocks have nothing to move
+  TreeBitset shrunk = resized(new_exp_max, storage_args...);
+  copy_tree_to(shrunk);
+  shrunk.mask_nonexisting();
+  if constexpr(counts_used)
+    shrunk.recount_used(0, shrunk._num_element_blocks - 1);
+
+  shrunk._max_used_id = used_id;
+  *this               = std::move(shrunk);
+}
+
+template <typename Config, size_t ExpMax>
+inline size_t TreeBitset<Config, ExpMax>::memory_footprint() const
+{
+  return required_blocks(MaxElements{_max_elements}) * sizeof(block_t);
+}
+
+template <typename Config, size_t ExpMax>
+inline bool TreeBitset<Config, ExpMax>::is_free(const size_t id) const
 {
   const size_t block_idx   = id >> bits_per_block_log2;
   const size_t storage_idx = _num_metadata_blocks + block_idx;
   const size_t bit         = id & (bits_per_block - 1);
-  return _storage[storage_idx] & (block_t{1} << bit);
+  return load_block(storage_idx) & (block_t{1} << bit);
+}
+
+template <typename Config, size_t ExpMax>
+inline void TreeBitset<Config, ExpMax>::set_free(const size_t id, const bool value)
+{
+  if constexpr(prefetches_ancestors)
+    prefetch_path(id);
+  set_free_without_prefetch(id, value);
+}
+
+template <typename Config, size_t ExpMax>
+template <typename ForwardIt>
+void TreeBitset<Config, ExpMax>::set_free_for_ids(ForwardIt first, const ForwardIt last, const bool value)
+{
+  if constexpr(prefetches_ancestors)
+  {
+    // Misses of the next prefetch_distance paths overlap with the current update
+    ForwardIt ahead = first;
+    for(size_t idx = 0; idx < prefetch_distance && ahead != last; ++idx, ++ahead)
+      prefetch_path(*ahead);
+    for(; first != last; ++first)
+    {
+      if(ahead != last)
+        prefetch_path(*ahead++);
+      set_free_without_prefetch(*first, value);
+    }
+  }
+  else
+  {
+    for(; first != last; ++first)
+      set_free_without_prefetch(*first, value);
+  }
 }
 
-template <typename Config>
-inline void TreeBitset<Config>::set_free(const size_t id, const bool value)
+template <typename Config, size_t ExpMax>
+inline void TreeBitset<Config, ExpMax>::prefetch_path(const size_t id) const
+{
+  const size_t element_block_idx = id >> bits_per_block_log2;
+  detail::prefetch(blocks() + _num_metadata_blocks + element_block_idx);
+  for_each_metadata_level([&](const size_t lvl_idx) {
+    // Children are addressed by their bit index on the level
+    const size_t child_idx = element_block_idx >> (node_bits_log2 * (_num_metadata_levels - 1 - lvl_idx));
+    const size_t block_idx =
+      metadata_level_offset(static_cast<uint8_t>(lvl_idx)) + (child_idx >> bits_per_block_log2);
+    detail::prefetch(blocks() + block_idx);
+    if constexpr(has_used_ids_tree)
+      detail::prefetch(blocks() + used_ids_tree_offset() + block_idx);
+    if constexpr(counts_used)
+    {
+      const size_t node_idx = metadata_level_offset(static_cast<uint8_t>(lvl_idx)) / node_blocks +
+                              (child_idx >> node_bits_log2);
+      detail::prefetch(blocks() + used_counts_offset() + node_idx * used_count_blocks);
+    }
+    return true;
+  });
+}
+
+template <typename Config, size_t ExpMax>
+inline void TreeBitset<Config, ExpMax>::set_free_without_prefetch(const size_t id, const bool value)
 {
   const size_t block_idx   = id >> bits_per_block_log2;
   const size_t storage_idx = _num_metadata_blocks + block_idx;
   const size_t bit         = id & (bits_per_block - 1);
 
 
+  const block_t all_bits_set = static_cast<block_t>(~block_t{0});
+  const block_t prev_block   = load_block(storage_idx);
+  block_t       block        = prev_block;
+
   bool should_update_metadata = false;
   if(value)
   {
-    should_update_metadata = !_storage[storage_idx];
-    _storage[storage_idx] |= block_t{1} << bit;
-    if(id == _max_used_id)
-      _max_used_id = find_new_smaller_max_used_id();
+    should_update_metadata = !block;
+    block |= block_t{1} << bit;
+    store_block(storage_idx, block);
+    if constexpr(has_used_ids_tree)
+    {
+      if(prev_block != all_bits_set && block == all_bits_set)
+        update_metadata<true>(id, false);
+    }
+    if constexpr(keeps_max_id_current)
+    {
+      if(id == _max_used_id)
+        _max_used_id = find_new_smaller_max_used_id();
+    }
   }
   else
   {
-    _max_used_id = _max_used_id == invalid_id ? id : std::max(_max_used_id, id);
-    _storage[storage_idx] &= ~(block_t{1} << bit);
-    should_update_metadata = !_storage[storage_idx];
+    track_max_used_id(id);
+    block &= ~(block_t{1} << bit);
+    store_block(storage_idx, block);
+    should_update_metadata = !block;
+    if constexpr(has_used_ids_tree)
+    {
+      if(prev_block == all_bits_set)
+        update_metadata<true>(id, true);
+    }
   }
   if(should_update_metadata)
     update_metadata(id, value);
+  if constexpr(counts_used)
+  {
+    if(block != prev_block)
+      update_used_counts(id, value ? -1 : 1);
+  }
+}
+
+template <typename Config, size_t ExpMax>
+void TreeBitset<Config, ExpMax>::set_free_for_range(const size_t min_id,
+                                                    const size_t max_id,
+                                                    const bool   value)
+{
+  assert(min_id <= max_id && max_id < _max_elements);
+
+  const block_t all_bits_set = static_cast<block_t>(~block_t{0});
+
+  auto set_masked_bits = [](block_t & block, const block_t mask, const bool value) {
+    if(value)
+      block |= mask;
+    else
+      block &= ~mask;
+  };
+
+  // Set [first_bit, last_bit] stored bits of a level at lvl_offset to value: edge blocks are masked, interior
+  // ones are filled
+  auto fill_bits = [&](const size_t lvl_offset,
+                       const size_t first_bit,
+                       const size_t last_bit,
+                       const bool   value) {
+    const size_t first_block = first_bit >> bits_per_block_log2;
+    const size_t last_block  = last_bit >> bits_per_block_log2;
+    block_t      first_mask  = static_cast<block_t>(all_bits_set << (first_bit & (bits_per_block - 1)));
+    const block_t last_mask =
+      static_cast<block_t>(all_bits_set >> (bits_per_block - 1 - (last_bit & (bits_per_block - 1))));
+
+    block_t * const lvl = blocks() + lvl_offset;
+    initialize_blocks(lvl_offset + first_block, lvl_offset + first_block, false);
+    if(first_block == last_block)
+      first_mask &= last_mask;
+    else
+    {
+      initialize_blocks(lvl_offset + last_block, lvl_offset + last_block, false);
+      if(last_block - first_block > 1)
+        initialize_blocks(lvl_offset + first_block + 1, lvl_offset + last_block - 1, true);
+      std::fill(lvl + first_block + 1, lvl + last_block, value ? all_bits_set : block_t{0});
+      set_masked_bits(lvl[last_block], last_mask, value);
+    }
+    set_masked_bits(lvl[first_block], first_mask, value);
+  };
+
+  fill_bits(_num_metadata_blocks, min_id, max_id, value != zero_means_free);
+
+  // Traverse the internal tree levels upwards while updating the bits of the affected child blocks range. All
+  // of them have tracked bits when the bits are set, otherwise only the partially covered edge ones might
+  auto update_tree_levels = [&](auto used_ids_tree, const bool bits_value) {
+    constexpr bool UsedIDsTree = decltype(used_ids_tree)::value;
+    const size_t   tree_offset = UsedIDsTree ? used_ids_tree_offset() : 0;
+    const bool     inverted    = !UsedIDsTree && zero_means_free;
+
+    // Children of the metadata nodes are addressed by their bit index on the level
+    size_t first_child_block  = min_id >> bits_per_block_log2;
+    size_t last_child_block   = max_id >> bits_per_block_log2;
+    size_t child_level_offset = _num_metadata_blocks;
+    for(uint8_t lvl_idx = _num_metadata_levels; lvl_idx-- > 0;)
+    {
+      const size_t level_offset = tree_offset + metadata_level_offset(lvl_idx);
+      fill_bits(level_offset, first_child_block, last_child_block, bits_value != inverted);
+      if(!bits_value)
+      {
+        for(const size_t child_block : {first_child_block, last_child_block})
+        {
+          const bool child_has_tracked_bits =
+            child_level_offset == _num_metadata_blocks
+              ? load_block(child_level_offset + child_block) != (UsedIDsTree ? all_bits_set : block_t{0})
+              : !node_is_empty<UsedIDsTree>(child_level_offset + child_block * node_blocks);
+          const size_t storage_idx = level_offset + (child_block >> bits_per_block_log2);
+          if(child_has_tracked_bits)
+            store_block<UsedIDsTree>(storage_idx,
+                                     load_block<UsedIDsTree>(storage_idx) |
+                                       block_t{1} << (child_block & (bits_per_block - 1)));
+        }
+      }
+      first_child_block >>= node_bits_log2;
+      last_child_block >>= node_bits_log2;
+      child_level_offset = level_offset;
+    }
+  };
+  update_tree_levels(std::false_type{}, value);
+  if constexpr(has_used_ids_tree)
+    update_tree_levels(std::true_type{}, !value);
+  // Nodes of the range edges are only partially changed, so all of the affected counts are summed again
+  if constexpr(counts_used)
+    recount_used(min_id >> bits_per_block_log2, max_id >> bits_per_block_log2);
+
+  if(!value)
+    track_max_used_id(max_id);
+  else if constexpr(keeps_max_id_current)
+  {
+    if(_max_used_id != invalid_id && _max_used_id >= min_id && _max_used_id <= max_id)
+    {
+      // Every id starting from min_id is free now, so the new max id search can start right below it
+      _max_used_id = min_id - 1;
+      _max_used_id = min_id ? find_new_smaller_max_used_id() : invalid_id;
+    }
+  }
 }
 
-template <typename Config>
-inline void TreeBitset<Config>::update_metadata(const size_t id, const bool all_bits_value)
+template <typename Config, size_t ExpMax>
+template <bool UsedIDsTree>
+inline void TreeBitset<Config, ExpMax>::update_metadata(const size_t id, const bool all_bits_value)
 {
   if(_num_metadata_levels == 0)
     return;
-  size_t metadata_lvl_bit_offset  = id;
-  size_t metadata_level_start_idx = _num_metadata_blocks;
+  // Index of the child node on the level below, which starts with the element block of id. Levels are
+  // walked by their full sizes, which the last one may not be stored with
+  size_t metadata_lvl_bit_offset  = id >> bits_per_block_log2;
+  size_t metadata_level_start_idx =
+    (UsedIDsTree ? used_ids_tree_offset() : 0) + metadata_level_offset(_num_metadata_levels);
 
   // Traverse the internal tree nodes upwards while updating metadata node values
-  for(uint8_t lvl_idx = 0; lvl_idx < _num_metadata_levels; ++lvl_idx)
-  {
+  auto update_level = [&](const size_t lvl_idx) {
     // Calculate bit and idx on the current level
-    metadata_lvl_bit_offset >>= bits_per_block_log2;
     const size_t bit = metadata_lvl_bit_offset & (bits_per_block - 1);
     // Go to the start of the level
     metadata_level_start_idx -= num_metadata_blocks_on_level(_num_metadata_levels - lvl_idx - 1);
 
-    const size_t metadata_lvl_block_idx = metadata_lvl_bit_offset >> bits_per_block_log2;
-    const size_t storage_idx            = metadata_level_start_idx + metadata_lvl_block_idx;
+    const size_t storage_idx = metadata_level_start_idx + (metadata_lvl_bit_offset >> bits_per_block_log2);
+    const size_t node_storage_idx =
+      metadata_level_start_idx + (metadata_lvl_bit_offset >> node_bits_log2) * node_blocks;
+    metadata_lvl_bit_offset >>= node_bits_log2;
     // Update metadata value for a corresponding node on the current lvl
+    const block_t block = load_block<UsedIDsTree>(storage_idx);
     if(all_bits_value)
     {
-      const bool need_updating_higher_tree_lvl_node = _storage[storage_idx] == block_t{0};
-      _storage[storage_idx] |= block_t{1} << bit;
-      if(!need_updating_higher_tree_lvl_node)
-        break;
+      // The node becomes tracked by its parent only if it didn't track any children before
+      const bool was_empty =
+        block == block_t{0} && (node_blocks == 1 || node_is_empty<UsedIDsTree>(node_storage_idx));
+      store_block<UsedIDsTree>(storage_idx, block | block_t{1} << bit);
+      return was_empty;
     }
-    else
+    const block_t new_block = block & ~(block_t{1} << bit);
+    store_block<UsedIDsTree>(storage_idx, new_block);
+    // We've obtained a bit on a node that still has some free(1) bits => no need to update higher lvls
+    return new_block == block_t{0} && (node_blocks == 1 || node_is_empty<UsedIDsTree>(node_storage_idx));
+  };
+  for_each_metadata_level(update_level);
+}
+
+template <typename Config, size_t ExpMax>
+inline size_t TreeBitset<Config, ExpMax>::find_new_smaller_max_used_id() const
+{
+  if constexpr(has_used_ids_tree)
+    return find_prev_in_tree<true>(_max_used_id != invalid_id ? _max_used_id : _max_elements - 1);
+
+  size_t data_block_idx =
+    _max_used_id != invalid_id ? (_max_used_id >> bits_per_block_log2) : num_element_blocks() - 1;
+  // Traverse data blocks until we find the first block which doesnt contain only free elements
+  while(data_block_idx != 0 && !used_element_bits(data_block_idx))
+    --data_block_idx;
+
+  const block_t block_data = used_element_bits(data_block_idx);
+  return block_data ? data_block_idx * bits_per_block + bits_per_block - 1 - std::countl_zero(block_data)
+                    : invalid_id;
+}
+
+template <typename Config, size_t ExpMax>
+inline typename TreeBitset<Config, ExpMax>::block_t
+TreeBitset<Config, ExpMax>::used_element_bits(const size_t element_block_idx) const
+{
+  const block_t used = static_cast<block_t>(~load_block(_num_metadata_blocks + element_block_idx));
+  return element_block_idx + 1 == _num_element_blocks ? static_cast<block_t>(used & last_element_block_mask())
+                                                      : used;
+}
+
+template <typename Config, size_t ExpMax>
+inline uint64_t TreeBitset<Config, ExpMax>::load_used_count(const size_t node_idx) const
+{
+  const size_t storage_idx = used_counts_offset() + node_idx * used_count_blocks;
+  if constexpr(lazy_init)
+  {
+    // Uninitialized counts are zero
+    if(chunk_init_epochs()[storage_idx >> lazy_init_chunk_blocks_log2] != _init_epoch)
+      return 0;
+  }
+  uint64_t count;
+  std::memcpy(&count, blocks() + storage_idx, sizeof(count));
+  return count;
+}
+
+template <typename Config, size_t ExpMax>
+inline void TreeBitset<Config, ExpMax>::store_used_count(const size_t node_idx, const uint64_t count)
+{
+  const size_t storage_idx = used_counts_offset() + node_idx * used_count_blocks;
+  initialize_blocks(storage_idx, storage_idx + used_count_blocks - 1, true);
+  std::memcpy(blocks() + storage_idx, &count, sizeof(count));
+}
+
+template <typename Config, size_t ExpMax>
+inline void TreeBitset<Config, ExpMax>::update_used_counts(const size_t id, const int64_t delta)
+{
+  if(_num_metadata_levels == 0)
+    return;
+  // Nodes of the level l start at (node_bits^l - 1) / (node_bits - 1), so the ones of the level above start
+  // at (start - 1) / node_bits
+  size_t level_start = metadata_level_offset(static_cast<uint8_t>(_num_metadata_levels - 1)) / node_blocks;
+  size_t node_idx    = id >> (bits_per_block_log2 + node_bits_log2);
+  for(uint8_t lvl_idx = _num_metadata_levels; lvl_idx-- > 0;)
+  {
+    store_used_count(level_start + node_idx, load_used_count(level_start + node_idx) + delta);
+    level_start = (level_start - 1) >> node_bits_log2;
+    node_idx >>= node_bits_log2;
+  }
+}
+
+template <typename Config, size_t ExpMax>
+void TreeBitset<Config, ExpMax>::recount_used(const size_t first_block, const size_t last_block)
+{
+  // Nodes of the last level sum the used bits of their data blocks, the ones above - their children counts.
+  // Children are addressed by their index on the level below
+  size_t first_child  = first_block;
+  size_t last_child   = last_block;
+  size_t num_children = _num_element_blocks;
+  for(uint8_t lvl_idx = _num_metadata_levels; lvl_idx-- > 0;)
+  {
+    const size_t level_node_idx = metadata_level_offset(lvl_idx) / node_blocks;
+    const size_t child_node_idx = metadata_level_offset(static_cast<uint8_t>(lvl_idx + 1)) / node_blocks;
+    const bool   is_last_level  = lvl_idx + 1 == _num_metadata_levels;
+    for(size_t node_idx = first_child >> node_bits_log2; node_idx <= last_child >> node_bits_log2; ++node_idx)
     {
-      _storage[storage_idx] &= ~(block_t{1} << bit);
-      // We've obtained a bit on a block that still has some free(1) bits => no need to update higher lvls
-      if(_storage[storage_idx] != block_t{0})
-        break;
+      const size_t end_child = std::min((node_idx + 1) << node_bits_log2, num_children);
+      uint64_t     count     = 0;
+      for(size_t child_idx = node_idx << node_bits_log2; child_idx < end_child; ++child_idx)
+        count += is_last_level ? std::popcount(used_element_bits(child_idx))
+                               : load_used_count(child_node_idx + child_idx);
+      store_used_count(level_node_idx + node_idx, count);
     }
+    first_child >>= node_bits_log2;
+    last_child >>= node_bits_log2;
+    num_children = ((num_children - 1) >> node_bits_log2) + 1;
   }
 }
 
-template <typename Config>
-inline size_t TreeBitset<Config>::find_new_smaller_max_used_id() const
+template <typename Config, size_t ExpMax>
+size_t TreeBitset<Config, ExpMax>::rank(const size_t id) const
 {
-  const block_t * const first_data_block = &_storage[num_metadata_blocks()];
-  const size_t          initial_block =
-    _max_used_id != invalid_id ? (_max_used_id >> bits_per_block_log2) : num_element_blocks() - 1;
-  const block_t * previous_max_id_block = &_storage[_num_metadata_blocks + initial_block];
-  // Traverse data blocks until we find the first block which doesnt contain only free elements
-  while((previous_max_id_block != first_data_block) && (*previous_max_id_block == static_cast<block_t>(~0)))
-    --previous_max_id_block;
+  static_assert(counts_used, "used ids are only counted with UsedCountPolicy::maintain");
+  if(id >= _max_elements)
+    return used_count();
 
-  const size_t data_block_idx        = previous_max_id_block - first_data_block;
-  const size_t first_id_of_max_block = data_block_idx * bits_per_block;
+  // Children before the ones on the path of id are summed on every level
+  const size_t element_block_idx = id >> bits_per_block_log2;
+  size_t       count             = 0;
+  for(uint8_t lvl_idx = 0; lvl_idx < _num_metadata_levels; ++lvl_idx)
+  {
+    const size_t child_node_idx = metadata_level_offset(static_cast<uint8_t>(lvl_idx + 1)) / node_blocks;
+    const bool   is_last_level  = lvl_idx + 1 == _num_metadata_levels;
+    const size_t path_child_idx =
+      element_block_idx >> (node_bits_log2 * (_num_metadata_levels - 1 - lvl_idx));
+    for(size_t child_idx = path_child_idx & ~(node_bits - 1); child_idx < path_child_idx; ++child_idx)
+      count += is_last_level ? std::popcount(used_element_bits(child_idx))
+                             : load_used_count(child_node_idx + child_idx);
+  }
+  const block_t ids_before = static_cast<block_t>((block_t{1} << (id & (bits_per_block - 1))) - 1);
+  return count + std::popcount(static_cast<block_t>(used_element_bits(element_block_idx) & ids_before));
+}
 
-  block_t block_data = *previous_max_id_block;
+template <typename Config, size_t ExpMax>
+inline size_t TreeBitset<Config, ExpMax>::used_count() const
+{
+  static_assert(counts_used, "used ids are only counted with UsedCountPolicy::maintain");
+  // The only data block has no metadata nodes to keep its count
+  return _num_metadata_levels ? load_used_count(0) : std::popcount(used_element_bits(0));
+}
 
-  // A special case when we don't have any metadata levels and some of the bits are reserved.
-  // TODO: that's really wasteful and reserved bits support should be supplied as a policy
-  auto mask = max_element_mask();
-  if(!_num_metadata_levels && mask)
-    block_data |= ~mask;
+template <typename Config, size_t ExpMax>
+inline size_t TreeBitset<Config, ExpMax>::free_count() const
+{
+  return _max_elements - used_count();
+}
 
-  const size_t max_bit = bits_per_block - std::countl_one(block_data);
-  return max_bit != 0 ? first_id_of_max_block + max_bit - 1 : invalid_id;
+template <typename Config, size_t ExpMax>
+size_t TreeBitset<Config, ExpMax>::count_used(const size_t min_id, const size_t max_id) const
+{
+  static_assert(counts_used, "used ids are only counted with UsedCountPolicy::maintain");
+  assert(min_id <= max_id && max_id < _max_elements);
+  return rank(max_id + 1) - rank(min_id);
 }
 
-template <typename Config>
-size_t TreeBitset<Config>::obtain_id()
+template <typename Config, size_t ExpMax>
+size_t TreeBitset<Config, ExpMax>::select(size_t k) const
+{
+  if(k >= used_count())
+    return invalid_id;
+
+  // Children are skipped while k is not less than their counts. Nonexisting ones aren't reached, as the
+  // counts of the existing ones add up to more than k
+  size_t child_idx = 0;
+  for(uint8_t lvl_idx = 0; lvl_idx < _num_metadata_levels; ++lvl_idx)
+  {
+    const size_t child_node_idx = metadata_level_offset(static_cast<uint8_t>(lvl_idx + 1)) / node_blocks;
+    const bool   is_last_level  = lvl_idx + 1 == _num_metadata_levels;
+    for(child_idx <<= node_bits_log2;; ++child_idx)
+    {
+      const size_t count = is_last_level ? std::popcount(used_element_bits(child_idx))
+                                         : load_used_count(child_node_idx + child_idx);
+      if(k < count)
+        break;
+      k -= count;
+    }
+  }
+  return (child_idx << bits_per_block_log2) + detail::select_set_bit(used_element_bits(child_idx), k);
+}
+
+template <typename Config, size_t ExpMax>
+size_t TreeBitset<Config, ExpMax>::obtain_id()
 {
   // Zero root node indicates that there're no free slots
-  if(_storage[0] == 0)
+  if(root_is_empty())
     return invalid_id;
 
   size_t storage_idx            = 0;
   size_t metadata_lvl_block_idx = 0;
   // Traverse the internal tree nodes until we find a suitable element block
-  for(uint8_t lvl_idx = 0; lvl_idx < _num_metadata_levels; ++lvl_idx)
-  {
-    // Calculate next level offset from the current lvl bit offset and the first non-zero bit
-    metadata_lvl_block_idx = metadata_lvl_block_idx * bits_per_block +
-                             std::countr_zero(_storage[storage_idx + metadata_lvl_block_idx]);
+  for_each_metadata_level([&](const size_t lvl_idx) {
+    // Calculate next level node from the current lvl node and its first non-zero bit
+    const size_t node_storage_idx = storage_idx + metadata_lvl_block_idx * node_blocks;
+    const size_t child_bit        = first_set_bit_in_node(node_storage_idx);
+    metadata_lvl_block_idx        = metadata_lvl_block_idx * node_bits + child_bit;
     // Go down to the next metadata level start
-    storage_idx += num_metadata_blocks_on_level(lvl_idx);
-  }
-  storage_idx      = _num_metadata_blocks + metadata_lvl_block_idx;
-  const size_t bit = std::countr_zero(_storage[storage_idx]);
-  _storage[storage_idx] &= ~(block_t{1} << bit);
+    storage_idx += num_metadata_blocks_on_level(static_cast<uint8_t>(lvl_idx));
+    if constexpr(prefetches_ancestors)
+    {
+      // Once the chosen subtree runs out of free bits, the next obtain_id descends to the next tracked child
+      const size_t next_bit = next_set_bit_in_node(node_storage_idx, child_bit + 1);
+      if(next_bit != node_bits)
+      {
+        const size_t next_child = metadata_lvl_block_idx - child_bit + next_bit;
+        detail::prefetch(blocks() + (lvl_idx + 1 < _num_metadata_levels
+                                       ? storage_idx + next_child * node_blocks
+                                       : _num_metadata_blocks + next_child));
+      }
+    }
+    return true;
+  });
+  storage_idx = _num_metadata_blocks + metadata_lvl_block_idx;
+  // Used ids tree path is going to be updated if the element block has no used bits yet
+  if constexpr(prefetches_ancestors && has_used_ids_tree)
+    prefetch_path(metadata_lvl_block_idx * bits_per_block);
+  const block_t prev_block = load_block(storage_idx);
+  const size_t  bit        = std::countr_zero(prev_block);
+  const block_t block      = prev_block & ~(block_t{1} << bit);
+  store_block(storage_idx, block);
 
   const size_t id = bit + metadata_lvl_block_idx * bits_per_block;
-  _max_used_id    = _max_used_id == invalid_id ? id : std::max(_max_used_id, id);
-  if(!_storage[storage_idx])
+  track_max_used_id(id);
+  if(!block)
     update_metadata(id, false);
+  if constexpr(counts_used)
+    update_used_counts(id, 1);
+  if constexpr(has_used_ids_tree)
+  {
+    if(prev_block == static_cast<block_t>(~block_t{0}))
+      update_metadata<true>(id, true);
+  }
+
+  return id;
+}
+
+template <typename Config, size_t ExpMax>
+template <bool Used>
+size_t TreeBitset<Config, ExpMax>::find_next_in_tree(const size_t id) const
+{
+  if(id >= _max_elements)
+    return invalid_id;
+
+  const block_t all_bits_set = static_cast<block_t>(~block_t{0});
+  const size_t  tree_offset  = Used ? used_ids_tree_offset() : 0;
+  auto          data_bits    = [&](const size_t block_idx) {
+    const block_t block = load_block(_num_metadata_blocks + block_idx);
+    return Used ? static_cast<block_t>(~block) : block;
+  };
+
+  size_t        block_idx = id >> bits_per_block_log2;
+  const block_t candidates =
+    data_bits(block_idx) & static_cast<block_t>(all_bits_set << (id & (bits_per_block - 1)));
+  if(candidates)
+    return block_idx * bits_per_block + std::countr_zero(candidates);
+
+  // Traverse the internal tree nodes upwards until we find a node with tracked children after the current
+  uint8_t lvl_idx   = _num_metadata_levels;
+  size_t  child_bit = node_bits;
+  while(child_bit == node_bits)
+  {
+    if(lvl_idx == 0)
+      return invalid_id;
+    --lvl_idx;
+    const size_t bit = block_idx & (node_bits - 1);
+    block_idx >>= node_bits_log2;
+    child_bit = next_set_bit_in_node<Used>(
+      tree_offset + metadata_level_offset(lvl_idx) + block_idx * node_blocks, bit + 1);
+  }
+
+  // Go down through the first tracked children
+  block_idx = block_idx * node_bits + child_bit;
+  for(++lvl_idx; lvl_idx < _num_metadata_levels; ++lvl_idx)
+  {
+    const size_t level_offset = tree_offset + metadata_level_offset(lvl_idx);
+    block_idx = block_idx * node_bits + first_set_bit_in_node<Used>(level_offset + block_idx * node_blocks);
+  }
+  return block_idx * bits_per_block + std::countr_zero(data_bits(block_idx));
+}
+
+template <typename Config, size_t ExpMax>
+template <bool Used>
+size_t TreeBitset<Config, ExpMax>::find_prev_in_tree(const size_t id) const
+{
+  const block_t all_bits_set = static_cast<block_t>(~block_t{0});
+  const size_t  tree_offset  = Used ? used_ids_tree_offset() : 0;
+  auto          data_bits    = [&](const size_t block_idx) {
+    const block_t block = load_block(_num_metadata_blocks + block_idx);
+    return Used ? static_cast<block_t>(~block) : block;
+  };
+  auto last_bit = [](const block_t block) { return bits_per_block - 1 - std::countl_zero(block); };
+
+  const size_t start_id = std::min(id, _max_elements - 1);
+
+  size_t        block_idx = start_id >> bits_per_block_log2;
+  const block_t candidates =
+    data_bits(block_idx) &
+    static_cast<block_t>(all_bits_set >> (bits_per_block - 1 - (start_id & (bits_per_block - 1))));
+  if(candidates)
+    return block_idx * bits_per_block + last_bit(candidates);
+
+  // Traverse the internal tree nodes upwards until we find a node with tracked children before the current
+  uint8_t lvl_idx   = _num_metadata_levels;
+  size_t  child_bit = node_bits;
+  while(child_bit == node_bits)
+  {
+    if(lvl_idx == 0)
+      return invalid_id;
+    --lvl_idx;
+    const size_t bit = block_idx & (node_bits - 1);
+    block_idx >>= node_bits_log2;
+    child_bit = prev_set_bit_in_node<Used>(
+      tree_offset + metadata_level_offset(lvl_idx) + block_idx * node_blocks, bit);
+  }
+
+  // Go down through the last tracked children
+  block_idx = block_idx * node_bits + child_bit;
+  for(++lvl_idx; lvl_idx < _num_metadata_levels; ++lvl_idx)
+  {
+    const size_t level_offset = tree_offset + metadata_level_offset(lvl_idx);
+    block_idx =
+      block_idx * node_bits + prev_set_bit_in_node<Used>(level_offset + block_idx * node_blocks, node_bits);
+  }
+  return block_idx * bits_per_block + last_bit(data_bits(block_idx));
+}
+
+template <typename Config, size_t ExpMax>
+size_t TreeBitset<Config, ExpMax>::find_next_free(const size_t id) const
+{
+  return find_next_in_tree<false>(id);
+}
+
+template <typename Config, size_t ExpMax>
+size_t TreeBitset<Config, ExpMax>::find_prev_free(const size_t id) const
+{
+  return find_prev_in_tree<false>(id);
+}
+
+template <typename Config, size_t ExpMax>
+size_t TreeBitset<Config, ExpMax>::find_next_used(const size_t id) const
+{
+  // There're no used ids after the max one, so we don't need to look further if it's known
+  const size_t last_id = keeps_max_id_current ? _max_used_id : _max_elements - 1;
+  if(last_id == invalid_id || id > last_id)
+    return invalid_id;
+
+  if constexpr(has_used_ids_tree)
+  {
+    const size_t next_used_id = find_next_in_tree<true>(id);
+    return next_used_id <= last_id ? next_used_id : invalid_id;
+  }
+
+  const block_t all_bits_set = static_cast<block_t>(~block_t{0});
+  const size_t  last_block   = last_id >> bits_per_block_log2;
+
+  size_t  block_idx  = id >> bits_per_block_log2;
+  block_t candidates = static_cast<block_t>(~load_block(_num_metadata_blocks + block_idx)) &
+                       static_cast<block_t>(all_bits_set << (id & (bits_per_block - 1)));
+  // Skip the blocks which contain only free elements
+  while(!candidates)
+  {
+    if(++block_idx > last_block)
+      return invalid_id;
+    candidates = static_cast<block_t>(~load_block(_num_metadata_blocks + block_idx));
+  }
+  const size_t next_used_id = block_idx * bits_per_block + std::countr_zero(candidates);
+  return next_used_id <= last_id ? next_used_id : invalid_id;
+}
+
+template <typename Config, size_t ExpMax>
+size_t TreeBitset<Config, ExpMax>::find_prev_used(const size_t id) const
+{
+  const size_t last_id = keeps_max_id_current ? _max_used_id : _max_elements - 1;
+  if(last_id == invalid_id)
+    return invalid_id;
+
+  const size_t start_id = std::min(id, last_id);
+  if constexpr(has_used_ids_tree)
+    return find_prev_in_tree<true>(start_id);
+
+  const block_t all_bits_set = static_cast<block_t>(~block_t{0});
+  const size_t  bit          = start_id & (bits_per_block - 1);
 
+  size_t  block_idx  = start_id >> bits_per_block_log2;
+  block_t candidates = static_cast<block_t>(~load_block(_num_metadata_blocks + block_idx)) &
+                       static_cast<block_t>(all_bits_set >> (bits_per_block - 1 - bit));
+  // Skip the blocks which contain only free elements
+  while(!candidates)
+  {
+    if(block_idx == 0)
+      return invalid_id;
+    candidates = static_cast<block_t>(~load_block(_num_metadata_blocks + --block_idx));
+  }
+  return block_idx * bits_per_block + bits_per_block - 1 - std::countl_zero(candidates);
+}
+
+template <typename Config, size_t ExpMax>
+size_t TreeBitset<Config, ExpMax>::obtain_id_near(const size_t hint)
+{
+  size_t id = find_next_free(hint);
+  if(id == invalid_id)
+    id = find_prev_free(hint);
+  if(id != invalid_id)
+    set_free(id, false);
   return id;
 }
 
-template <typename Config>
+template <typename Config, size_t ExpMax>
+template <typename OutputIt>
+size_t TreeBitset<Config, ExpMax>::obtain_ids(const size_t n, OutputIt out)
+{
+  size_t n_obtained = 0;
+  size_t last_id    = invalid_id;
+
+  // Write out free bits of an element block using a single store and return the block's new value
+  auto drain_element_block = [&](const size_t element_block_idx) {
+    const size_t  storage_idx = _num_metadata_blocks + element_block_idx;
+    const size_t  first_id    = element_block_idx * bits_per_block;
+    const block_t prev_block  = load_block(storage_idx);
+    block_t       block       = prev_block;
+    for(; block && n_obtained < n; ++n_obtained)
+    {
+      last_id = first_id + std::countr_zero(block);
+      *out++  = last_id;
+      block &= block - 1;
+    }
+    store_block(storage_idx, block);
+    if constexpr(has_used_ids_tree)
+    {
+      if(prev_block == static_cast<block_t>(~block_t{0}) && block != prev_block)
+        update_metadata<true>(first_id, true);
+    }
+    if constexpr(counts_used)
+      update_used_counts(first_id, std::popcount(prev_block) - std::popcount(block));
+    return block;
+  };
+
+  if(_num_metadata_levels == 0)
+    drain_element_block(0);
+
+  // Each iteration descends once and drains the element blocks of the found last level metadata node
+  while(_num_metadata_levels && n_obtained < n && !root_is_empty())
+  {
+    size_t storage_idx            = 0;
+    size_t metadata_lvl_block_idx = 0;
+    for(uint8_t lvl_idx = 0; lvl_idx < _num_metadata_levels - 1; ++lvl_idx)
+    {
+      metadata_lvl_block_idx = metadata_lvl_block_idx * node_bits +
+                               first_set_bit_in_node(storage_idx + metadata_lvl_block_idx * node_blocks);
+      storage_idx += num_metadata_blocks_on_level(lvl_idx);
+    }
+    storage_idx += metadata_lvl_block_idx * node_blocks;
+
+    bool element_block_left = false;
+    for(size_t node_block_idx = 0; node_block_idx < node_blocks && !element_block_left && n_obtained < n;
+        ++node_block_idx)
+    {
+      const size_t first_child    = metadata_lvl_block_idx * node_bits + node_block_idx * bits_per_block;
+      block_t      metadata_block = load_block(storage_idx + node_block_idx);
+      while(metadata_block && n_obtained < n)
+      {
+        // The element block still has free bits => we've obtained enough ids
+        element_block_left = drain_element_block(first_child + std::countr_zero(metadata_block)) != 0;
+        if(element_block_left)
+          break;
+        metadata_block &= metadata_block - 1;
+      }
+      store_block(storage_idx + node_block_idx, metadata_block);
+    }
+
+    // The node has no free bits anymore, so propagate it to the higher levels once
+    if(node_is_empty(storage_idx))
+      update_metadata(last_id, false);
+  }
+
+  if(last_id != invalid_id)
+    track_max_used_id(last_id);
+
+  return n_obtained;
+}
+
+template <typename Config, size_t ExpMax>
 template <typename AddAbbreviationCallback, typename AddPackedBlockCallback>
-inline void TreeBitset<Config>::pack(AddAbbreviationCallback abbrev_cb, AddPackedBlockCallback block_cb) const
+inline void TreeBitset<Config, ExpMax>::pack(AddAbbreviationCallback abbrev_cb,
+                                             AddPackedBlockCallback  block_cb) const
+{
+  if constexpr(lazy_init)
+  {
+    struct RawBlocks
+    {
+      const TreeBitset * tb;
+      block_t            operator[](const size_t idx) const { return tb->raw_block(idx); }
+    };
+    detail::rle_pack(RawBlocks{this}, num_storage_blocks(), abbrev_cb, block_cb);
+  }
+  else
+    detail::rle_pack(blocks(), num_storage_blocks(), abbrev_cb, block_cb);
+}
+
+template <typename Config, size_t ExpMax>
+template <typename... StorageArgs>
+inline TreeBitset<Config, ExpMax> TreeBitset<Config, ExpMax>::unpack(const size_t               exp_max,
+                                                     const block_t *            packed_blocks,
+                                                     const RLEBitAbbreviation * abbreviations,
+                                                     size_t                     abbreviations_count,
+                                                     StorageArgs... storage_args)
 {
-  detail::rle_pack(_storage.get(), _num_element_blocks + _num_metadata_blocks, abbrev_cb, block_cb);
+  return unpack(MaxElements{detail::pow2_capacity(exp_max)},
+                packed_blocks,
+                abbreviations,
+                abbreviations_count,
+                storage_args...);
 }
 
-template <typename Config>
-inline TreeBitset<Config> TreeBitset<Config>::unpack(const size_t               exp_max,
+template <typename Config, size_t ExpMax>
+template <typename... StorageArgs>
+inline TreeBitset<Config, ExpMax> TreeBitset<Config, ExpMax>::unpack(const MaxElements          max_elements,
                                                      const block_t *            packed_blocks,
                                                      const RLEBitAbbreviation * abbreviations,
-                                                     size_t                     abbreviations_count)
+                                                     size_t                     abbreviations_count,
+                                                     StorageArgs... storage_args)
 {
-  TreeBitset result(exp_max);
-  detail::rle_unpack(result._storage.get(),
-                     result._num_element_blocks + result._num_metadata_blocks,
+  TreeBitset result(max_elements, storage_args...);
+  // All of the storage is going to be unpacked
+  result.initialize_blocks(0, result.num_storage_blocks() - 1, true);
+  detail::rle_unpack(result.blocks(),
+                     result.num_storage_blocks(),
                      packed_blocks,
                      abbreviations,
                      abbreviations_count);
-  if constexpr(Config::template get<MaxIDPolicy>() == MaxIDPolicy::keep_max_id_current)
+  if constexpr(keeps_max_id_current)
   {
     result._max_used_id = result.find_new_smaller_max_used_id();
   }
   return result;
 }
 
-template <typename Config>
-inline bool operator==(const TreeBitset<Config> & lhs, const TreeBitset<Config> & rhs)
+template <typename Config, size_t ExpMax>
+inline bool operator==(const TreeBitset<Config, ExpMax> & lhs, const TreeBitset<Config, ExpMax> & rhs)
 {
   if(lhs._max_elements != rhs._max_elements)
     return false;
 
-  if constexpr(Config::template get<MaxIDPolicy>() == MaxIDPolicy::keep_max_id_current)
+  if constexpr(TreeBitset<Config, ExpMax>::keeps_max_id_current)
   {
     if(lhs._max_used_id != rhs._max_used_id)
       return false;
   }
-  const size_t storage_bytes =
-    (lhs._num_element_blocks + lhs._num_metadata_blocks) * sizeof(typename Config::block_t);
-  return !memcmp(lhs._storage.get(), rhs._storage.get(), storage_bytes);
+  if constexpr(TreeBitset<Config, ExpMax>::lazy_init)
+  {
+    for(size_t idx = 0; idx < lhs.num_storage_blocks(); ++idx)
+      if(lhs.raw_block(idx) != rhs.raw_block(idx))
+        return false;
+    return true;
+  }
+  const size_t storage_bytes = lhs.num_storage_blocks() * sizeof(typename Config::block_t);
+  return !memcmp(lhs.blocks(), rhs.blocks(), storage_bytes);
 }
 
-template <typename Config>
-inline bool operator!=(const TreeBitset<Config> & lhs, const TreeBitset<Config> & rhs)
+template <typename Config, size_t ExpMax>
+inline bool operator!=(const TreeBitset<Config, ExpMax> & lhs, const TreeBitset<Config, ExpMax> & rhs)
 {
   return !(lhs == rhs);
 }
 
-template <typename Config>
-class TreeBitset<Config>::IDIterator
+template <typename Config, size_t ExpMax>
+class TreeBitset<Config, ExpMax>::IDIterator
 {
-  block_t   _block_mask = static_cast<block_t>(~block_t{0});
-  block_t * _ptr        = nullptr;
-  block_t * _start_ptr  = nullptr;
-  block_t * _end_ptr    = nullptr;
+  block_t                    _block_mask = static_cast<block_t>(~block_t{0});
+  // Used bits of the last block up to the max used id, the ones past it are nonexisting ids
+  block_t                    _last_block_mask = block_t{0};
+  const block_t *            _ptr        = nullptr;
+  const block_t *            _start_ptr  = nullptr;
+  const block_t *            _end_ptr    = nullptr;
+  const TreeBitset<Config, ExpMax> * _container  = nullptr;
+
+  inline block_t block() const
+  {
+    if constexpr(lazy_init)
+      return _container->raw_block(_ptr - _container->blocks()) ^ inverted_bits_mask;
+    else
+      return *_ptr ^ inverted_bits_mask;
+  }
+
+  inline block_t used_bits() const
+  {
+    const block_t used = static_cast<block_t>(~block());
+    return _ptr + 1 == _end_ptr ? static_cast<block_t>(used & _last_block_mask) : used;
+  }
 
   inline void advanced_to_next_block()
   {
+    if constexpr(has_used_ids_tree)
+    {
+      // Descend the used ids tree to get the next block with used IDs
+      if(_ptr != _end_ptr && !used_bits())
+      {
+        const size_t next_used_id = _container->find_next_used(bits_per_block * (_ptr - _start_ptr));
+        _ptr = next_used_id != invalid_id ? _start_ptr + (next_used_id >> bits_per_block_log2) : _end_ptr;
+      }
+      return;
+    }
     // Advance the _ptr to obtain the first used ID
-    while(_ptr != _end_ptr && (*_ptr == static_cast<block_t>(~block_t{0})))
+    while(_ptr != _end_ptr && !used_bits())
       ++_ptr;
   }
 
   inline void advance()
   {
-    const block_t reversed_block = ~(*_ptr);
+    const block_t reversed_block = used_bits();
     const int     bit_idx        = std::countr_zero(static_cast<block_t>(reversed_block & _block_mask));
     _block_mask                  = _block_mask & ~(block_t{1} << bit_idx);
     if(static_cast<block_t>(reversed_block & _block_mask) == block_t{0})
@@ -290,8 +1584,8 @@ class TreeBitset<Config>::IDIterator
 
   inline size_t current_id() const
   {
-    const size_t  block_offset     = TreeBitset<Config>::bits_per_block * (_ptr - _start_ptr);
-    const block_t reversed_block   = ~(*_ptr);
+    const size_t  block_offset     = TreeBitset<Config, ExpMax>::bits_per_block * (_ptr - _start_ptr);
+    const block_t reversed_block   = used_bits();
     const size_t  block_bit_offset = std::countr_zero(static_cast<block_t>(reversed_block & _block_mask));
     return block_offset + block_bit_offset;
   }
@@ -303,12 +1597,16 @@ public:
   using pointer           = size_t *;
   using reference         = size_t;
 
-  IDIterator(const TreeBitset<Config> & container)
-    : _ptr{&container._storage[container.num_metadata_blocks()]}, _start_ptr{_ptr}
+  IDIterator(const TreeBitset<Config, ExpMax> & container)
+    : _ptr{container.blocks() + container.num_metadata_blocks()}, _start_ptr{_ptr}, _container{&container}
   {
     const size_t max_used_id = container.max_used_id();
     if(max_used_id != invalid_id)
-      _end_ptr = &container._storage[container.num_metadata_blocks() + (max_used_id >> bits_per_block_log2)];
+    {
+      _end_ptr         = _start_ptr + (max_used_id >> bits_per_block_log2);
+      _last_block_mask = static_cast<block_t>(static_cast<block_t>(~block_t{0}) >>
+                                              (bits_per_block - 1 - (max_used_id & (bits_per_block - 1))));
+    }
     else
       _end_ptr = _start_ptr;
     ++_end_ptr;
@@ -340,8 +1638,8 @@ public:
   }
 };
 
-template <typename Config>
-inline typename TreeBitset<Config>::IDIterator TreeBitset<Config>::used_ids_iter() const
+template <typename Config, size_t ExpMax>
+inline typename TreeBitset<Config, ExpMax>::IDIterator TreeBitset<Config, ExpMax>::used_ids_iter() const
 {
   return *this;
 }
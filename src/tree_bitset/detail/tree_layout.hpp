@@ -0,0 +1,168 @@
+#pragma once
+
+// Sizes of the tree levels. Capacity is either a runtime value or a compile-time constant, in which case all
+// of them are constexpr as well.
+
+#include <cassert>
+#include <cstddef>
+#include <cinttypes>
+#include <algorithm>
+#include <utility>
+#include <limits>
+#include <type_traits>
+
+#include "math_utils.hpp"
+#include "../config.hpp"
+
+namespace treebitset { namespace detail {
+
+// ExpMax of a TreeBitset which capacity is set at runtime
+constexpr inline size_t dynamic_exp_max = ~size_t{0};
+
+constexpr inline size_t cache_line_bytes = 64;
+
+template <typename block_t>
+constexpr size_t metadata_node_blocks(const MetadataNodePolicy policy)
+{
+  return policy == MetadataNodePolicy::cache_line ? cache_line_bytes / sizeof(block_t) : 1;
+}
+
+// Metadata nodes consist of NodeBlocks blocks, so each of them tracks BitsPerBlock * NodeBlocks children.
+// Level l of the metadata tree has that many times more nodes than the previous one and the data level of
+// single block nodes comes after the last metadata level. The last metadata level only stores the nodes
+// which the data blocks need, while the nodes of the previous ones past the needed ones stay unreachable
+template <size_t BitsPerBlock, size_t NodeBlocks>
+struct TreeLevels
+{
+  size_t  max_elements        = 0;
+  size_t  num_element_blocks  = 0;
+  size_t  num_metadata_blocks = 0;
+  uint8_t num_metadata_levels = 0;
+
+  constexpr TreeLevels(const size_t capacity)
+    : max_elements{capacity}
+  {
+    assert(capacity > 0);
+    constexpr size_t bits_per_block_log2 = math::int_log2(BitsPerBlock);
+    constexpr size_t node_bits_log2      = math::int_log2(BitsPerBlock * NodeBlocks);
+
+    // The last data block may have fewer ids than bits
+    num_element_blocks = (max_elements >> bits_per_block_log2) + ((max_elements & (BitsPerBlock - 1)) != 0);
+    // Only the last node of every level may track fewer children than a node has
+    num_metadata_levels =
+      static_cast<uint8_t>(math::int_log_ceil(size_t{1} << node_bits_log2, num_element_blocks));
+
+    for(uint8_t metadata_lvl_idx = 0; metadata_lvl_idx + 1 < num_metadata_levels; ++metadata_lvl_idx)
+      num_metadata_blocks += NodeBlocks << (node_bits_log2 * metadata_lvl_idx);
+    if(num_metadata_levels)
+    {
+      const size_t num_last_level_nodes = ((num_element_blocks - 1) >> node_bits_log2) + 1;
+      num_metadata_blocks += num_last_level_nodes * NodeBlocks;
+    }
+  }
+};
+
+// Capacity of 2^exp_max elements
+constexpr size_t pow2_capacity(const size_t exp_max)
+{
+  assert(exp_max < std::numeric_limits<size_t>::digits);
+  return size_t{1} << exp_max;
+}
+
+template <size_t BitsPerBlock, size_t NodeBlocks>
+constexpr TreeLevels<BitsPerBlock, NodeBlocks> pow2_tree_levels(const size_t exp_max)
+{
+  return TreeLevels<BitsPerBlock, NodeBlocks>{pow2_capacity(exp_max)};
+}
+
+template <size_t BitsPerBlock, size_t NodeBlocks, size_t ExpMax>
+struct TreeBitsetLayout
+{
+  constexpr static inline TreeLevels<BitsPerBlock, NodeBlocks> levels =
+    pow2_tree_levels<BitsPerBlock, NodeBlocks>(ExpMax);
+
+  constexpr static inline size_t  _num_metadata_blocks = levels.num_metadata_blocks;
+  constexpr static inline size_t  _num_element_blocks  = levels.num_element_blocks;
+  constexpr static inline uint8_t _num_metadata_levels = levels.num_metadata_levels;
+  constexpr static inline size_t  _max_elements        = levels.max_elements;
+
+  constexpr static void calculate_constants([[maybe_unused]] const size_t max_elements)
+  {
+    assert(max_elements == levels.max_elements);
+  }
+};
+
+template <size_t BitsPerBlock, size_t NodeBlocks>
+struct TreeBitsetLayout<BitsPerBlock, NodeBlocks, dynamic_exp_max>
+{
+  // These fields are constant throughout object lifetime
+  size_t  _num_metadata_blocks;
+  size_t  _num_element_blocks;
+  uint8_t _num_metadata_levels;
+  size_t  _max_elements;
+
+  void calculate_constants(const size_t max_elements)
+  {
+    const TreeLevels<BitsPerBlock, NodeBlocks> levels{max_elements};
+    _num_metadata_blocks = levels.num_metadata_blocks;
+    _num_element_blocks  = levels.num_element_blocks;
+    _num_metadata_levels = levels.num_metadata_levels;
+    _max_elements        = levels.max_elements;
+  }
+};
+
+constexpr size_t num_lazy_init_chunks(const size_t num_storage_blocks, const size_t chunk_blocks_log2)
+{
+  const size_t chunk_size = size_t{1} << chunk_blocks_log2;
+  return (num_storage_blocks + chunk_size - 1) >> chunk_blocks_log2;
+}
+
+// Used ids tree has the metadata tree layout and starts at the first node boundary after the data blocks
+constexpr size_t used_ids_tree_offset(const size_t num_metadata_blocks,
+                                      const size_t num_element_blocks,
+                                      const size_t node_blocks)
+{
+  return (num_metadata_blocks + num_element_blocks + node_blocks - 1) / node_blocks * node_blocks;
+}
+
+// Used counts of the metadata nodes are 64-bit and follow the trees, each of them starts at a multiple of its
+// size, so it never crosses a lazy initialization chunk
+constexpr size_t used_counts_offset(const size_t num_tree_blocks, const size_t count_blocks)
+{
+  return (num_tree_blocks + count_blocks - 1) / count_blocks * count_blocks;
+}
+
+// Storage consists of the metadata tree, data blocks, an optional used ids tree, optional used counts of the
+// metadata nodes and lazy initialization epochs for chunks of 2^lazy_init_chunk_blocks_log2 blocks if
+// they're needed
+template <size_t BitsPerBlock, size_t NodeBlocks>
+constexpr size_t required_blocks(const size_t max_elements,
+                                 const bool   used_ids_tree,
+                                 const bool   used_counts,
+                                 const bool   lazy_init,
+                                 const size_t lazy_init_chunk_blocks_log2)
+{
+  const TreeLevels<BitsPerBlock, NodeBlocks> levels{max_elements};
+
+  const size_t used_tree_offset =
+    used_ids_tree_offset(levels.num_metadata_blocks, levels.num_element_blocks, NodeBlocks);
+  const size_t num_tree_blocks = used_ids_tree ? used_tree_offset + levels.num_metadata_blocks
+                                               : levels.num_metadata_blocks + levels.num_element_blocks;
+  // Everything starting with the used ids tree offset is initially zero, so the counts can't start before it
+  constexpr size_t count_blocks = 64 / BitsPerBlock;
+  const size_t     num_storage_blocks =
+    used_counts ? used_counts_offset(std::max(num_tree_blocks, used_tree_offset), count_blocks) +
+                    levels.num_metadata_blocks / NodeBlocks * count_blocks
+                : num_tree_blocks;
+  return num_storage_blocks +
+         (lazy_init ? num_lazy_init_chunks(num_storage_blocks, lazy_init_chunk_blocks_log2) : 0);
+}
+
+// Call f(std::integral_constant<size_t, I>{}) for I in [0, N) while it returns true
+template <typename F, size_t... I>
+constexpr void unrolled_for(F && f, std::index_sequence<I...>)
+{
+  static_cast<void>((f(std::integral_constant<size_t, I>{}) && ...));
+}
+
+}}
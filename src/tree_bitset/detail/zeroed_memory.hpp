@@ -0,0 +1,118 @@
+#pragma once
+
+// Zero-initialized memory which is mapped directly from the OS when it's big enough, so its pages aren't
+// touched until they're accessed and can be given back to the OS to become zeroed again.
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace treebitset { namespace detail {
+
+// Smaller allocations aren't worth a separate mapping
+constexpr inline size_t min_zeroed_pages_allocation = size_t{1} << 16;
+
+// Mappings are page-aligned, smaller allocations are aligned to alignment, which calloc doesn't guarantee
+inline void * allocate_zeroed(const size_t bytes, const size_t alignment = alignof(std::max_align_t))
+{
+  void * ptr = nullptr;
+  if(bytes < min_zeroed_pages_allocation)
+  {
+    const size_t ptr_alignment =
+      alignment > alignof(std::max_align_t) ? alignment : alignof(std::max_align_t);
+    // aligned_alloc requires the size to be a multiple of the alignment
+    const size_t aligned_bytes = (bytes + ptr_alignment - 1) / ptr_alignment * ptr_alignment;
+#if defined(_WIN32)
+    ptr = _aligned_malloc(aligned_bytes, ptr_alignment);
+#else
+    ptr = aligned_alloc(ptr_alignment, aligned_bytes);
+#endif
+    if(ptr)
+      memset(ptr, 0, bytes);
+  }
+  else
+  {
+#if defined(_WIN32)
+    ptr = VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ptr == MAP_FAILED)
+      ptr = nullptr;
+#endif
+  }
+  if(!ptr)
+    throw std::bad_alloc{};
+  return ptr;
+}
+
+inline void deallocate_zeroed(void * ptr, const size_t bytes)
+{
+  if(bytes < min_zeroed_pages_allocation)
+  {
+#if defined(_WIN32)
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+    return;
+  }
+#if defined(_WIN32)
+  VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+  munmap(ptr, bytes);
+#endif
+}
+
+inline size_t os_page_bytes()
+{
+#if defined(_WIN32)
+  static const size_t page_bytes = [] {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return size_t{info.dwPageSize};
+  }();
+#else
+  static const size_t page_bytes = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+  return page_bytes;
+}
+
+// Give the pages of a mapping from allocate_zeroed back to the OS, they read as zero the next time they're
+// accessed. ptr has to be page-aligned and bytes are rounded up to whole pages. Returns false when the pages
+// couldn't be discarded and still hold their old contents
+inline bool discard_zeroed_pages(void * ptr, const size_t bytes)
+{
+#if defined(_WIN32)
+  // Decommitted pages are zeroed once they're committed again
+  if(!VirtualFree(ptr, bytes, MEM_DECOMMIT))
+    return false;
+  if(!VirtualAlloc(ptr, bytes, MEM_COMMIT, PAGE_READWRITE))
+    throw std::bad_alloc{};
+  return true;
+#else
+  // Private anonymous pages are zero-filled on the next access
+  return !madvise(ptr, bytes, MADV_DONTNEED);
+#endif
+}
+
+// Zero the memory by giving its pages back to the OS, so it costs O(1) in touched memory. It's overwritten
+// instead when the OS refuses to discard them, stale bits would make the bitset hand out used ids
+inline void reset_zeroed(void * ptr, const size_t bytes)
+{
+  if(bytes < min_zeroed_pages_allocation || !discard_zeroed_pages(ptr, bytes))
+    memset(ptr, 0, bytes);
+}
+
+}}
@@ -0,0 +1,74 @@
+#pragma once
+#include <limits>
+#include <cinttypes>
+#include <memory>
+#include <type_traits>
+
+#include "tree_bitset.hpp"
+
+namespace treebitset {
+// Packed entity handle: index in the low 32 bits and generation in the high ones
+struct EntityHandle
+{
+  uint64_t packed = 0;
+
+  constexpr EntityHandle() = default;
+  constexpr EntityHandle(const uint32_t index, const uint32_t generation)
+    : packed{uint64_t{generation} << 32 | index}
+  {
+  }
+
+  constexpr uint32_t index() const { return static_cast<uint32_t>(packed); }
+  constexpr uint32_t generation() const { return static_cast<uint32_t>(packed >> 32); }
+
+  friend constexpr bool operator==(const EntityHandle lhs, const EntityHandle rhs)
+  {
+    return lhs.packed == rhs.packed;
+  }
+  friend constexpr bool operator!=(const EntityHandle lhs, const EntityHandle rhs)
+  {
+    return lhs.packed != rhs.packed;
+  }
+};
+
+// Entity ids dispenser whose handles carry the generation of their index, so the handles of the destroyed
+// entities don't alias the ones created later with the same index.
+//
+// Generations are kept in an array parallel to the data blocks and are bumped on both create and destroy:
+// odd ones belong to the alive entities and even ones to the free indices, so is_alive() only needs the
+// generation of the index, which is a single cache line access. generation_t sets the generation memory per
+// id. Handles alias once a generation wraps around, after 2^(digits - 1) reuses of an index
+template <typename Config = DefaultTreeBitsetConfig, typename generation_t = uint32_t>
+class EntityAllocator
+{
+  static_assert(std::is_unsigned_v<generation_t> && sizeof(generation_t) <= sizeof(uint32_t),
+                "generation must be an unsigned integer of up to 32 bits");
+
+public:
+  // Never alive, as its generation is even
+  constexpr static inline EntityHandle invalid_handle{};
+
+  // Entity allocator will have a capacity for 2^exp_max entities, exp_max has to be <= 32
+  EntityAllocator(const size_t exp_max);
+
+  // Create an entity with the first free index. Returns invalid_handle when all of them are alive
+  inline EntityHandle create();
+  // Destroy an alive entity. Returns false if the handle isn't alive
+  inline bool         destroy(const EntityHandle handle);
+  inline bool         is_alive(const EntityHandle handle) const;
+
+  // Call f(handle) for all alive entities in ascending index order
+  template <typename F>
+  void for_each_alive(F && f) const;
+
+  inline size_t max_entities() const;
+
+private:
+  TreeBitset<Config>              _ids;
+  std::unique_ptr<generation_t[]> _generations;
+
+  // Checked before any member is allocated, as out of range exp_max would size them by 2^exp_max
+  static inline size_t checked_exp_max(const size_t exp_max);
+};
+}
+#include "detail/entity_allocator.hpp"
@@ -0,0 +1,57 @@
+#pragma once
+#include <cinttypes>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <vector>
+
+#include "tree_bitset.hpp"
+
+namespace treebitset {
+// Caching layer in front of a shared TreeBitset: each thread keeps a magazine of up to 2 * magazine_size
+// obtained ids, which is refilled or drained by magazine_size ids at once under a lock, so most
+// obtain_id/release calls only touch the thread's own memory. Magazines are drained when their threads exit.
+//
+// Ids in the magazines are used from the point of view of the shared bitset, so max_used_id() and
+// for_each_used_id() are only exact after flush_all()
+template <typename Config = DefaultTreeBitsetConfig>
+class MagazineTreeBitset
+{
+public:
+  constexpr static inline size_t invalid_id = TreeBitset<Config>::invalid_id;
+
+  // Magazine tree bitset will have a capacity for 2^exp_max elements
+  MagazineTreeBitset(const size_t exp_max, const size_t magazine_size = 64);
+
+  // Take an id from the thread's magazine, which is refilled from the shared bitset when it's empty
+  inline size_t obtain_id();
+  // Put an obtained id back to the thread's magazine, which is drained to the shared bitset when it's full
+  inline void   release(const size_t id);
+
+  // Return the ids of the calling thread's magazine to the shared bitset
+  void flush();
+  // Return the ids of all magazines to the shared bitset. Ids which the other threads are obtaining or
+  // releasing concurrently might still be in transit
+  void flush_all();
+
+  size_t max_used_id() const;
+  // Call f(id) for the used ids of the shared bitset in ascending order
+  template <typename F>
+  void   for_each_used_id(F && f) const;
+
+  inline size_t magazine_size() const;
+  inline size_t max_elements() const;
+
+private:
+  struct Magazine;
+  struct Shared;
+  struct ThreadMagazines;
+
+  std::shared_ptr<Shared> _shared;
+
+  inline Magazine & thread_magazine();
+  size_t            refill(Magazine & magazine);
+  void              drain(Magazine & magazine);
+};
+}
+#include "detail/magazine_tree_bitset.hpp"
@@ -0,0 +1,179 @@
+#pragma once
+
+// Memory resource which maps storage straight from the OS, backed by huge pages where it's possible and
+// optionally placed on the given NUMA nodes. Use it with StoragePolicy::memory_resource.
+
+#include <cstddef>
+#include <cinttypes>
+#include <cassert>
+#include <new>
+#include <memory_resource>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <intrin.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+#endif
+
+namespace treebitset {
+
+enum class NumaPlacement {
+  // pages are placed wherever the OS decides, usually on the node of the thread which touches them first
+  any,
+  // pages are allocated from the nodes of the mask only
+  bind,
+  // pages are spread round-robin over the nodes of the mask
+  interleave
+};
+
+class MappedMemoryResource : public std::pmr::memory_resource
+{
+public:
+  constexpr static inline size_t huge_page_size = size_t{1} << 21;
+
+  struct Options
+  {
+    // Try explicit huge pages first, then transparent ones. Otherwise mappings are kept on base pages
+    bool          huge_pages = true;
+    NumaPlacement numa       = NumaPlacement::any;
+    // Bit n selects NUMA node n
+    uint64_t      numa_nodes = 1;
+  };
+
+  // Pages which have backed the last allocation
+  enum class Pages {
+    base,
+    // MAP_HUGETLB or MEM_LARGE_PAGES pages reserved by the administrator
+    huge,
+    // the kernel was asked to back the mapping with transparent huge pages, it may still use base pages
+    transparent_huge
+  };
+
+  MappedMemoryResource() = default;
+  explicit MappedMemoryResource(const Options & options) : _options{options} {}
+
+  Pages last_pages() const { return _last_pages; }
+
+private:
+  Options _options;
+  Pages   _last_pages = Pages::base;
+
+  size_t mapped_bytes(const size_t bytes) const
+  {
+    const size_t granularity = _options.huge_pages ? huge_page_size : size_t{4096};
+    return (bytes + granularity - 1) / granularity * granularity;
+  }
+
+  void * do_allocate(const size_t bytes, [[maybe_unused]] const size_t alignment) override
+  {
+    assert(alignment <= 4096);
+    const size_t size = mapped_bytes(bytes);
+    void *       ptr  = nullptr;
+#if defined(_WIN32)
+    unsigned long numa_node = 0;
+    _BitScanForward64(&numa_node, _options.numa_nodes);
+    auto allocate = [&](const DWORD flags) {
+      // Interleaving isn't supported, such mappings are bound to the first node of the mask
+      return _options.numa == NumaPlacement::any
+               ? VirtualAlloc(nullptr, size, flags, PAGE_READWRITE)
+               : VirtualAllocExNuma(GetCurrentProcess(), nullptr, size, flags, PAGE_READWRITE, numa_node);
+    };
+    // Large pages need the lock pages privilege, so they're often unavailable
+    const size_t large_page_size = GetLargePageMinimum();
+    if(_options.huge_pages && large_page_size && size % large_page_size == 0)
+    {
+      ptr         = allocate(MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES);
+      _last_pages = Pages::huge;
+    }
+    if(!ptr)
+    {
+      ptr         = allocate(MEM_RESERVE | MEM_COMMIT);
+      _last_pages = Pages::base;
+    }
+    if(!ptr)
+      throw std::bad_alloc{};
+#else
+    ptr = MAP_FAILED;
+#if defined(MAP_HUGETLB)
+    if(_options.huge_pages)
+    {
+      ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      _last_pages = Pages::huge;
+    }
+#endif
+    if(ptr == MAP_FAILED)
+    {
+      ptr         = map_aligned(size);
+      _last_pages = Pages::base;
+#if defined(MADV_HUGEPAGE)
+      if(_options.huge_pages && !madvise(ptr, size, MADV_HUGEPAGE))
+        _last_pages = Pages::transparent_huge;
+      else if(!_options.huge_pages)
+        madvise(ptr, size, MADV_NOHUGEPAGE);
+#endif
+    }
+#if defined(__linux__) && defined(SYS_mbind)
+    // The policy has to be set before the pages are touched. Mappings stay usable when it fails
+    constexpr int mpol_bind = 2, mpol_interleave = 3;
+    if(_options.numa != NumaPlacement::any)
+    {
+      const unsigned long nodes = _options.numa_nodes;
+      syscall(SYS_mbind,
+              ptr,
+              size,
+              _options.numa == NumaPlacement::bind ? mpol_bind : mpol_interleave,
+              &nodes,
+              sizeof(nodes) * 8,
+              0);
+    }
+#endif
+#endif
+    return ptr;
+  }
+
+  void do_deallocate(void * ptr, const size_t bytes, size_t) override
+  {
+#if defined(_WIN32)
+    static_cast<void>(bytes);
+    VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+    munmap(ptr, mapped_bytes(bytes));
+#endif
+  }
+
+  bool do_is_equal(const std::pmr::memory_resource & other) const noexcept override { return this == &other; }
+
+#if !defined(_WIN32)
+  // Transparent huge pages only back huge page aligned ranges, so a bigger range is mapped and trimmed
+  void * map_aligned(const size_t size) const
+  {
+    const size_t alignment = _options.huge_pages ? huge_page_size : 0;
+    void * const mapping =
+      mmap(nullptr, size + alignment, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mapping == MAP_FAILED)
+      throw std::bad_alloc{};
+
+    if(!alignment)
+      return mapping;
+    char * const    first   = static_cast<char *>(mapping);
+    const uintptr_t address = reinterpret_cast<uintptr_t>(first);
+    char * const    aligned = first + ((alignment - address % alignment) % alignment);
+    const size_t    head    = static_cast<size_t>(aligned - first);
+    if(head)
+      munmap(first, head);
+    if(head != alignment)
+      munmap(aligned + size, alignment - head);
+    return aligned;
+  }
+#endif
+};
+
+}
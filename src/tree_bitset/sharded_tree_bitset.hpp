@@ -0,0 +1,58 @@
+#pragma once
+#include <limits>
+#include <cinttypes>
+#include <atomic>
+#include <deque>
+
+#include "concurrent_tree_bitset.hpp"
+
+namespace treebitset {
+// Concurrent bitset whose id space is split into 2^shards_exp shards, so threads which obtain ids from
+// different shards don't share any blocks. Id = shard index << shard exp_max | id within the shard.
+//
+// Threads obtain ids from their home shard and only steal from the nearest shard after it which has free
+// ids, according to a summary bitmask of the shards, when it runs out of them. Freed ids go back to their
+// shard. Same policies as ConcurrentTreeBitset are supported
+template <typename Config = DefaultTreeBitsetConfig>
+class ShardedTreeBitset
+{
+  using Shard = ConcurrentTreeBitset<Config>;
+
+public:
+  using block_t = typename Config::block_t;
+
+  constexpr static inline size_t invalid_id = std::numeric_limits<size_t>::max();
+  constexpr static inline size_t max_shards = std::numeric_limits<uint64_t>::digits;
+
+  // Sharded tree bitset will have a capacity for 2^exp_max elements split into 2^shards_exp shards
+  ShardedTreeBitset(const size_t exp_max, const size_t shards_exp);
+
+  // Get value of bit id
+  inline bool is_free(const size_t id) const;
+  // Set bit id value
+  inline void set_free(const size_t id, const bool free);
+  // Obtain a free id from the home shard or steal it from another one. Home shards are assigned to threads
+  // round-robin in the order of their first call
+  inline size_t obtain_id();
+  // Same with the home shard chosen by the caller, e.g. by the worker thread index
+  size_t obtain_id(const size_t home_shard);
+
+  // Free all ids. Must not run concurrently with the other calls
+  void clean();
+
+  inline size_t num_shards() const;
+  inline size_t max_elements() const;
+
+private:
+  std::deque<Shard> _shards;
+  size_t            _shard_exp_max;
+  // Bit n is set when shard n might have free ids. It's unset by the threads which find the shard empty
+  alignas(detail::cache_line_bytes) std::atomic<uint64_t> _shards_with_free_ids;
+
+  inline uint64_t all_shards_mask() const;
+  // Unset the summary bit of a shard which has run out of free ids, unless it's been refilled meanwhile
+  inline void     mark_shard_empty(const size_t shard_idx);
+  inline size_t   obtain_from_shard(const size_t shard_idx);
+};
+}
+#include "detail/sharded_tree_bitset.hpp"
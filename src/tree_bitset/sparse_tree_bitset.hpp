@@ -0,0 +1,130 @@
+#pragma once
+#include <limits>
+#include <cinttypes>
+#include <memory>
+#include <vector>
+#include <array>
+
+#include "detail/bit"
+#include "detail/math_utils.hpp"
+#include "detail/tree_layout.hpp"
+#include "detail/zeroed_memory.hpp"
+
+#include "config.hpp"
+
+#undef max
+#undef min
+
+namespace treebitset {
+// TreeBitset for huge sparse id spaces, such as 2^40 object ids. Data blocks are allocated by page-aligned
+// leaf pages of leaf_page_bytes when an id of the page gets used for the first time. Once all of their ids
+// are free again the pages are given back to the OS and kept only as address space for reuse. Missing pages
+// have all of their ids free.
+//
+// Metadata levels are dense, but only as big as the data level needs, and their bits are stored inverted: a
+// set bit means the child has no free ids. Both they and the leaf page directory are placed in zeroed pages
+// mapped from the OS, so only the pages which track the used ids are backed by memory.
+//
+// Only the default storage layout is supported. There's no max_used_id(), as it would need the used ids tree
+template <typename Config = DefaultTreeBitsetConfig>
+class SparseTreeBitset : Config
+{
+public:
+  using block_t = typename Config::block_t;
+  static_assert(sizeof(block_t) > 1, "block size must be bigger than 1 byte!");
+  static_assert(Config::template get<FreeBitPolicy>() == FreeBitPolicy::one &&
+                  Config::template get<UsedIDsTreePolicy>() == UsedIDsTreePolicy::none &&
+                  Config::template get<StorageInitPolicy>() == StorageInitPolicy::eager &&
+                  Config::template get<StoragePolicy>() == StoragePolicy::owning &&
+                  Config::template get<MetadataNodePolicy>() == MetadataNodePolicy::block,
+                "sparse tree bitset only supports the default storage layout");
+
+  constexpr static inline size_t invalid_id       = std::numeric_limits<size_t>::max();
+  constexpr static inline size_t bits_per_block   = std::numeric_limits<block_t>::digits;
+  constexpr static inline size_t leaf_page_bytes  = 4096;
+  constexpr static inline size_t leaf_page_blocks = leaf_page_bytes / sizeof(block_t);
+
+  // Sparse tree bitset will have a capacity for 2^exp_max elements, all of them free
+  SparseTreeBitset(const size_t exp_max);
+
+  // Get value of bit id
+  inline bool is_free(const size_t id) const;
+  // Set bit id value
+  inline void set_free(const size_t id, const bool free);
+  // Find the first free bit id, unset it and get the id
+  size_t obtain_id();
+
+  // Free all ids and release all leaf pages
+  void clean();
+
+  // Number of the allocated leaf pages
+  inline size_t  num_leaf_pages() const;
+  inline uint8_t num_metadata_levels() const;
+  inline size_t  num_element_blocks() const;
+  inline size_t  max_elements() const;
+
+private:
+  // Leaf page is exactly a page-aligned page of blocks, its bookkeeping is kept in the directory
+  struct alignas(leaf_page_bytes) LeafPage
+  {
+    block_t blocks[leaf_page_blocks];
+  };
+  static_assert(sizeof(LeafPage) == leaf_page_bytes);
+
+  // Directory slot holds the page address and the number of the page blocks which have used ids in its low
+  // bits, which are zero in the address of a page-aligned page
+  using LeafPageSlot = uintptr_t;
+  constexpr static inline LeafPageSlot slot_count_mask = leaf_page_bytes - 1;
+  static_assert(leaf_page_blocks <= slot_count_mask);
+
+  struct ZeroedDeleter
+  {
+    size_t bytes = 0;
+
+    template <typename T>
+    void operator()(T * ptr) const
+    {
+      detail::deallocate_zeroed(ptr, bytes);
+    }
+  };
+
+  constexpr static inline size_t  bits_per_block_log2   = math::int_log2(bits_per_block);
+  constexpr static inline size_t  leaf_page_blocks_log2 = math::int_log2(leaf_page_blocks);
+  constexpr static inline block_t all_bits_set          = static_cast<block_t>(~block_t{0});
+  constexpr static inline size_t  leaf_slab_pages       = 64;
+  // Only slabs mapped from the OS can give the pages of the released leaf pages back
+  static_assert(leaf_slab_pages * leaf_page_bytes >= detail::min_zeroed_pages_allocation);
+
+  size_t  _max_elements;
+  size_t  _num_element_blocks;
+  uint8_t _num_metadata_levels;
+  // Offsets of the metadata levels and the size of all of them after the last one
+  std::array<size_t, std::numeric_limits<size_t>::digits + 1> _metadata_level_offsets{};
+  // Bits of the only data block which exist when there're no metadata levels
+  block_t _data_block_mask;
+
+  // Stored metadata bit is set when the child has no free ids
+  std::unique_ptr<block_t[], ZeroedDeleter>      _metadata;
+  std::unique_ptr<LeafPageSlot[], ZeroedDeleter> _leaf_page_directory;
+  // Leaf pages are handed out from slabs of zeroed pages mapped from the OS, so each of them takes a page
+  std::vector<std::unique_ptr<LeafPage[], ZeroedDeleter>> _leaf_slabs;
+  // Pages at the end of the last slab which haven't been handed out yet
+  size_t _num_fresh_slab_pages = 0;
+  // Released pages have all of their blocks zero, their memory is given back to the OS where possible
+  std::vector<LeafPage *> _free_leaf_pages;
+  size_t                  _num_leaf_pages = 0;
+
+  static inline LeafPage * slot_page(const LeafPageSlot slot);
+  inline block_t &  metadata_block(const uint8_t level, const size_t block_idx);
+  // Stored data block holds the used bits, the missing ones are zero
+  inline block_t    data_block(const size_t block_idx) const;
+  inline block_t &  allocated_data_block(const size_t block_idx, LeafPageSlot *& slot);
+  inline void       allocate_leaf_page(const size_t page_idx);
+  inline void       release_leaf_page(const size_t page_idx);
+  // Set the ancestor bits of a block which has got all of its ids used
+  inline void       propagate_full(const size_t block_idx);
+  // Unset the ancestor bits of a full block which has got a free id
+  inline void       propagate_not_full(const size_t block_idx);
+};
+}
+#include "detail/sparse_tree_bitset.hpp"
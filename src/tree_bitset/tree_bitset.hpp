@@ -2,19 +2,39 @@
 #include <limits>
 #include <cinttypes>
 #include <memory>
+#include <memory_resource>
 #include <algorithm>
+#include <array>
 
 #include "detail/bit"
 #include "detail/math_utils.hpp"
 #include "detail/bit_rle_pack.hpp"
+#include "detail/zeroed_memory.hpp"
+#include "detail/tree_layout.hpp"
+#include "detail/node_search.hpp"
+#include "detail/prefetch.hpp"
+#include "detail/mapped_file.hpp"
 
 #include "config.hpp"
 
 #undef max
+#undef min
 
 namespace treebitset {
-template <typename Config = DefaultTreeBitsetConfig>
-class TreeBitset : Config
+// Capacity of a TreeBitset which isn't a power of two, see the TreeBitset constructors
+struct MaxElements
+{
+  size_t value;
+};
+
+// ExpMax sets a compile-time capacity of 2^ExpMax elements, see StaticTreeBitset
+template <typename Config = DefaultTreeBitsetConfig, size_t ExpMax = detail::dynamic_exp_max>
+class TreeBitset
+  : Config
+  , detail::TreeBitsetLayout<
+      std::numeric_limits<typename Config::block_t>::digits,
+      detail::metadata_node_blocks<typename Config::block_t>(Config::template get<MetadataNodePolicy>()),
+      ExpMax>
 {
   class IDIterator;
 
@@ -25,24 +45,96 @@ public:
   constexpr static inline size_t invalid_id     = std::numeric_limits<size_t>::max();
   constexpr static inline size_t bits_per_block = std::numeric_limits<block_t>::digits;
 
-  // Tree bitset will have a capacity for 2^exp_max elements
+  // Tree bitset will have a capacity for 2^exp_max elements. Storage is either owned or allocated from the
+  // default memory resource, depending on StoragePolicy
   TreeBitset(const size_t exp_max);
+  // Tree bitset of any capacity. Ids of the last data block past max_elements are kept used and the metadata
+  // nodes past it aren't stored, so only the ids below it are ever obtained
+  TreeBitset(const MaxElements max_elements);
+  // Tree bitset with the compile-time capacity
+  TreeBitset();
+  // StoragePolicy::external: storage is placed in the buffer of required_blocks(exp_max) blocks
+  TreeBitset(const size_t exp_max, block_t * buffer);
+  TreeBitset(const MaxElements max_elements, block_t * buffer);
+  // StoragePolicy::memory_resource: storage is allocated from the resource, which must outlive the bitset
+  TreeBitset(const size_t exp_max, std::pmr::memory_resource * resource);
+  TreeBitset(const MaxElements max_elements, std::pmr::memory_resource * resource);
+  // StoragePolicy::mapped_file: storage is mapped from the file at path. An existing file is opened as is,
+  // a new one is created with all ids free. Throws when the file holds a bitset of another configuration
+  TreeBitset(const size_t exp_max, const char * path);
+  TreeBitset(const MaxElements max_elements, const char * path);
+
+  // Number of blocks of the storage needed for a capacity of 2^exp_max/max_elements elements
+  constexpr static size_t required_blocks(const size_t exp_max);
+  constexpr static size_t required_blocks(const MaxElements max_elements);
 
   // Get value of bit id
   inline bool is_free(const size_t id) const;
   // Set bit id value
   inline void set_free(const size_t id, const bool free);
-  // Bulk-set many bit values
+  // Bulk-set values of bits in [min_id, max_id] range
   void set_free_for_range(const size_t min_id, const size_t max_id, const bool value);
+  // Set values of the bits with ids from [first, last). With PrefetchPolicy::ancestors the paths of the next
+  // ids are prefetched while the current one is updated
+  template <typename ForwardIt>
+  void set_free_for_ids(ForwardIt first, const ForwardIt last, const bool value);
 
   // Find the first free bit id, unset it and get the id
   size_t obtain_id();
+  // Find the first free bit id at or after hint, or the nearest one before it. Unset it and get the id
+  size_t obtain_id_near(const size_t hint);
+  // Obtain up to n first free bit ids and write them to out in ascending order. Returns the obtained count
+  template <typename OutputIt>
+  size_t obtain_ids(const size_t n, OutputIt out);
+
+  // Find the first free/used bit id which is >= id or invalid_id if there's none. Free bit lookups are
+  // logarithmic. Used bit lookups are logarithmic only with UsedIDsTreePolicy::maintain, otherwise they scan
+  // the data blocks, which is O(num_element_blocks): up to max_used_id, or up to the capacity with
+  // on_demand_max_id_calc
+  size_t find_next_free(const size_t id) const;
+  size_t find_next_used(const size_t id) const;
+  // Find the last free/used bit id which is <= id or invalid_id if there's none. Same costs, the
+  // used bit scan runs from min(id, max_used_id) down to the first data block
+  size_t find_prev_free(const size_t id) const;
+  size_t find_prev_used(const size_t id) const;
 
   // Free all ids
   void clean();
 
+  // Increase the capacity to 2^new_exp_max elements, keeping the values of the existing bits and freeing the
+  // new ones. The existing levels are copied into the bigger storage and the new root levels are added above
+  // them. storage_args are passed to the constructor after exp_max, memory_resource storage is allocated from
+  // the current resource when they're omitted
+  template <typename... StorageArgs>
+  void grow(const size_t new_exp_max, StorageArgs... storage_args);
+  // Decrease the capacity to the smallest power of two which covers max_used_id() and release the rest of the
+  // storage. Does nothing when the capacity isn't bigger than that. storage_args are the same as the grow()
+  // ones
+  template <typename... StorageArgs>
+  void shrink_to_fit(StorageArgs... storage_args);
+  // Bytes of the storage held by the metadata and data levels, the used ids tree and the lazy initialization
+  // epochs
+  inline size_t memory_footprint() const;
+
+  // StoragePolicy::mapped_file: write the blocks modified since the last sync and max_used_id to the file
+  void sync();
+
   IDIterator used_ids_iter() const;
 
+  // UsedCountPolicy::maintain: number of the used/free ids
+  inline size_t used_count() const;
+  inline size_t free_count() const;
+  // UsedCountPolicy::maintain: number of the used ids in [min_id, max_id] range, it's rank(max_id + 1) -
+  // rank(min_id)
+  size_t count_used(const size_t min_id, const size_t max_id) const;
+  // UsedCountPolicy::maintain: number of the used ids below id, all of them for id >= max_elements(). Sums
+  // the counts of up to node_bits - 1 siblings before the path on every level, so it's
+  // O(node_bits * num_metadata_levels()) rather than logarithmic
+  size_t rank(const size_t id) const;
+  // UsedCountPolicy::maintain: the used id with k used ids below it or invalid_id if there're no more than k
+  // used ids. Descends along the node counts, so it's O(node_bits * num_metadata_levels()) as well
+  size_t select(size_t k) const;
+
   inline size_t max_used_id() const;
 
   inline uint8_t num_metadata_levels() const;
@@ -53,36 +145,195 @@ public:
   template <typename AddAbbreviationCallback, typename AddPackedBlockCallback>
   void pack(AddAbbreviationCallback abbrev_cb, AddPackedBlockCallback block_cb) const;
 
+  // storage_args are passed to the constructor after exp_max/max_elements. Capacity has to be the one of the
+  // packed bitset, as it determines the storage layout
+  template <typename... StorageArgs>
   static TreeBitset unpack(const size_t               exp_max,
                            const block_t *            packed_blocks,
                            const RLEBitAbbreviation * abbreviations,
-                           size_t                     abbreviations_count);
+                           size_t                     abbreviations_count,
+                           StorageArgs... storage_args);
+  template <typename... StorageArgs>
+  static TreeBitset unpack(const MaxElements          max_elements,
+                           const block_t *            packed_blocks,
+                           const RLEBitAbbreviation * abbreviations,
+                           size_t                     abbreviations_count,
+                           StorageArgs... storage_args);
 
-  template <typename C>
-  friend inline bool operator==(const TreeBitset<C> & lhs, const TreeBitset<C> & rhs);
+  template <typename C, size_t E>
+  friend inline bool operator==(const TreeBitset<C, E> & lhs, const TreeBitset<C, E> & rhs);
 
-  template <typename C>
-  friend inline bool operator!=(const TreeBitset<C> & lhs, const TreeBitset<C> & rhs);
+  template <typename C, size_t E>
+  friend inline bool operator!=(const TreeBitset<C, E> & lhs, const TreeBitset<C, E> & rhs);
 
 private:
   friend class IDIterator;
 
+  // Metadata nodes of node_blocks blocks track node_bits children each
+  constexpr static inline size_t node_blocks =
+    detail::metadata_node_blocks<block_t>(Config::template get<MetadataNodePolicy>());
+  constexpr static inline size_t node_bits      = node_blocks * bits_per_block;
+  constexpr static inline size_t node_bits_log2 = math::int_log2(node_bits);
+  // Nodes shouldn't cross cache lines
+  constexpr static inline size_t storage_alignment = node_blocks * sizeof(block_t);
+
+  using Layout = detail::TreeBitsetLayout<bits_per_block, node_blocks, ExpMax>;
+  using Layout::_num_metadata_blocks;
+  using Layout::_num_element_blocks;
+  using Layout::_num_metadata_levels;
+  using Layout::_max_elements;
+  using Layout::calculate_constants;
+
+  constexpr static inline bool   is_static_capacity  = ExpMax != detail::dynamic_exp_max;
   constexpr static inline size_t bits_per_block_log2 = math::int_log2(bits_per_block);
+  constexpr static inline bool   has_used_ids_tree =
+    Config::template get<UsedIDsTreePolicy>() == UsedIDsTreePolicy::maintain;
+  constexpr static inline bool   keeps_max_id_current =
+    Config::template get<MaxIDPolicy>() == MaxIDPolicy::keep_max_id_current;
+  constexpr static inline bool   zero_means_free =
+    Config::template get<FreeBitPolicy>() == FreeBitPolicy::zero;
+  constexpr static inline bool   lazy_init =
+    Config::template get<StorageInitPolicy>() == StorageInitPolicy::lazy;
+  constexpr static inline bool   prefetches_ancestors =
+    Config::template get<PrefetchPolicy>() == PrefetchPolicy::ancestors;
+  constexpr static inline bool   counts_used =
+    Config::template get<UsedCountPolicy>() == UsedCountPolicy::maintain;
+  // Used counts are 64-bit, so each of them takes several blocks
+  constexpr static inline size_t used_count_blocks = sizeof(uint64_t) / sizeof(block_t);
+  // Number of ids whose paths set_free_for_ids keeps in flight
+  constexpr static inline size_t prefetch_distance = 8;
+  // Lazily initialized storage is tracked by page-sized chunks of blocks
+  constexpr static inline size_t lazy_init_chunk_blocks_log2 = math::int_log2(4096 / sizeof(block_t));
+  // Stored free tree and data blocks are XORed with it to get the logical "1 means free" blocks
+  constexpr static inline block_t inverted_bits_mask =
+    zero_means_free ? static_cast<block_t>(~block_t{0}) : block_t{0};
+
+  constexpr static inline StoragePolicy storage_policy = Config::template get<StoragePolicy>();
+  constexpr static inline bool          is_mapped_file = storage_policy == StoragePolicy::mapped_file;
+  // Policies which the stored blocks depend on. A file can only be opened with the same ones
+  constexpr static inline uint64_t file_policies =
+    static_cast<uint64_t>(Config::template get<MaxIDPolicy>()) |
+    static_cast<uint64_t>(Config::template get<FreeBitPolicy>()) << 8 |
+    static_cast<uint64_t>(Config::template get<UsedIDsTreePolicy>()) << 16 |
+    static_cast<uint64_t>(Config::template get<StorageInitPolicy>()) << 24 |
+    static_cast<uint64_t>(Config::template get<MetadataNodePolicy>()) << 32 |
+    static_cast<uint64_t>(Config::template get<UsedCountPolicy>()) << 40;
+  static_assert(!is_static_capacity || storage_policy == StoragePolicy::owning,
+                "storage of the compile-time capacity is always placed inline");
+  // Both the zero polarity and the lazy initialization benefit from the pages which are zeroed by the OS
+  constexpr static inline bool owns_zeroed_pages =
+    !is_static_capacity && storage_policy == StoragePolicy::owning && (zero_means_free || lazy_init);
+
+  struct StorageDeleter
+  {
+    size_t                      bytes    = 0;
+    std::pmr::memory_resource * resource = nullptr;
 
-  std::unique_ptr<block_t[]> _storage;
-  size_t                     _max_used_id = invalid_id;
+    inline void operator()(block_t * ptr) const;
+  };
+  using storage_t = std::conditional_t<
+    is_static_capacity,
+    std::array<block_t,
+               detail::required_blocks<bits_per_block, node_blocks>(
+                 detail::pow2_capacity(is_static_capacity ? ExpMax : 0),
+                 has_used_ids_tree,
+                 counts_used,
+                 lazy_init,
+                 lazy_init_chunk_blocks_log2)>,
+    std::unique_ptr<block_t[], StorageDeleter>>;
 
-  // These fields are constant throughout object lifetime
-  size_t  _num_metadata_blocks;
-  size_t  _num_element_blocks;
-  uint8_t _num_metadata_levels;
-  size_t  _max_elements;
+  alignas(storage_alignment) storage_t _storage;
+  size_t    _max_used_id = invalid_id;
 
-  inline void    calculate_constants(const size_t exp_max);
-  inline block_t max_element_mask() const;
-  inline size_t  num_metadata_blocks_on_level(const uint8_t level) const;
+  // A chunk of lazily initialized storage is initialized when its epoch matches the current one, so clean()
+  // only needs to bump the current epoch. Epochs are stored right after the storage blocks
+  block_t _init_epoch = 0;
+  // StoragePolicy::mapped_file: chunks of the storage which sync() has to flush
+  std::conditional_t<is_mapped_file, detail::DirtyChunks, detail::NoDirtyChunks> _dirty_chunks;
+
+  inline void            init_storage();
+  // Unset the bits of the nonexisting children and ids. Nonexisting ids are used ones for the used ids tree
+  inline void            mask_nonexisting();
+  // Call f(height, block_idx, mask) for the blocks of the last nodes which have nonexisting children or ids.
+  // Height 0 is the data level, block_idx is the block index on the level and mask has the existing bits
+  template <typename F>
+  inline void            for_each_partial_block(F && f) const;
+  // New bitset of the capacity of 2^new_exp_max elements with the same kind of storage, all ids are free
+  template <typename... StorageArgs>
+  TreeBitset             resized(const size_t new_exp_max, StorageArgs... storage_args) const;
+  // Copy the levels to the bitset of another capacity, see grow() and shrink_to_fit()
+  void                   copy_tree_to(TreeBitset & dst) const;
+  inline block_t *       blocks();
+  inline const block_t * blocks() const;
+  inline block_t *       chunk_init_epochs();
+  inline const block_t * chunk_init_epochs() const;
+  // Header of the mapped file which precedes the storage
+  inline detail::MappedFileHeader * file_header();
+  // Record the storage blocks which have to be flushed by sync()
+  inline void            mark_dirty(const size_t first_idx, const size_t last_idx);
+  // Mask of the existing ids of the last data block
+  inline block_t         last_element_block_mask() const;
+  constexpr static size_t num_metadata_blocks_on_level(const uint8_t level);
+  constexpr static size_t metadata_level_offset(const uint8_t level);
+  // Offset of the level which is height levels above the data level, so the levels of different capacities
+  // can be matched
+  inline size_t          level_offset_at_height(const uint8_t height) const;
+  inline size_t  used_ids_tree_offset() const;
+  // Used count of a metadata node is at its index among all metadata nodes, root's one is at 0
+  inline size_t  used_counts_offset() const;
+  inline size_t  num_storage_blocks() const;
+  // Call f(lvl_idx) for lvl_idx in [0, _num_metadata_levels) while it returns true. For the compile-time
+  // capacity lvl_idx is an std::integral_constant and the loop is unrolled
+  template <typename F>
+  inline void for_each_metadata_level(F && f) const;
+  inline block_t raw_block(const size_t storage_idx) const;
+  inline void    initialize_chunk(const size_t chunk_idx);
+  inline void    initialize_blocks(const size_t first_idx, const size_t last_idx, const bool overwritten);
+  // Copy count blocks of this bitset's storage starting at src_idx to the storage of dst at dst_idx
+  inline void    copy_blocks_to(TreeBitset & dst, size_t src_idx, size_t dst_idx, size_t count) const;
+  template <bool UsedIDsTree = false>
+  inline block_t load_block(const size_t storage_idx) const;
+  template <bool UsedIDsTree = false>
+  inline void    store_block(const size_t storage_idx, const block_t value);
+  // Bits of the metadata node which starts at storage_idx: the first set one and the nearest set one at or
+  // after from_bit/before end_bit. node_bits if there's none
+  template <bool UsedIDsTree = false>
+  inline size_t  first_set_bit_in_node(const size_t storage_idx) const;
+  template <bool UsedIDsTree = false>
+  inline size_t  next_set_bit_in_node(const size_t storage_idx, const size_t from_bit) const;
+  template <bool UsedIDsTree = false>
+  inline size_t  prev_set_bit_in_node(const size_t storage_idx, const size_t end_bit) const;
+  template <bool UsedIDsTree = false>
+  inline bool    node_is_empty(const size_t storage_idx) const;
+  // The root is either the first metadata node or the only data block
+  inline bool    root_is_empty() const;
+  template <bool UsedIDsTree = false>
   inline void    update_metadata(const size_t id, const bool all_bits_value);
+  // Prefetch the data block of id and its ancestors in both metadata trees
+  inline void    prefetch_path(const size_t id) const;
+  inline void    set_free_without_prefetch(const size_t id, const bool value);
+  inline void    track_max_used_id(const size_t used_id);
   inline size_t  find_new_smaller_max_used_id() const;
+  // Used bits of the data block, the nonexisting ids of the last one aren't used ones
+  inline block_t used_element_bits(const size_t element_block_idx) const;
+
+  inline uint64_t load_used_count(const size_t node_idx) const;
+  inline void     store_used_count(const size_t node_idx, const uint64_t count);
+  // Add delta to the used counts of the metadata nodes on the path of id
+  inline void     update_used_counts(const size_t id, const int64_t delta);
+  // Sum the used counts of the metadata nodes over the data blocks [first_block, last_block] from their
+  // children again
+  void            recount_used(const size_t first_block, const size_t last_block);
+
+  // Used ids are looked up in the used ids tree, free ids - in the default metadata tree
+  template <bool Used>
+  size_t find_next_in_tree(const size_t id) const;
+  template <bool Used>
+  size_t find_prev_in_tree(const size_t id) const;
 };
+
+// TreeBitset with a compile-time capacity of 2^ExpMax elements and storage placed inline
+template <typename Config, size_t ExpMax>
+using StaticTreeBitset = TreeBitset<Config, ExpMax>;
 }
 #include "detail/tree_bitset.hpp"